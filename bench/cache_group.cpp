@@ -0,0 +1,137 @@
+/*
+MIT License
+
+Copyright © 2016 David Curtis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <memory>
+#include "../include/lru_cache_group.h"
+
+using namespace utils;
+
+// Compares eight caches that split a budget equally with the same caches in a cache_group. Each
+// cache's requests are uniformly distributed over its own working set, from 512 to 65536 keys, so
+// its miss-ratio curve has a cliff at the working set size; halfway through the trace, the working
+// sets are reversed. The group rebalances every 64K requests. Reports the total misses in each half,
+// and the time per request (which includes the cost of sampling and rebalancing).
+
+using static_cache_type = lru_cache<std::uint64_t, std::uint64_t, std::hash<std::uint64_t>, std::equal_to<std::uint64_t>,
+	cache_policies<lru_eviction, counting_stats>>;
+using group_cache_type = lru_cache<std::uint64_t, std::uint64_t, std::hash<std::uint64_t>, std::equal_to<std::uint64_t>,
+	cache_policies<lru_eviction, mrc_stats>>;
+
+static const std::size_t cache_count = 8;
+static const std::size_t budget = cache_count * 4096;
+static const std::size_t request_count = 1 << 23;
+static const std::size_t rebalance_interval = 1 << 16;
+
+class request
+{
+public:
+	std::size_t		cache_;
+	std::uint64_t	key_;
+};
+
+static std::vector<request> make_trace()
+{
+	std::mt19937_64 rng(42);
+	std::vector<request> trace(request_count);
+	for (std::size_t i = 0; i < request_count; ++i)
+	{
+		auto cache = rng() % cache_count;
+		auto working_set = std::size_t{512} << ((i < request_count / 2) ? cache : cache_count - 1 - cache);
+		trace[i].cache_ = cache;
+		trace[i].key_ = (cache << 32) | (rng() % working_set);
+	}
+	return trace;
+}
+
+static void enroll(static_cache_type&, cache_group*)
+{}
+
+static void enroll(group_cache_type& cache, cache_group* group)
+{
+	group->add(cache);
+}
+
+template<class Cache>
+static void replay(const char* name, const std::vector<request>& trace, cache_group* group)
+{
+	std::vector<std::unique_ptr<Cache>> caches;
+	for (std::size_t i = 0; i < cache_count; ++i)
+	{
+		caches.emplace_back(new Cache([] (const std::uint64_t& key, typename Cache::miss_handler_reply_f reply)
+		{
+			reply(typename Cache::value_uptr_t(new std::uint64_t(key)), std::error_code());
+		}, budget / cache_count));
+		enroll(*caches.back(), group);
+	}
+	
+	auto misses = [&] ()
+	{
+		std::uint64_t total = 0;
+		for (auto& cache : caches)
+		{
+			total += cache->stats().misses();
+		}
+		return total;
+	};
+	
+	std::uint64_t first_half = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < trace.size(); ++i)
+	{
+		caches[trace[i].cache_]->get(trace[i].key_, [] (typename Cache::const_iterator, std::error_code) {});
+		if (group && (i + 1) % rebalance_interval == 0)
+		{
+			group->rebalance();
+		}
+		if (i + 1 == trace.size() / 2)
+		{
+			first_half = misses();
+		}
+	}
+	auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	
+	std::cout << name << ": misses " << first_half << " + " << misses() - first_half << ", "
+		<< elapsed / trace.size() << " ns/request, limits";
+	for (auto& cache : caches)
+	{
+		std::cout << " " << cache->limit();
+	}
+	std::cout << std::endl;
+}
+
+int main(int argc, const char * argv[])
+{
+	auto trace = make_trace();
+	
+	replay<static_cache_type>("equal split", trace, nullptr);
+	
+	cache_group group(budget);
+	replay<group_cache_type>("cache group", trace, &group);
+	
+	return 0;
+}
@@ -0,0 +1,123 @@
+/*
+MIT License
+
+Copyright © 2016 David Curtis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "../include/lru_cache.h"
+
+using namespace utils;
+
+// Replays a mixed-cost trace against LRU and GreedyDual-Size-Frequency eviction at several cache
+// sizes, and reports the total cost of the misses. Keys are Zipf-distributed (s = 0.9); one key in
+// eight is remote, and costs 100 times as much to fetch as a local one. The costs are supplied with
+// a cost function, as the miss handler here doesn't actually fetch anything.
+
+using lru_cache_type = lru_cache<std::uint64_t, std::uint64_t>;
+using gdsf_cache_type = lru_cache<std::uint64_t, std::uint64_t, std::hash<std::uint64_t>, std::equal_to<std::uint64_t>, cache_policies<gdsf_eviction>>;
+
+static const std::size_t key_count = 1 << 17;
+static const std::size_t request_count = 1 << 22;
+static const double remote_cost = 100;
+static const double local_cost = 1;
+
+static double cost_of(std::uint64_t key)
+{
+	return ((key * 0x9E3779B97F4A7C15ull) >> 60) < 2 ? remote_cost : local_cost;
+}
+
+static std::vector<std::uint64_t> make_trace()
+{
+	std::vector<double> cdf(key_count);
+	double sum = 0;
+	for (std::size_t i = 0; i < key_count; ++i)
+	{
+		sum += 1.0 / std::pow(static_cast<double>(i + 1), 0.9);
+		cdf[i] = sum;
+	}
+	for (auto& c : cdf)
+	{
+		c /= sum;
+	}
+	
+	// the ranks are scattered over the key space, so that popularity and cost are independent
+	
+	std::mt19937_64 rng(42);
+	std::uniform_real_distribution<double> dist(0.0, 1.0);
+	std::vector<std::uint64_t> trace(request_count);
+	for (auto& key : trace)
+	{
+		auto rank = static_cast<std::uint64_t>(std::lower_bound(cdf.begin(), cdf.end(), dist(rng)) - cdf.begin());
+		key = (rank * 0xD6E8FEB86659FD93ull) >> 17;
+	}
+	return trace;
+}
+
+template<class Cache>
+static void replay(const char* name, std::size_t size, const std::vector<std::uint64_t>& trace, double& total_cost, double& miss_ratio)
+{
+	double cost = 0;
+	std::size_t misses = 0;
+	Cache cache([&] (const std::uint64_t& key, typename Cache::miss_handler_reply_f reply)
+	{
+		cost += cost_of(key);
+		++misses;
+		reply(typename Cache::value_uptr_t(new std::uint64_t(key)), std::error_code());
+	}, size);
+	cache.set_cost_function([] (const std::uint64_t& key, const std::uint64_t&, double)
+	{
+		return cost_of(key);
+	});
+	
+	auto start = std::chrono::steady_clock::now();
+	for (auto key : trace)
+	{
+		cache.get(key, [] (typename Cache::const_iterator, std::error_code) {});
+	}
+	auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	
+	total_cost = cost;
+	miss_ratio = static_cast<double>(misses) / trace.size();
+	std::cout << "  " << name << ": miss ratio " << miss_ratio << ", total miss cost " << cost
+		<< ", " << elapsed / trace.size() << " ns/request" << std::endl;
+}
+
+int main(int argc, const char * argv[])
+{
+	auto trace = make_trace();
+	
+	for (std::size_t size : {key_count / 64, key_count / 16, key_count / 4})
+	{
+		std::cout << "cache size " << size << std::endl;
+		double lru_cost, lru_misses, gdsf_cost, gdsf_misses;
+		replay<lru_cache_type>("LRU ", size, trace, lru_cost, lru_misses);
+		replay<gdsf_cache_type>("GDSF", size, trace, gdsf_cost, gdsf_misses);
+		std::cout << "  GDSF miss cost is " << 100.0 * gdsf_cost / lru_cost << "% of LRU's" << std::endl;
+	}
+	
+	return 0;
+}
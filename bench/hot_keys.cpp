@@ -0,0 +1,253 @@
+/*
+MIT License
+
+Copyright © 2016 David Curtis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <cmath>
+#include "../include/lru_hot_keys.h"
+
+using namespace utils;
+
+// Worker threads read a shared cache, owned by its own executor thread, with Zipf-distributed
+// keys (s = 1), keeping a fixed number of requests outstanding. Without replication, every request
+// is a task on the cache's executor; with it, requests for replicated keys are served on the
+// workers' own threads. Throughput should scale with the number of workers (up to the number of
+// cores) for the replicated head of the distribution.
+
+using bench_cache_type = lru_cache<std::uint64_t, std::uint64_t>;
+using replicator_type = hot_key_replicator<std::uint64_t, std::uint64_t>;
+
+static const std::size_t key_count = 1 << 20;
+static const std::size_t cache_size = 1 << 16;
+static const std::size_t requests_per_worker = 1 << 18;
+static const std::size_t outstanding = 32;
+
+class executor_thread
+{
+public:
+
+	executor_thread()
+	:
+	stopping_{false},
+	thread_{[this] () { run(); }}
+	{}
+	
+	~executor_thread()
+	{
+		post([this] () { stopping_ = true; });
+		thread_.join();
+	}
+	
+	void post(bench_cache_type::task_f task)
+	{
+		std::lock_guard<std::mutex> lock{mutex_};
+		tasks_.emplace_back(std::move(task));
+		ready_.notify_one();
+	}
+	
+private:
+
+	void run()
+	{
+		std::vector<bench_cache_type::task_f> tasks;
+		while (!stopping_)
+		{
+			{
+				std::unique_lock<std::mutex> lock{mutex_};
+				ready_.wait(lock, [this] () { return !tasks_.empty(); });
+				tasks.swap(tasks_);
+			}
+			for (auto& task : tasks)
+			{
+				task();
+			}
+			tasks.clear();
+		}
+	}
+	
+	bool										stopping_;
+	std::mutex									mutex_;
+	std::condition_variable						ready_;
+	std::vector<bench_cache_type::task_f>		tasks_;
+	std::thread									thread_;
+};
+
+static std::vector<std::uint64_t> zipf_keys(std::size_t count, std::uint64_t seed)
+{
+	static std::vector<double> cdf;
+	if (cdf.empty())
+	{
+		cdf.resize(key_count);
+		double sum = 0;
+		for (std::size_t i = 0; i < key_count; ++i)
+		{
+			sum += 1.0 / static_cast<double>(i + 1);
+			cdf[i] = sum;
+		}
+		for (auto& c : cdf)
+		{
+			c /= sum;
+		}
+	}
+	
+	std::mt19937_64 rng(seed);
+	std::uniform_real_distribution<double> dist(0.0, 1.0);
+	std::vector<std::uint64_t> keys(count);
+	for (auto& key : keys)
+	{
+		key = static_cast<std::uint64_t>(std::lower_bound(cdf.begin(), cdf.end(), dist(rng)) - cdf.begin());
+	}
+	return keys;
+}
+
+// run_workers returns requests per second over all workers; get(worker, key, done) starts
+// a request, and invokes done when it completes
+
+template<class Get>
+static double run_workers(std::size_t workers, const std::vector<std::vector<std::uint64_t>>& keys, Get get)
+{
+	std::vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+	for (std::size_t w = 0; w < workers; ++w)
+	{
+		threads.emplace_back([w, &keys, &get] ()
+		{
+			std::atomic<std::size_t> completed{0};
+			std::size_t issued = 0;
+			for (auto key : keys[w])
+			{
+				while (issued - completed.load(std::memory_order_acquire) >= outstanding)
+				{
+					std::this_thread::yield();
+				}
+				++issued;
+				get(w, key, [&completed] () { completed.fetch_add(1, std::memory_order_release); });
+			}
+			while (completed.load(std::memory_order_acquire) != issued)
+			{
+				std::this_thread::yield();
+			}
+		});
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return static_cast<double>(workers * requests_per_worker) / elapsed;
+}
+
+int main(int argc, const char * argv[])
+{
+	std::cout << std::thread::hardware_concurrency() << " hardware threads" << std::endl;
+	
+	std::vector<std::vector<std::uint64_t>> keys;
+	for (std::size_t w = 0; w < 8; ++w)
+	{
+		keys.push_back(zipf_keys(requests_per_worker, w + 1));
+	}
+	
+	auto extract = [] (const std::uint64_t* value, std::error_code err) { return value ? *value : 0; };
+	
+	for (std::size_t workers : {1, 2, 4, 8})
+	{
+		executor_thread executor;
+		auto post = [&executor] (bench_cache_type::task_f task) { executor.post(std::move(task)); };
+		auto inline_post = [] (bench_cache_type::task_f task) { task(); };
+		
+		bench_cache_type cache([] (const std::uint64_t& key, bench_cache_type::miss_handler_reply_f reply)
+		{
+			reply(bench_cache_type::value_uptr_t(new std::uint64_t(key)), std::error_code());
+		}, cache_size);
+		
+		double direct = run_workers(workers, keys, [&] (std::size_t, std::uint64_t key, std::function<void()> done)
+		{
+			post([&, key, done] ()
+			{
+				cache.get(key, inline_post,
+					[] (bench_cache_type::const_iterator it, std::error_code err) { return err ? 0 : *it; },
+					[done] (std::uint64_t) { done(); });
+			});
+		});
+		
+		// the replicator is created, and its readers used, on the cache's executor
+		
+		std::unique_ptr<replicator_type> replicator;
+		std::mutex created_mutex;
+		std::condition_variable created;
+		post([&] ()
+		{
+			std::lock_guard<std::mutex> lock{created_mutex};
+			replicator.reset(new replicator_type(cache, post));
+			replicator->attach();
+			created.notify_one();
+		});
+		{
+			std::unique_lock<std::mutex> lock{created_mutex};
+			created.wait(lock, [&] () { return replicator != nullptr; });
+		}
+		
+		std::vector<std::unique_ptr<replicator_type::reader>> readers;
+		for (std::size_t w = 0; w < workers; ++w)
+		{
+			readers.emplace_back(new replicator_type::reader(*replicator, inline_post));
+		}
+		
+		double replicated = run_workers(workers, keys, [&] (std::size_t w, std::uint64_t key, std::function<void()> done)
+		{
+			readers[w]->get(key, extract, [done] (std::uint64_t) { done(); });
+		});
+		
+		std::size_t hits = 0;
+		for (auto& reader : readers)
+		{
+			hits += reader->hits();
+		}
+		
+		std::cout << workers << " workers: " << direct / 1e6 << "M gets/s through the executor, " << replicated / 1e6
+			<< "M gets/s with replicas (" << 100.0 * hits / (workers * requests_per_worker) << "% replica hits, "
+			<< replicator->hot_count() << " keys replicated)" << std::endl;
+		
+		// the replicator is destroyed on the executor, which is drained first
+		
+		readers.clear();
+		std::atomic<bool> destroyed{false};
+		post([&] ()
+		{
+			replicator.reset();
+			destroyed = true;
+		});
+		while (!destroyed)
+		{
+			std::this_thread::yield();
+		}
+	}
+	
+	return 0;
+}
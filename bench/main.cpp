@@ -0,0 +1,110 @@
+/*
+MIT License
+
+Copyright © 2016 David Curtis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "../include/lru_cache.h"
+
+using namespace utils;
+
+using bench_cache_type = lru_cache<std::uint64_t, std::uint64_t>;
+
+static const std::size_t cache_size = 1 << 21;
+static const std::size_t lookup_count = 1 << 22;
+
+static void fill_cache(bench_cache_type& cache)
+{
+	for (std::uint64_t i = 0; i < cache_size; ++i)
+	{
+		cache.get(i, [] (bench_cache_type::const_iterator, std::error_code) {});
+	}
+}
+
+template<class F>
+static double time_ns_per_lookup(F f)
+{
+	auto start = std::chrono::steady_clock::now();
+	f();
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / lookup_count;
+}
+
+// Compares sequential calls to get() against get_many() over the same random sequence of
+// keys, all of which hit. The cache is sized well beyond the last-level cache, so most probes
+// miss in the CPU caches.
+
+int main(int argc, const char * argv[])
+{
+	bench_cache_type cache([] (const std::uint64_t& key, bench_cache_type::miss_handler_reply_f reply)
+	{
+		reply(bench_cache_type::value_uptr_t(new std::uint64_t(key)), std::error_code());
+	}, cache_size);
+	
+	fill_cache(cache);
+	
+	std::mt19937_64 rng(42);
+	std::uniform_int_distribution<std::uint64_t> dist(0, cache_size - 1);
+	std::vector<std::uint64_t> keys(lookup_count);
+	for (auto& key : keys)
+	{
+		key = dist(rng);
+	}
+	
+	std::uint64_t checksum = 0;
+	
+	double sequential = time_ns_per_lookup([&] ()
+	{
+		for (auto& key : keys)
+		{
+			cache.get(key, [&] (bench_cache_type::const_iterator it, std::error_code)
+			{
+				checksum += *it;
+			});
+		}
+	});
+	
+	std::cout << "sequential get():      " << sequential << " ns/lookup" << std::endl;
+	
+	for (std::size_t batch : {8, 16, 32, 64})
+	{
+		double batched = time_ns_per_lookup([&] ()
+		{
+			for (std::size_t i = 0; i < lookup_count; i += batch)
+			{
+				cache.get_many(keys.begin() + i, keys.begin() + i + batch, [&] (const std::uint64_t&, bench_cache_type::const_iterator it, std::error_code)
+				{
+					checksum += *it;
+				});
+			}
+		});
+		
+		std::cout << "get_many(), batch " << batch << ": " << batched << " ns/lookup (" << sequential / batched << "x)" << std::endl;
+	}
+	
+	std::cout << "checksum " << checksum << std::endl;
+	
+	return 0;
+}
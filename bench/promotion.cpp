@@ -0,0 +1,175 @@
+/*
+MIT License
+
+Copyright © 2016 David Curtis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "../include/lru_cache.h"
+
+using namespace utils;
+
+// Compares eager promotion with buffered promotion on a hit-heavy trace, at a cache size that fits
+// in the processor's caches and one that doesn't. Keys are Zipf-distributed (s = 1.1). Reports the
+// time per get, and, against the eager cache: the eviction victims that differ (which should be
+// none, since the buffer is applied before every eviction), and the fraction of the usage order that
+// differs at the end of the trace, before and after apply_promotions.
+
+template<std::size_t Capacity>
+using buffered_cache_type = lru_cache<std::uint64_t, std::uint64_t, std::hash<std::uint64_t>, std::equal_to<std::uint64_t>,
+	cache_policies<lru_eviction, no_stats, no_expiry, buffered_promotion<Capacity>>>;
+using eager_cache_type = lru_cache<std::uint64_t, std::uint64_t>;
+
+static const std::size_t key_count = 1 << 18;
+static const std::size_t request_count = 1 << 23;
+
+static std::vector<std::uint64_t> make_trace()
+{
+	std::vector<double> cdf(key_count);
+	double sum = 0;
+	for (std::size_t i = 0; i < key_count; ++i)
+	{
+		sum += 1.0 / std::pow(static_cast<double>(i + 1), 1.1);
+		cdf[i] = sum;
+	}
+	for (auto& c : cdf)
+	{
+		c /= sum;
+	}
+	
+	std::mt19937_64 rng(42);
+	std::uniform_real_distribution<double> dist(0.0, 1.0);
+	std::vector<std::uint64_t> trace(request_count);
+	for (auto& key : trace)
+	{
+		auto rank = static_cast<std::uint64_t>(std::lower_bound(cdf.begin(), cdf.end(), dist(rng)) - cdf.begin());
+		key = rank * 0xD6E8FEB86659FD93ull;
+	}
+	return trace;
+}
+
+class outcome
+{
+public:
+	std::vector<std::uint64_t>	victims_;
+	std::vector<std::uint64_t>	order_;
+	std::vector<std::uint64_t>	applied_order_;
+};
+
+template<class Cache>
+static std::unique_ptr<Cache> make_cache(std::size_t size)
+{
+	return std::unique_ptr<Cache>(new Cache([] (const std::uint64_t& key, typename Cache::miss_handler_reply_f reply)
+	{
+		reply(typename Cache::value_uptr_t(new std::uint64_t(key)), std::error_code());
+	}, size));
+}
+
+template<class Cache>
+static std::vector<std::uint64_t> order_of(const Cache& cache)
+{
+	std::vector<std::uint64_t> order;
+	for (auto it = cache.cbegin(); it != cache.cend(); ++it)
+	{
+		order.push_back(*it);
+	}
+	return order;
+}
+
+static double mismatch(const std::vector<std::uint64_t>& a, const std::vector<std::uint64_t>& b)
+{
+	std::size_t differing = 0;
+	for (std::size_t i = 0; i < a.size(); ++i)
+	{
+		if (i >= b.size() || a[i] != b[i])
+		{
+			++differing;
+		}
+	}
+	return a.empty() ? 0 : 100.0 * differing / a.size();
+}
+
+template<class Cache>
+static outcome replay(const char* name, const std::vector<std::uint64_t>& trace, std::size_t size, const outcome* eager)
+{
+	// timed without a removal listener
+	
+	auto timed = make_cache<Cache>(size);
+	auto start = std::chrono::steady_clock::now();
+	for (auto key : trace)
+	{
+		timed->get(key, [] (typename Cache::const_iterator, std::error_code) {});
+	}
+	auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	
+	outcome result;
+	auto cache = make_cache<Cache>(size);
+	cache->set_removal_listener([&] (typename Cache::removal_batch_t& batch)
+	{
+		for (auto& removed : batch)
+		{
+			result.victims_.push_back(removed.key());
+		}
+	});
+	for (auto key : trace)
+	{
+		cache->get(key, [] (typename Cache::const_iterator, std::error_code) {});
+	}
+	result.order_ = order_of(*cache);
+	cache->apply_promotions();
+	result.applied_order_ = order_of(*cache);
+	
+	std::cout << "  " << name << ": " << elapsed / trace.size() << " ns/get";
+	if (eager)
+	{
+		std::size_t differing = result.victims_.size() != eager->victims_.size();
+		for (std::size_t i = 0; i < std::min(result.victims_.size(), eager->victims_.size()); ++i)
+		{
+			differing += result.victims_[i] != eager->victims_[i];
+		}
+		std::cout << ", " << differing << " of " << eager->victims_.size() << " victims differ, order differs "
+			<< mismatch(eager->applied_order_, result.order_) << "% before and "
+			<< mismatch(eager->applied_order_, result.applied_order_) << "% after apply_promotions";
+	}
+	std::cout << std::endl;
+	return result;
+}
+
+int main(int argc, const char * argv[])
+{
+	auto trace = make_trace();
+	
+	for (std::size_t size : {std::size_t{1} << 12, std::size_t{1} << 17})
+	{
+		std::cout << size << " entries:" << std::endl;
+		auto eager = replay<eager_cache_type>("eager", trace, size, nullptr);
+		replay<buffered_cache_type<16>>("buffered (16)", trace, size, &eager);
+		replay<buffered_cache_type<64>>("buffered (64)", trace, size, &eager);
+		replay<buffered_cache_type<256>>("buffered (256)", trace, size, &eager);
+	}
+	
+	return 0;
+}
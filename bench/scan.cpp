@@ -0,0 +1,132 @@
+/*
+MIT License
+
+Copyright © 2016 David Curtis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <limits>
+#include "../include/lru_cache.h"
+
+using namespace utils;
+
+// Compares full scans of a cache of 2^20 entries, whose usage order has been shuffled by random
+// gets: walking the usage list with the iterators, scanning the table at once and in slabs of 256
+// buckets, and scanning the parts of a split cursor on separate threads. Reports the time per entry.
+
+using cache_type = lru_cache<std::uint64_t, std::uint64_t>;
+
+static const std::size_t entry_count = 1 << 20;
+
+template<class Scan>
+static void measure(const char* name, Scan scan)
+{
+	auto start = std::chrono::steady_clock::now();
+	auto sum = scan();
+	auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	std::cout << name << ": " << elapsed / entry_count << " ns/entry (checksum " << sum << ")" << std::endl;
+}
+
+int main(int argc, const char * argv[])
+{
+	cache_type cache([] (const std::uint64_t& key, cache_type::miss_handler_reply_f reply)
+	{
+		reply(cache_type::value_uptr_t(new std::uint64_t(key)), std::error_code());
+	}, entry_count);
+	
+	std::mt19937_64 rng(42);
+	for (std::size_t i = 0; i < entry_count; ++i)
+	{
+		cache.get(i, [] (cache_type::const_iterator, std::error_code) {});
+	}
+	for (std::size_t i = 0; i < 4 * entry_count; ++i)
+	{
+		cache.get(rng() % entry_count, [] (cache_type::const_iterator, std::error_code) {});
+	}
+	
+	measure("usage list", [&] ()
+	{
+		std::uint64_t sum = 0;
+		for (auto it = cache.cbegin(); it != cache.cend(); ++it)
+		{
+			sum += *it;
+		}
+		return sum;
+	});
+	
+	measure("scan", [&] ()
+	{
+		std::uint64_t sum = 0;
+		cache.scan([&] (const std::uint64_t&, const std::uint64_t& value)
+		{
+			sum += value;
+		});
+		return sum;
+	});
+	
+	measure("scan, slabs of 256 buckets", [&] ()
+	{
+		std::uint64_t sum = 0;
+		cache_type::scan_cursor cursor;
+		while (!cursor.done())
+		{
+			cache.scan(cursor, 256, [&] (const std::uint64_t&, const std::uint64_t& value)
+			{
+				sum += value;
+			});
+		}
+		return sum;
+	});
+	
+	auto thread_count = std::max(2u, std::thread::hardware_concurrency());
+	std::cout << thread_count << " threads" << std::endl;
+	measure("split scan", [&] ()
+	{
+		std::vector<cache_type::scan_cursor> parts(thread_count);
+		std::vector<std::uint64_t> sums(thread_count, 0);
+		cache_type::scan_cursor{}.split(parts.begin(), parts.end());
+		std::vector<std::thread> threads;
+		for (std::size_t i = 0; i < thread_count; ++i)
+		{
+			threads.emplace_back([&, i] ()
+			{
+				cache.scan(parts[i], std::numeric_limits<std::size_t>::max(), [&] (const std::uint64_t&, const std::uint64_t& value)
+				{
+					sums[i] += value;
+				});
+			});
+		}
+		std::uint64_t sum = 0;
+		for (std::size_t i = 0; i < thread_count; ++i)
+		{
+			threads[i].join();
+			sum += sums[i];
+		}
+		return sum;
+	});
+	
+	return 0;
+}
@@ -0,0 +1,239 @@
+/*
+MIT License
+
+Copyright © 2016 David Curtis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include "../include/lru_uring.h"
+
+using namespace utils;
+
+// An end-to-end benchmark of a cache fronting a directory of files, one file per key. A fixed
+// number of get() requests are kept outstanding, as a server with that many concurrent clients
+// would; the key sequence is skewed, so some keys are much more popular than others. Misses are
+// served either by a miss handler that reads the file synchronously with pread(), or by
+// uring_file_source.
+//
+// The files are created in a temporary directory under /tmp, or in the directory given as the
+// first argument (to measure a particular device). Files just written are likely to be in the page
+// cache, so unless the page cache is dropped between runs, this measures the cost of the read
+// system calls rather than the device.
+
+using bench_cache_type = lru_cache<std::size_t, std::string>;
+
+static const std::size_t file_count = 1 << 12;
+static const std::size_t file_size = 16 * 1024;
+static const std::size_t cache_size = file_count / 8;
+static const std::size_t request_count = 1 << 18;
+
+class driver
+{
+public:
+
+	driver(uring_loop& loop, bench_cache_type& cache, const std::vector<std::size_t>& keys, std::size_t concurrency)
+	:
+	loop_{loop},
+	cache_{cache},
+	keys_{keys},
+	concurrency_{concurrency},
+	next_{0},
+	errors_{0},
+	bytes_{0}
+	{}
+	
+	double run()
+	{
+		auto start = std::chrono::steady_clock::now();
+		loop_.post([this] ()
+		{
+			for (std::size_t i = 0; i < concurrency_; ++i)
+			{
+				request();
+			}
+		});
+		loop_.run();
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		return std::chrono::duration<double>(elapsed).count();
+	}
+	
+	std::size_t errors() const
+	{
+		return errors_;
+	}
+	
+	std::size_t bytes() const
+	{
+		return bytes_;
+	}
+	
+private:
+
+	// each reply starts the next request, from a task, so runs of hits don't recurse
+	
+	void request()
+	{
+		if (next_ == keys_.size())
+		{
+			return;
+		}
+		cache_.get(keys_[next_++], [this] (bench_cache_type::const_iterator it, std::error_code err)
+		{
+			if (err)
+			{
+				++errors_;
+			}
+			else
+			{
+				bytes_ += it->size();
+			}
+			loop_.post([this] () { request(); });
+		});
+	}
+	
+	uring_loop&							loop_;
+	bench_cache_type&					cache_;
+	const std::vector<std::size_t>&		keys_;
+	std::size_t							concurrency_;
+	std::size_t							next_;
+	std::size_t							errors_;
+	std::size_t							bytes_;
+};
+
+static std::string path(const std::string& dir, std::size_t key)
+{
+	return dir + "/" + std::to_string(key);
+}
+
+static bench_cache_type::value_uptr_t make_value(const char* data, std::size_t size)
+{
+	return bench_cache_type::value_uptr_t(new std::string(data, size));
+}
+
+int main(int argc, const char * argv[])
+{
+	std::string dir;
+	bool temporary = argc < 2;
+	if (temporary)
+	{
+		char dir_template[] = "/tmp/lru_uring_bench.XXXXXX";
+		if (!::mkdtemp(dir_template))
+		{
+			std::cout << "couldn't make a temporary directory" << std::endl;
+			return 1;
+		}
+		dir = dir_template;
+	}
+	else
+	{
+		dir = argv[1];
+	}
+	
+	std::string contents(file_size, 'x');
+	for (std::size_t i = 0; i < file_count; ++i)
+	{
+		auto file = std::fopen(path(dir, i).c_str(), "w");
+		if (!file)
+		{
+			std::cout << "couldn't create " << path(dir, i) << std::endl;
+			return 1;
+		}
+		std::fwrite(contents.data(), 1, contents.size(), file);
+		std::fclose(file);
+	}
+	
+	// cubing a uniform variate skews the keys toward zero; about a third of the requests
+	// are for the most popular 4% of the keys
+	
+	std::mt19937_64 rng(42);
+	std::uniform_real_distribution<double> dist(0.0, 1.0);
+	std::vector<std::size_t> keys(request_count);
+	for (auto& key : keys)
+	{
+		auto u = dist(rng);
+		key = static_cast<std::size_t>(u * u * u * file_count) % file_count;
+	}
+	
+	for (std::size_t concurrency : {1, 16, 64, 256})
+	{
+		uring_loop blocking_loop(0);
+		bench_cache_type blocking_cache([&] (const std::size_t& key, bench_cache_type::miss_handler_reply_f reply)
+		{
+			int fd = ::open(path(dir, key).c_str(), O_RDONLY);
+			if (fd < 0)
+			{
+				reply(nullptr, std::error_code(errno, std::system_category()));
+				return;
+			}
+			struct stat status;
+			if (::fstat(fd, &status) != 0)
+			{
+				::close(fd);
+				reply(nullptr, std::error_code(errno, std::system_category()));
+				return;
+			}
+			std::string data(static_cast<std::size_t>(status.st_size), '\0');
+			auto result = ::pread(fd, &data[0], data.size(), 0);
+			::close(fd);
+			if (result < 0)
+			{
+				reply(nullptr, std::error_code(errno, std::system_category()));
+				return;
+			}
+			data.resize(static_cast<std::size_t>(result));
+			reply(bench_cache_type::value_uptr_t(new std::string(std::move(data))), std::error_code());
+		}, cache_size);
+		driver blocking(blocking_loop, blocking_cache, keys, concurrency);
+		double blocking_seconds = blocking.run();
+		
+		uring_loop loop(256, 256, file_size);
+		uring_file_source<std::size_t, std::string> source(loop, [&] (const std::size_t& key) { return path(dir, key); }, make_value);
+		bench_cache_type cache(source.miss_handler(), cache_size);
+		driver uring(loop, cache, keys, concurrency);
+		double uring_seconds = uring.run();
+		
+		if (blocking.errors() || uring.errors() || blocking.bytes() != uring.bytes())
+		{
+			std::cout << "errors: " << blocking.errors() << " (pread), " << uring.errors() << " (io_uring)" << std::endl;
+		}
+		
+		std::cout << concurrency << " outstanding: pread " << request_count / blocking_seconds << " gets/s, io_uring "
+			<< request_count / uring_seconds << " gets/s (" << loop.completions() << " reads in " << loop.submits()
+			<< " submissions" << (loop.buffers_registered() ? ", registered buffers" : "") << ")" << std::endl;
+	}
+	
+	for (std::size_t i = 0; i < file_count; ++i)
+	{
+		::unlink(path(dir, i).c_str());
+	}
+	if (temporary)
+	{
+		::rmdir(dir.c_str());
+	}
+	
+	return 0;
+}
@@ -23,10 +23,14 @@ SOFTWARE.
 */
 
 #include <iostream>
-#include "test.h"
+#include "stress.h"
 
 int main(int argc, const char * argv[]) {
 
+	// the stress tests take their seed from the first argument, if there is one
+	
+	std::uint64_t seed = (argc > 1) ? std::stoull(argv[1]) : 20161;
+
 	{
 		test_fixture<test_value_copy_constructible> tf("copy-construcible value", 5);
 		tf.run();
@@ -37,7 +41,131 @@ int main(int argc, const char * argv[]) {
 		tf.run();
 	}
 
-	std::cout << "tests complete" << std::endl;
+	{
+		executor_test test;
+		test.run();
+	}
+
+	{
+		reentrancy_test test;
+		test.run();
+	}
+
+	{
+		write_test test;
+		test.run();
+	}
+
+	{
+		removal_listener_test test;
+		test.run();
+	}
+
+	{
+		file_tier_test test(false);
+		test.run();
+	}
+
+	{
+		file_tier_test test(true);
+		test.run();
+	}
+
+	{
+		uring_test test(true);
+		test.run();
+	}
+
+	{
+		uring_test test(false);
+		test.run();
+	}
+
+	{
+		hot_keys_test test;
+		test.run();
+	}
+
+	{
+		inflight_group_test test;
+		test.run();
+	}
+
+	{
+		gdsf_test test;
+		test.run();
+	}
+
+	{
+		policy_test test;
+		test.run();
+	}
+
+	{
+		tier_chain_test test;
+		test.run();
+	}
+
+	{
+		promotion_test test;
+		test.run();
+	}
+
+	{
+		scan_test test;
+		test.run();
+	}
+
+	{
+		cache_group_test test;
+		test.run();
+	}
+
+	{
+		stress_test<> test(seed, stress_test<>::mode::sequential, 20000);
+		test.run();
+	}
+
+	{
+		stress_test<> test(seed + 1, stress_test<>::mode::reentrant, 20000);
+		test.run();
+	}
+
+	{
+		stress_test<> test(seed + 2, stress_test<>::mode::deferred, 20000);
+		test.run();
+	}
+
+	{
+		stress_test<utils::cache_policies<utils::lru_eviction, utils::no_stats, utils::no_expiry, utils::buffered_promotion<8>>>
+			test(seed + 4, stress_test<>::mode::sequential, 20000);
+		test.run();
+	}
+
+	{
+		stress_test<utils::cache_policies<utils::lru_eviction, utils::no_stats, utils::no_expiry, utils::buffered_promotion<8>>>
+			test(seed + 5, stress_test<>::mode::deferred, 20000);
+		test.run();
+	}
+
+	{
+		threaded_stress_test test(seed + 3, 20000);
+		test.run();
+	}
+
+#if defined(__cpp_impl_coroutine)
+	{
+		coroutine_async_test test;
+		test.run();
+	}
+#endif
+
+	std::cout << "tests complete";
+	if (test_failures() != 0)
+	{
+		std::cout << ", " << test_failures() << " failed";
+	}
+	std::cout << std::endl;
 	
-    return 0;
+    return (test_failures() == 0) ? 0 : 1;
 }
@@ -0,0 +1,621 @@
+/*
+MIT License
+
+Copyright © 2016 David Curtis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef guard_async_lru_cache_stress_h
+#define guard_async_lru_cache_stress_h
+
+#include "test.h"
+#include <list>
+#include <algorithm>
+
+// The stress tests drive a cache with long seeded random sequences of operations, and check it
+// against a reference model of the backing store. Every put gives a key a new version, and the
+// miss handler reads the version current when it is called, so replies can be checked against
+// the versions that were current while they were outstanding:
+//
+//	- every get is replied to exactly once, with an error and the past-the-end iterator, or with
+//	  the requested key at a version no older than the one current when get was called;
+//	- every value in the cache is the key's current version (a stale miss reply is never inserted);
+//	- the cache's size, its usage list and its hash table agree, and it holds at most limit entries;
+//	- in sequential mode, the usage order (and so the choice of victim) matches a reference LRU list.
+//
+// A failure reports the seed; passing it to ctest as the first argument repeats the run.
+
+class stress_value
+{
+public:
+	stress_value(std::uint32_t key, std::uint64_t version)
+	:
+	key_{key},
+	version_{version}
+	{}
+	
+	std::uint32_t	key_;
+	std::uint64_t	version_;
+};
+
+enum class stress_mode
+{
+	sequential,
+	reentrant,
+	deferred
+};
+
+// stress_test runs on a single thread. Misses are held and completed in random order (some
+// with errors, some synchronously), and, except in sequential mode, replies re-enter the cache.
+// Without deferred delivery, replies only issue gets, and synchronous misses are confined to the
+// outermost operation, since nested operations that remove entries are only safe when deferred.
+// The cache's policies are a parameter, so that the same checks cover the optional policies
+// that change how entries are ordered (buffered_promotion).
+
+template<class Policies = utils::cache_policies<>>
+class stress_test
+{
+public:
+	using cache_type = utils::lru_cache<std::uint32_t, stress_value, std::hash<std::uint32_t>, std::equal_to<std::uint32_t>, Policies>;
+	using value_uptr_t = typename cache_type::value_uptr_t;
+	using const_iterator = typename cache_type::const_iterator;
+	using reply_f = typename cache_type::miss_handler_reply_f;
+	using removal_cause = typename cache_type::removal_cause;
+	
+	using mode = stress_mode;
+	
+	static const std::uint32_t key_space = 48;
+	static const std::size_t cache_limit = 16;
+	
+	stress_test(std::uint64_t seed, mode m, std::size_t steps)
+	:
+	seed_{seed},
+	mode_{m},
+	steps_{steps},
+	rng_(seed),
+	versions_(key_space, 1),
+	depth_{0},
+	budget_{0},
+	requests_{0},
+	replies_{0},
+	cache_(
+		[this] (const std::uint32_t& key, reply_f reply)
+		{
+			if (depth_ == 0 && rng_() % 8 == 0)
+			{
+				reply(value_uptr_t(new stress_value(key, versions_[key])), std::error_code());
+			}
+			else
+			{
+				pending_.emplace_back(key, versions_[key], std::move(reply));
+			}
+		}, cache_limit)
+	{
+		cache_.set_deferred_delivery(m == mode::deferred);
+		cache_.set_removal_listener([this] (typename cache_type::removal_batch_t& batch)
+		{
+			for (auto& removed : batch)
+			{
+				removals_.emplace_back(removed.key(), removed.cause());
+			}
+		});
+	}
+	
+	std::string name() const
+	{
+		static const char* names[] = {"sequential", "reentrant", "deferred"};
+		auto buffered = !std::is_same<typename Policies::promotion, utils::eager_promotion>::value;
+		return std::string("stress test (") + names[static_cast<int>(mode_)] + (buffered ? ", buffered promotion" : "")
+			+ ", seed " + std::to_string(seed_) + ")";
+	}
+	
+	std::uint32_t random_key()
+	{
+		// half of the requests go to a hot set smaller than the cache
+		
+		return (rng_() % 2 == 0) ? rng_() % (cache_limit / 2) : rng_() % key_space;
+	}
+	
+	void get(std::uint32_t key)
+	{
+		auto request = requests_++;
+		auto oldest = versions_[key];
+		replied_.push_back(false);
+		
+		cache_.get(key, [this, key, request, oldest] (const_iterator iter, const std::error_code& err)
+		{
+			if (replied_[request])
+			{
+				report_failure() << name() << " failed: request " << request << " replied to twice" << std::endl;
+			}
+			replied_[request] = true;
+			++replies_;
+			
+			if (err)
+			{
+				if (iter != cache_.cend())
+				{
+					report_failure() << name() << " failed: error reply with a value for key " << key << std::endl;
+				}
+			}
+			else if (iter == cache_.cend() || iter->key_ != key || iter->version_ < oldest || iter->version_ > versions_[key])
+			{
+				report_failure() << name() << " failed: wrong value for key " << key << std::endl;
+			}
+			else if (mode_ == mode::sequential)
+			{
+				touch(key);
+			}
+			
+			++depth_;
+			nest();
+			--depth_;
+		});
+	}
+	
+	void put(std::uint32_t key)
+	{
+		auto version = ++versions_[key];
+		cache_.put(key, value_uptr_t(new stress_value(key, version)));
+		if (mode_ == mode::sequential)
+		{
+			touch(key);
+		}
+	}
+	
+	// nest issues operations from a reply
+	
+	void nest()
+	{
+		for (auto n = rng_() % 3; n > 0 && budget_ > 0 && mode_ != mode::sequential; --n)
+		{
+			--budget_;
+			auto key = random_key();
+			switch ((mode_ == mode::deferred) ? rng_() % 8 : 0)
+			{
+				case 1:
+					put(key);
+					break;
+				case 2:
+					cache_.invalidate(key);
+					break;
+				case 3:
+					if (rng_() % 8 == 0)
+					{
+						cache_.flush();
+					}
+					break;
+				default:
+					get(key);
+					break;
+			}
+		}
+	}
+	
+	void complete(std::size_t index)
+	{
+		std::swap(pending_[index], pending_.back());
+		auto miss = std::move(pending_.back());
+		pending_.pop_back();
+		
+		if (rng_() % 10 == 0)
+		{
+			std::get<2>(miss)(value_uptr_t(), std::make_error_code(std::errc::io_error));
+		}
+		else
+		{
+			std::get<2>(miss)(value_uptr_t(new stress_value(std::get<0>(miss), std::get<1>(miss))), std::error_code());
+		}
+	}
+	
+	void complete_all()
+	{
+		while (!pending_.empty())
+		{
+			complete(rng_() % pending_.size());
+		}
+	}
+	
+	// The reference LRU list, most recently used first, as the cache's iterators walk it
+	
+	void touch(std::uint32_t key)
+	{
+		auto it = std::find(model_.begin(), model_.end(), key);
+		if (it != model_.end())
+		{
+			model_.erase(it);
+		}
+		model_.push_front(key);
+	}
+	
+	void apply_removals()
+	{
+		for (auto& removal : removals_)
+		{
+			if (mode_ != mode::sequential || removal.second == removal_cause::replaced)
+			{
+				continue;
+			}
+			if (removal.second == removal_cause::size && (model_.empty() || model_.back() != removal.first))
+			{
+				report_failure() << name() << " failed: evicted key " << removal.first << " wasn't the least recently used" << std::endl;
+			}
+			model_.remove(removal.first);
+		}
+		removals_.clear();
+	}
+	
+	void check(std::size_t step)
+	{
+		// with buffered promotion, the promotions are left to accumulate between checks of the order
+		
+		bool ordered = std::is_same<typename Policies::promotion, utils::eager_promotion>::value || step % 16 == 0 || step == steps_;
+		if (ordered)
+		{
+			cache_.apply_promotions();
+		}
+		apply_removals();
+		
+		std::size_t count = 0;
+		for (auto it = cache_.cbegin(); it != cache_.cend() && count <= cache_.size(); ++it, ++count)
+		{
+			auto found = cache_.find(it->key_);
+			if (found == cache_.cend() || &*found != &*it)
+			{
+				report_failure() << name() << " failed at step " << step << ": key " << it->key_ << " not found in the table" << std::endl;
+			}
+			if (it->version_ != versions_[it->key_])
+			{
+				report_failure() << name() << " failed at step " << step << ": key " << it->key_ << " has version "
+					<< it->version_ << ", current version " << versions_[it->key_] << std::endl;
+			}
+		}
+		
+		if (count != cache_.size() || count > cache_.limit())
+		{
+			report_failure() << name() << " failed at step " << step << ": " << count << " entries in the list, size "
+				<< cache_.size() << std::endl;
+		}
+		
+		if (mode_ == mode::sequential && ordered)
+		{
+			std::vector<std::uint32_t> order;
+			for (auto it = cache_.cbegin(); it != cache_.cend() && order.size() <= cache_.size(); ++it)
+			{
+				order.push_back(it->key_);
+			}
+			if (!std::equal(order.begin(), order.end(), model_.begin(), model_.end()))
+			{
+				report_failure() << name() << " failed at step " << step << ": usage order differs from the reference" << std::endl;
+			}
+		}
+	}
+	
+	void run()
+	{
+		std::cout << "starting " << name() << std::endl;
+		
+		auto failures = test_failures().load();
+		for (std::size_t step = 0; step < steps_ && test_failures() == failures; ++step)
+		{
+			budget_ = 8;
+			auto key = random_key();
+			auto op = rng_() % 100;
+			if (op < 45)
+			{
+				get(key);
+			}
+			else if (op < 70)
+			{
+				if (!pending_.empty())
+				{
+					complete(rng_() % pending_.size());
+				}
+			}
+			else if (op < 80)
+			{
+				put(key);
+			}
+			else if (op < 90)
+			{
+				cache_.invalidate(key);
+			}
+			else if (op < 91)
+			{
+				cache_.flush();
+			}
+			else if (op < 96)
+			{
+				auto found = cache_.find(key);
+				if (found != cache_.cend() && found->version_ != versions_[key])
+				{
+					report_failure() << name() << " failed: find returned a stale value for key " << key << std::endl;
+				}
+			}
+			else
+			{
+				complete_all();
+			}
+			check(step);
+		}
+		
+		complete_all();
+		check(steps_);
+		
+		if (replies_ != requests_)
+		{
+			report_failure() << name() << " failed: " << replies_ << " replies for " << requests_ << " requests" << std::endl;
+		}
+	}
+
+private:
+	using pending_miss_t = std::tuple<std::uint32_t, std::uint64_t, reply_f>;
+	
+	std::uint64_t seed_;
+	mode mode_;
+	std::size_t steps_;
+	std::mt19937_64 rng_;
+	std::vector<std::uint64_t> versions_;
+	std::vector<pending_miss_t> pending_;
+	std::vector<bool> replied_;
+	std::list<std::uint32_t> model_;
+	std::vector<std::pair<std::uint32_t, removal_cause>> removals_;
+	std::size_t depth_;
+	std::size_t budget_;
+	std::size_t requests_;
+	std::size_t replies_;
+	cache_type cache_;
+};
+
+// threaded_stress_test runs the cache on the main thread's loop, with its misses served by
+// backend threads that reply in random order (and sometimes with errors) from their own threads,
+// and with client threads that get values through the cross-executor form of get, and put and
+// invalidate them. The interleaving depends on the scheduler, so the seed doesn't fully determine
+// the run; it is mainly useful under ThreadSanitizer.
+
+class threaded_stress_test
+{
+public:
+	using cache_type = utils::lru_cache<std::uint32_t, stress_value>;
+	
+	static const std::uint32_t key_space = 48;
+	static const std::size_t cache_limit = 16;
+	static const std::size_t client_count = 2;
+	static const std::size_t backend_count = 2;
+	
+	threaded_stress_test(std::uint64_t seed, std::size_t requests_per_client)
+	:
+	seed_{seed},
+	requests_per_client_{requests_per_client},
+	versions_(key_space, 1),
+	stopping_{false},
+	cache_(
+		[this] (const std::uint32_t& key, cache_type::miss_handler_reply_f reply)
+		{
+			std::lock_guard<std::mutex> lock{backend_mutex_};
+			backend_queue_.emplace_back(key, versions_[key], std::move(reply));
+		}, cache_limit)
+	{
+		cache_.set_executor([this] (cache_type::task_f task)
+		{
+			loop_.post(std::move(task));
+		});
+	}
+	
+	std::string name() const
+	{
+		return "threaded stress test (seed " + std::to_string(seed_) + ")";
+	}
+	
+	void backend(std::uint64_t seed)
+	{
+		std::mt19937_64 rng(seed);
+		while (true)
+		{
+			pending_miss_t miss;
+			{
+				std::lock_guard<std::mutex> lock{backend_mutex_};
+				if (backend_queue_.empty())
+				{
+					if (stopping_)
+					{
+						return;
+					}
+				}
+				else
+				{
+					auto index = rng() % backend_queue_.size();
+					std::swap(backend_queue_[index], backend_queue_.back());
+					miss = std::move(backend_queue_.back());
+					backend_queue_.pop_back();
+				}
+			}
+			
+			if (!std::get<2>(miss))
+			{
+				std::this_thread::yield();
+			}
+			else if (rng() % 10 == 0)
+			{
+				std::get<2>(miss)(cache_type::value_uptr_t(), std::make_error_code(std::errc::io_error));
+			}
+			else
+			{
+				std::get<2>(miss)(cache_type::value_uptr_t(new stress_value(std::get<0>(miss), std::get<1>(miss))), std::error_code());
+			}
+		}
+	}
+	
+	void client(std::uint64_t seed)
+	{
+		std::mt19937_64 rng(seed);
+		test_loop origin;
+		std::size_t gets = 0;
+		std::size_t replies = 0;
+		
+		for (std::size_t i = 0; i < requests_per_client_; ++i)
+		{
+			std::uint32_t key = (rng() % 2 == 0) ? rng() % (cache_limit / 2) : rng() % key_space;
+			auto op = rng() % 100;
+			if (op < 80)
+			{
+				// versions_ is only used on the cache's loop, so the oldest acceptable version is
+				// read there, when the get is issued
+				
+				++gets;
+				loop_.post([this, key, &origin, &replies] ()
+				{
+					auto oldest = versions_[key];
+					cache_.get(key, [&origin] (cache_type::task_f task) { origin.post(std::move(task)); },
+						[this, key, oldest] (cache_type::const_iterator iter, const std::error_code& err)
+						{
+							if (err ? iter != cache_.cend() : (iter == cache_.cend() || iter->key_ != key || iter->version_ < oldest || iter->version_ > versions_[key]))
+							{
+								report_failure() << name() << " failed: wrong value for key " << key << std::endl;
+							}
+							return key;
+						},
+						[&replies] (std::uint32_t)
+						{
+							++replies;
+						});
+				});
+			}
+			else if (op < 90)
+			{
+				loop_.post([this, key] ()
+				{
+					auto version = ++versions_[key];
+					cache_.put(key, cache_type::value_uptr_t(new stress_value(key, version)));
+				});
+			}
+			else if (op < 99)
+			{
+				loop_.post([this, key] ()
+				{
+					cache_.invalidate(key);
+				});
+			}
+			else
+			{
+				loop_.post([this] ()
+				{
+					cache_.flush();
+				});
+			}
+			
+			if (rng() % 16 == 0)
+			{
+				std::this_thread::yield();
+			}
+			origin.run();
+		}
+		
+		while (replies != gets)
+		{
+			if (origin.run() == 0)
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+	
+	// check runs on the cache's loop
+	
+	void check()
+	{
+		std::size_t count = 0;
+		for (auto it = cache_.cbegin(); it != cache_.cend() && count <= cache_.size(); ++it, ++count)
+		{
+			if (it->version_ != versions_[it->key_])
+			{
+				report_failure() << name() << " failed: key " << it->key_ << " has version " << it->version_
+					<< ", current version " << versions_[it->key_] << std::endl;
+			}
+		}
+		if (count != cache_.size() || count > cache_.limit())
+		{
+			report_failure() << name() << " failed: " << count << " entries in the list, size " << cache_.size() << std::endl;
+		}
+	}
+	
+	void run()
+	{
+		std::cout << "starting " << name() << std::endl;
+		
+		std::atomic<std::size_t> running{client_count};
+		std::vector<std::thread> clients;
+		std::vector<std::thread> backends;
+		for (std::size_t i = 0; i < backend_count; ++i)
+		{
+			backends.emplace_back([this, i] () { backend(seed_ + 100 + i); });
+		}
+		for (std::size_t i = 0; i < client_count; ++i)
+		{
+			clients.emplace_back([this, i, &running] ()
+			{
+				client(seed_ + i);
+				--running;
+			});
+		}
+		
+		std::size_t rounds = 0;
+		while (running != 0)
+		{
+			if (loop_.run() == 0)
+			{
+				std::this_thread::yield();
+			}
+			if (++rounds % 64 == 0)
+			{
+				check();
+			}
+		}
+		
+		for (auto& client : clients)
+		{
+			client.join();
+		}
+		{
+			std::lock_guard<std::mutex> lock{backend_mutex_};
+			stopping_ = true;
+		}
+		for (auto& backend : backends)
+		{
+			backend.join();
+		}
+		loop_.run();
+		check();
+	}
+
+private:
+	using pending_miss_t = std::tuple<std::uint32_t, std::uint64_t, cache_type::miss_handler_reply_f>;
+	
+	std::uint64_t seed_;
+	std::size_t requests_per_client_;
+	std::vector<std::uint64_t> versions_;
+	std::mutex backend_mutex_;
+	std::vector<pending_miss_t> backend_queue_;
+	bool stopping_;
+	test_loop loop_;
+	cache_type cache_;
+};
+
+#endif /* guard_async_lru_cache_stress_h */
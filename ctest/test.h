@@ -26,8 +26,57 @@ SOFTWARE.
 #define guard_async_lru_cache_test_h
 
 #include "../include/lru_cache.h"
+#include "../include/lru_file_tier.h"
+#include "../include/lru_uring.h"
+#include "../include/lru_hot_keys.h"
+#include "../include/lru_inflight_group.h"
+#include "../include/lru_cache_group.h"
 #include <iostream>
 #include <vector>
+#include <map>
+#include <iterator>
+#include <deque>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+
+// report_failure counts a failed check (main returns nonzero if there were any), and returns the
+// stream on which to describe it
+
+inline std::atomic<std::size_t>& test_failures()
+{
+	static std::atomic<std::size_t> failures{0};
+	return failures;
+}
+
+inline std::ostream& report_failure()
+{
+	++test_failures();
+	return std::cout;
+}
+
+#if defined(__cpp_impl_coroutine)
+
+// test_task is a minimal eagerly-started, fire-and-forget coroutine type for the co_get tests
+
+class test_task
+{
+public:
+	struct promise_type
+	{
+		test_task get_return_object() { return test_task{}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+#endif
 
 class test_value
 {
@@ -152,6 +201,24 @@ private:
 	std::unique_ptr<std::uint64_t>	n_ptr_;
 };
 
+// counting_hash is std::hash<std::string>, counting its calls
+
+class counting_hash
+{
+public:
+	std::size_t operator()(const std::string& key) const
+	{
+		++calls();
+		return std::hash<std::string>()(key);
+	}
+	
+	static std::size_t& calls()
+	{
+		static std::size_t count = 0;
+		return count;
+	}
+};
+
 template<class V>
 class test_fixture
 {
@@ -203,13 +270,13 @@ public:
 		
 		if (iter != cache_.cend())
 		{
-			std::cout << test_name_ << " failed, unexpected iterator to past-the-end element" << std::endl;
+			report_failure() << test_name_ << " failed, unexpected iterator to past-the-end element" << std::endl;
 			result = false;
 		}
 		
 		if (!err)
 		{
-			std::cout << test_name_ << " failed, unexpected non-zero error code" << std::endl;
+			report_failure() << test_name_ << " failed, unexpected non-zero error code" << std::endl;
 			result = false;
 		}
 		
@@ -221,14 +288,14 @@ public:
 		bool retval = true;
 		if (iter == cache_.cend())
 		{
-			std::cout << test_name_ << " failed, unexpected iterator to past-the-end element" << std::endl;
+			report_failure() << test_name_ << " failed, unexpected iterator to past-the-end element" << std::endl;
 			retval = false;
 		}
 		else
 		{
 			if (iter->get() != expected)
 			{
-				std::cout << test_name_ << " failed, found value [" << iter->get() << "] at iterator, expected [" << expected << "]" << std::endl;
+				report_failure() << test_name_ << " failed, found value [" << iter->get() << "] at iterator, expected [" << expected << "]" << std::endl;
 				retval = false;
 			}
 		}
@@ -239,7 +306,7 @@ public:
 	{
 		for (auto i = start; i < end; ++i)
 		{
-			cache_.get(std::to_string(i), [=] (typename cache_type::const_iterator hit, const std::error_code& err)
+			cache_.get(std::to_string(i), [this, i] (typename cache_type::const_iterator hit, const std::error_code& err)
 			{
 				expect_value(hit, i);
 			});
@@ -257,14 +324,14 @@ public:
 		{
 			if (!iter.check_linkage())
 			{
-				std::cout << test_name_ << " failed: list pointers corrupted" << std::endl;
+				report_failure() << test_name_ << " failed: list pointers corrupted" << std::endl;
 				retval = false;
 				break;
 			}
 			
 			if (!(count < cache_.size()))
 			{
-				std::cout << test_name_ << " failed: list pointers corrupted, count of list elements exceeeds map size" << std::endl;
+				report_failure() << test_name_ << " failed: list pointers corrupted, count of list elements exceeeds map size" << std::endl;
 				retval = false;
 				break;
 			}
@@ -276,7 +343,7 @@ public:
 		{
 			if (count != cache_.size())
 			{
-				std::cout << test_name_ << " failed: count of list elements doesn't match map size" << std::endl;
+				report_failure() << test_name_ << " failed: count of list elements doesn't match map size" << std::endl;
 				retval = false;
 			}
 		}
@@ -296,7 +363,7 @@ public:
 		{
 			if (it->get() != expected[count])
 			{
-				std::cout << test_name_ << " failed at index " << count << ": expected " << expected[count] << ", found " << it->get() << std::endl;
+				report_failure() << test_name_ << " failed at index " << count << ": expected " << expected[count] << ", found " << it->get() << std::endl;
 				result = false;
 			}
 		
@@ -304,7 +371,7 @@ public:
 			
 			if (count > expected.size())
 			{
-				std::cout << test_name_ << " failed: list item count (" << count << ") exceeds number of expected items (" << expected.size() << ")" << std::endl;
+				report_failure() << test_name_ << " failed: list item count (" << count << ") exceeds number of expected items (" << expected.size() << ")" << std::endl;
 				result = false;
 				break;
 			}
@@ -315,7 +382,7 @@ public:
 		}
 		if (result && count != expected.size())
 		{
-			std::cout << test_name_ << " failed: list item count (" << count << ") doesn't match number of expected items(" << expected.size() << ")" << std::endl;
+			report_failure() << test_name_ << " failed: list item count (" << count << ") doesn't match number of expected items(" << expected.size() << ")" << std::endl;
 			result = false;
 		}
 		
@@ -334,7 +401,7 @@ public:
 		list_check({4, 3, 2, 1, 0});
 		list_integrity_check();
 		
-		cache().get("2", [=] (typename cache_type::const_iterator iter, const std::error_code& err)
+		cache().get("2", [this] (typename cache_type::const_iterator iter, const std::error_code& err)
 		{
 			expect_value(iter, 2);
 		});
@@ -354,7 +421,7 @@ public:
 		list_check({4, 3, 2, 1, 0});
 		list_integrity_check();
 		
-		cache().get("5", [=] (typename cache_type::const_iterator iter, const std::error_code& err)
+		cache().get("5", [this] (typename cache_type::const_iterator iter, const std::error_code& err)
 		{
 			expect_value(iter, 5);
 		});
@@ -369,7 +436,7 @@ public:
 		
 		std::cout << "starting " << test_name_ << ": miss handler error test" << std::endl;
 		
-		cache().get("not_a_number", [=] (typename cache_type::const_iterator iter, const std::error_code& err)
+		cache().get("not_a_number", [this] (typename cache_type::const_iterator iter, const std::error_code& err)
 		{
 			expect_error(iter, err);
 		});
@@ -377,11 +444,202 @@ public:
 		list_integrity_check();
 	}
 
+	void batch_lookup_test()
+	{
+		using cache_type = utils::lru_cache<std::string, V>;
+		
+		std::cout << "starting " << test_name_ << ": batch lookup test" << std::endl;
+		
+		cache().flush();
+		fill(0,5);
+		
+		std::vector<std::string> keys{"3", "1", "7", "3", "not_a_number"};
+		std::vector<typename cache_type::const_iterator> found;
+		
+		cache().find_many(keys.begin(), keys.end(), std::back_inserter(found));
+		
+		if (found.size() != keys.size())
+		{
+			report_failure() << test_name_ << " failed: find_many produced " << found.size() << " results, expected " << keys.size() << std::endl;
+		}
+		else
+		{
+			expect_value(found[0], 3);
+			expect_value(found[1], 1);
+			if (found[2] != cache().cend() || found[4] != cache().cend())
+			{
+				report_failure() << test_name_ << " failed: find_many found a value for a missing key" << std::endl;
+			}
+		}
+		
+		// find_many doesn't change the usage order
+		
+		list_check({4, 3, 2, 1, 0});
+		
+		std::size_t replies = 0;
+		cache().get_many(keys.begin(), keys.end(), [&] (const std::string& key, typename cache_type::const_iterator iter, const std::error_code& err)
+		{
+			++replies;
+			if (key == "not_a_number")
+			{
+				expect_error(iter, err);
+			}
+			else
+			{
+				expect_value(iter, std::stoull(key));
+			}
+		});
+		
+		if (replies != keys.size())
+		{
+			report_failure() << test_name_ << " failed: get_many produced " << replies << " replies, expected " << keys.size() << std::endl;
+		}
+		
+		// same order as sequential calls to get; the miss on "7" evicts 0
+		
+		list_check({3, 7, 1, 4, 2});
+		list_integrity_check();
+	}
+
+	void precomputed_hash_test()
+	{
+		using cache_type = utils::lru_cache<std::string, V>;
+		
+		std::cout << "starting " << test_name_ << ": precomputed hash test" << std::endl;
+		
+		cache().flush();
+		fill(0,5);
+		
+		std::string key{"2"};
+		std::size_t hash = std::hash<std::string>()(key);
+		
+		if (cache().hash(key) != hash)
+		{
+			report_failure() << test_name_ << " failed: hash() doesn't match the Hash template parameter" << std::endl;
+		}
+		
+		expect_value(cache().find(key, hash), 2);
+		
+		cache().get(key, hash, [this] (typename cache_type::const_iterator iter, const std::error_code& err)
+		{
+			expect_value(iter, 2);
+		});
+		
+		list_check({2, 4, 3, 1, 0});
+		
+		cache().invalidate(key, hash);
+		
+		if (cache().find(key, hash) != cache().cend())
+		{
+			report_failure() << test_name_ << " failed: found invalidated key" << std::endl;
+		}
+		
+		std::string missing{"7"};
+		cache().get(missing, cache().hash(missing), [this] (typename cache_type::const_iterator iter, const std::error_code& err)
+		{
+			expect_value(iter, 7);
+		});
+		
+		list_check({7, 4, 3, 1, 0});
+		list_integrity_check();
+		
+		// the Hash function is called once per operation: not again when the miss completes, when
+		// the table grows, or when the entry is evicted
+		
+		using counted_cache_type = utils::lru_cache<std::string, V, counting_hash>;
+		std::vector<std::pair<std::string, typename counted_cache_type::miss_handler_reply_f>> pending;
+		counted_cache_type counted([&pending] (const std::string& key, typename counted_cache_type::miss_handler_reply_f reply)
+		{
+			pending.emplace_back(key, reply);
+		}, 4);
+		
+		auto complete = [&pending] ()
+		{
+			for (auto& miss : pending)
+			{
+				miss.second(std::unique_ptr<V>(new V(std::stoull(miss.first))), std::error_code());
+			}
+			pending.clear();
+		};
+		
+		// the table starts with 8 buckets, and grows when the ninth entry is added
+		
+		counted.set_limit(16);
+		for (auto key : {"10", "11", "12", "13", "14", "15", "16", "17"})
+		{
+			counted.get(key, [] (typename counted_cache_type::const_iterator, const std::error_code&) {});
+		}
+		complete();
+		
+		counting_hash::calls() = 0;
+		counted.get("18", [] (typename counted_cache_type::const_iterator, const std::error_code&) {});
+		complete();
+		counted.set_limit(4);
+		
+		if (counting_hash::calls() != 1 || counted.find("18") == counted.cend())
+		{
+			report_failure() << test_name_ << " failed: " << counting_hash::calls() << " calls to the hash function for a miss, expected 1" << std::endl;
+		}
+	}
+
+#if defined(__cpp_impl_coroutine)
+
+	test_task co_get_values(int& step)
+	{
+		auto hit = co_await cache().co_get("2");
+		expect_value(hit.iterator(), 2);
+		step = 1;
+		
+		auto miss = co_await cache().co_get("9");
+		expect_value(miss.iterator(), 9);
+		if (!miss || miss->get() != 9)
+		{
+			report_failure() << test_name_ << " failed: co_get result doesn't hold the value" << std::endl;
+		}
+		step = 2;
+		
+		auto error = co_await cache().co_get("not_a_number");
+		expect_error(error.iterator(), error.error());
+		if (error.has_value())
+		{
+			report_failure() << test_name_ << " failed: co_get result holds a value after an error" << std::endl;
+		}
+		step = 3;
+	}
+	
+	void coroutine_test()
+	{
+		std::cout << "starting " << test_name_ << ": coroutine test" << std::endl;
+		
+		cache().flush();
+		fill(0,5);
+		
+		// the fixture's miss handler replies synchronously, so the coroutine never suspends
+		
+		int step = 0;
+		co_get_values(step);
+		
+		if (step != 3)
+		{
+			report_failure() << test_name_ << " failed: coroutine suspended at step " << step << std::endl;
+		}
+		
+		list_check({9, 2, 4, 3, 1});
+		list_integrity_check();
+	}
+
+#endif
+
 	void run()
 	{
 		lru_order_test();
 		evict_lru_test();
 		miss_handler_error_test();
+		batch_lookup_test();
+		precomputed_hash_test();
+#if defined(__cpp_impl_coroutine)
+		coroutine_test();
+#endif
 	}
 	
 protected:
@@ -390,4 +648,2455 @@ protected:
 	std::string	test_name_;
 };
 
+// test_loop is a minimal single-threaded task queue standing in for an event loop
+
+class test_loop
+{
+public:
+	void post(std::function<void()> task)
+	{
+		std::lock_guard<std::mutex> lock{mutex_};
+		tasks_.push_back(std::move(task));
+	}
+	
+	std::size_t run()
+	{
+		std::size_t count = 0;
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::lock_guard<std::mutex> lock{mutex_};
+				if (tasks_.empty())
+				{
+					break;
+				}
+				task = std::move(tasks_.front());
+				tasks_.pop_front();
+			}
+			task();
+			++count;
+		}
+		return count;
+	}
+	
+private:
+	std::mutex mutex_;
+	std::deque<std::function<void()>> tasks_;
+};
+
+// executor_test has the miss handler replies invoked on a separate (backend) thread, and checks that
+// the completions are marshalled back to the cache's loop in a single batch, and that extracted
+// values are delivered on the origin executor.
+
+class executor_test
+{
+public:
+	using cache_type = utils::lru_cache<std::string, test_value_move_constructible>;
+	
+	executor_test()
+	:
+	cache_(
+		[this] (const std::string& key, cache_type::miss_handler_reply_f reply)
+		{
+			pending_.emplace_back(key, reply);
+		}, 10)
+	{
+		cache_.set_executor([this] (cache_type::task_f task)
+		{
+			loop_.post(std::move(task));
+		});
+	}
+	
+	void run()
+	{
+		std::cout << "starting executor test" << std::endl;
+		
+		auto loop_thread = std::this_thread::get_id();
+		std::size_t replies = 0;
+		
+		for (auto i = 0; i < 8; ++i)
+		{
+			cache_.get(std::to_string(i % 4), [&, i] (cache_type::const_iterator iter, const std::error_code& err)
+			{
+				if (std::this_thread::get_id() != loop_thread)
+				{
+					report_failure() << "executor test failed: reply invoked on backend thread" << std::endl;
+				}
+				if (err || iter == cache_.cend() || iter->get() != static_cast<std::uint64_t>(i % 4))
+				{
+					report_failure() << "executor test failed: unexpected result for key " << i % 4 << std::endl;
+				}
+				++replies;
+			});
+		}
+		
+		std::uint64_t extracted = 0;
+		test_loop origin;
+		
+		cache_.get("3", [&] (cache_type::task_f task) { origin.post(std::move(task)); },
+			[] (cache_type::const_iterator iter, const std::error_code& err)
+			{
+				return err ? 0 : iter->get();
+			},
+			[&] (std::uint64_t value)
+			{
+				extracted = value;
+			});
+		
+		std::thread backend([this] ()
+		{
+			for (auto& pending : pending_)
+			{
+				pending.second(cache_type::value_uptr_t(new test_value_move_constructible(std::stoull(pending.first))), std::error_code());
+			}
+		});
+		backend.join();
+		
+		if (replies != 0)
+		{
+			report_failure() << "executor test failed: replies invoked before the loop ran" << std::endl;
+		}
+		
+		auto wakeups = loop_.run();
+		
+		if (wakeups != 1)
+		{
+			report_failure() << "executor test failed: " << wakeups << " loop tasks for one burst of completions, expected 1" << std::endl;
+		}
+		
+		if (replies != 8 || cache_.size() != 4)
+		{
+			report_failure() << "executor test failed: " << replies << " replies and " << cache_.size() << " entries, expected 8 and 4" << std::endl;
+		}
+		
+		if (extracted != 0 || origin.run() != 1 || extracted != 3)
+		{
+			report_failure() << "executor test failed: extracted value not delivered on the origin executor" << std::endl;
+		}
+	}
+	
+private:
+	std::vector<std::pair<std::string, cache_type::miss_handler_reply_f>> pending_;
+	test_loop loop_;
+	cache_type cache_;
+};
+
+// reentrancy_test exercises replies that re-enter the cache: chains of synchronous misses
+// issued from replies, replies that invalidate or flush the entry other waiters are about to
+// receive, and a seeded random mix of nested operations.
+
+class reentrancy_test
+{
+public:
+	using cache_type = utils::lru_cache<std::string, test_value_move_constructible>;
+	using reply_t = std::pair<std::string, cache_type::miss_handler_reply_f>;
+	
+	reentrancy_test()
+	:
+	cache_(
+		[this] (const std::string& key, cache_type::miss_handler_reply_f reply)
+		{
+			++misses_;
+			if (async_)
+			{
+				pending_.emplace_back(key, reply);
+			}
+			else if (fail_next_)
+			{
+				fail_next_ = false;
+				reply(cache_type::value_uptr_t(), std::make_error_code(std::errc::io_error));
+			}
+			else
+			{
+				reply(cache_type::value_uptr_t(new test_value_move_constructible(std::stoull(key))), std::error_code());
+			}
+		}, 16)
+	{}
+	
+	bool check(cache_type::const_iterator iter, const std::error_code& err, const std::string& key)
+	{
+		if (err || iter == cache_.cend() || iter->get() != std::stoull(key))
+		{
+			report_failure() << "reentrancy test failed: invalid result for key " << key << std::endl;
+			return false;
+		}
+		return true;
+	}
+	
+	void release_pending()
+	{
+		while (!pending_.empty())
+		{
+			auto pending = std::move(pending_.front());
+			pending_.pop_front();
+			pending.second(cache_type::value_uptr_t(new test_value_move_constructible(std::stoull(pending.first))), std::error_code());
+		}
+	}
+	
+	void chained_miss_test()
+	{
+		// each reply requests the next key, which misses, and the miss handler replies synchronously
+		
+		const std::size_t chain_length = 200000;
+		std::size_t depth = 0;
+		std::size_t max_depth = 0;
+		std::size_t replies = 0;
+		
+		std::function<void(std::size_t)> request = [&] (std::size_t n)
+		{
+			auto key = std::to_string(n);
+			cache_.get(key, [&, n, key] (cache_type::const_iterator iter, const std::error_code& err)
+			{
+				max_depth = std::max(max_depth, ++depth);
+				check(iter, err, key);
+				++replies;
+				if (n + 1 < chain_length)
+				{
+					request(n + 1);
+				}
+				--depth;
+			});
+		};
+		
+		request(0);
+		
+		if (replies != chain_length || max_depth != 1)
+		{
+			report_failure() << "reentrancy test failed: chain of " << replies << " replies, maximum nesting " << max_depth << std::endl;
+		}
+	}
+	
+	void invalidating_waiter_test()
+	{
+		// the first of several coalesced waiters invalidates the entry and flushes the cache
+		
+		async_ = true;
+		std::size_t replies = 0;
+		for (auto i = 0; i < 5; ++i)
+		{
+			cache_.get("1000", [&, i] (cache_type::const_iterator iter, const std::error_code& err)
+			{
+				check(iter, err, "1000");
+				++replies;
+				if (i == 0)
+				{
+					cache_.invalidate("1000");
+					cache_.flush();
+				}
+			});
+		}
+		release_pending();
+		async_ = false;
+		
+		if (replies != 5 || cache_.find("1000") != cache_.cend())
+		{
+			report_failure() << "reentrancy test failed: invalidation by a waiter" << std::endl;
+		}
+	}
+	
+	void retry_after_error_test()
+	{
+		// a waiter that retries the same key after an error starts a new miss
+		
+		fail_next_ = true;
+		auto misses = misses_;
+		bool retried = false;
+		cache_.get("2000", [&] (cache_type::const_iterator iter, const std::error_code& err)
+		{
+			if (!err)
+			{
+				report_failure() << "reentrancy test failed: expected an error" << std::endl;
+			}
+			cache_.get("2000", [&] (cache_type::const_iterator iter, const std::error_code& err)
+			{
+				retried = check(iter, err, "2000");
+			});
+		});
+		
+		if (!retried || misses_ - misses != 2)
+		{
+			report_failure() << "reentrancy test failed: retry after error" << std::endl;
+		}
+	}
+	
+	void random_nesting_test()
+	{
+		std::mt19937 rng(20161);
+		std::size_t budget = 100000;
+		std::size_t replies = 0;
+		std::size_t requests = 0;
+		
+		std::function<void()> random_op = [&] ()
+		{
+			if (budget == 0)
+			{
+				return;
+			}
+			--budget;
+			auto key = std::to_string(rng() % 40);
+			switch (rng() % 8)
+			{
+				case 0:
+					cache_.invalidate(key);
+					break;
+				case 1:
+					if (rng() % 16 == 0)
+					{
+						cache_.flush();
+					}
+					break;
+				default:
+					async_ = (rng() % 4 == 0);
+					++requests;
+					cache_.get(key, [&, key] (cache_type::const_iterator iter, const std::error_code& err)
+					{
+						check(iter, err, key);
+						++replies;
+						for (auto n = rng() % 3; n > 0; --n)
+						{
+							random_op();
+						}
+					});
+					break;
+			}
+		};
+		
+		while (budget > 0)
+		{
+			random_op();
+			if (rng() % 8 == 0)
+			{
+				release_pending();
+			}
+		}
+		release_pending();
+		async_ = false;
+		
+		if (replies != requests || cache_.size() > cache_.limit())
+		{
+			report_failure() << "reentrancy test failed: " << replies << " replies for " << requests << " requests" << std::endl;
+		}
+	}
+	
+	void run()
+	{
+		std::cout << "starting reentrancy test" << std::endl;
+		
+		retry_after_error_test();
+		
+		cache_.set_deferred_delivery(true);
+		
+		chained_miss_test();
+		invalidating_waiter_test();
+		retry_after_error_test();
+		random_nesting_test();
+	}
+	
+private:
+	std::deque<reply_t> pending_;
+	bool async_ = false;
+	bool fail_next_ = false;
+	std::size_t misses_ = 0;
+	cache_type cache_;
+};
+
+// write_test exercises put with write-through and write-behind store handlers
+
+class write_test
+{
+public:
+	using cache_type = utils::lru_cache<std::string, test_value_move_constructible>;
+	using value_uptr_t = cache_type::value_uptr_t;
+	using stored_batch_t = std::vector<std::pair<std::string, std::uint64_t>>;
+	
+	write_test()
+	:
+	misses_{0}
+	{}
+	
+	std::unique_ptr<cache_type> make_cache(cache_type::write_policy policy, std::size_t limit)
+	{
+		std::unique_ptr<cache_type> cache{new cache_type(
+			[this] (const std::string& key, cache_type::miss_handler_reply_f reply)
+			{
+				++misses_;
+				pending_misses_.emplace_back(key, reply);
+			}, limit)};
+		
+		cache->set_store_handler([this] (const cache_type::write_batch_t& batch, cache_type::store_handler_reply_f reply)
+		{
+			// the batch is only valid during the call, so copy it
+			
+			stored_batch_t stored;
+			for (auto& item : batch)
+			{
+				stored.emplace_back(*item.first, item.second->get());
+			}
+			stored_.push_back(stored);
+			pending_stores_.emplace_back(stored, reply);
+		}, policy, 4);
+		
+		return cache;
+	}
+	
+	static value_uptr_t make_value(std::uint64_t n)
+	{
+		return value_uptr_t(new test_value_move_constructible(n));
+	}
+	
+	// the miss handler returns the last value stored for the key, or the key's own number
+	
+	void release_misses()
+	{
+		for (auto& pending : pending_misses_)
+		{
+			auto found = backend_.find(pending.first);
+			pending.second(make_value(found != backend_.end() ? found->second : std::stoull(pending.first)), std::error_code());
+		}
+		pending_misses_.clear();
+	}
+	
+	void release_stores(std::error_code err = std::error_code())
+	{
+		for (auto& pending : pending_stores_)
+		{
+			if (!err)
+			{
+				for (auto& item : pending.first)
+				{
+					backend_[item.first] = item.second;
+				}
+			}
+			pending.second(err);
+		}
+		pending_stores_.clear();
+	}
+	
+	void write_through_test()
+	{
+		auto cache = make_cache(cache_type::write_policy::write_through, 5);
+		std::uint64_t received = 0;
+		bool put_replied = false;
+		
+		auto receive = [&] (cache_type::const_iterator iter, const std::error_code& err)
+		{
+			received = (err || iter == cache->cend()) ? 0 : iter->get();
+		};
+		
+		// a get issued while the write is in flight waits for it, without a miss
+		
+		cache->put("1", make_value(100), [&] (const std::error_code& err) { put_replied = !err; });
+		cache->get("1", receive);
+		
+		if (received != 0 || misses_ != 0 || stored_.size() != 1 || stored_[0][0].second != 100)
+		{
+			report_failure() << "write test failed: write-through didn't hold the get" << std::endl;
+		}
+		release_stores();
+		if (received != 100 || !put_replied)
+		{
+			report_failure() << "write test failed: write-through get received " << received << ", expected 100" << std::endl;
+		}
+		
+		// a miss in flight when the put is issued is superseded by the write
+		
+		received = 0;
+		cache->get("2", receive);
+		cache->put("2", make_value(200));
+		release_misses();
+		if (received != 0)
+		{
+			report_failure() << "write test failed: stale miss reply delivered during write" << std::endl;
+		}
+		release_stores();
+		if (received != 200 || cache->find("2") == cache->cend() || cache->find("2")->get() != 200)
+		{
+			report_failure() << "write test failed: write-through after a pending miss received " << received << std::endl;
+		}
+		
+		// a failed write falls back to the miss handler for waiting gets
+		
+		received = 0;
+		put_replied = true;
+		cache->put("3", make_value(300), [&] (const std::error_code& err) { put_replied = !err; });
+		cache->get("3", receive);
+		release_stores(std::make_error_code(std::errc::io_error));
+		release_misses();
+		if (received != 3 || put_replied)
+		{
+			report_failure() << "write test failed: failed write-through received " << received << ", expected 3" << std::endl;
+		}
+	}
+	
+	void write_behind_test()
+	{
+		stored_.clear();
+		auto cache = make_cache(cache_type::write_policy::write_behind, 5);
+		
+		// repeated writes to a key are coalesced
+		
+		cache->put("1", make_value(10));
+		cache->put("1", make_value(11));
+		cache->put("1", make_value(12));
+		
+		if (!stored_.empty() || cache->dirty_count() != 1 || cache->find("1")->get() != 12)
+		{
+			report_failure() << "write test failed: write-behind didn't hold the dirty value" << std::endl;
+		}
+		
+		bool flushed = false;
+		cache->flush_writes([&] (const std::error_code& err) { flushed = !err; });
+		release_stores();
+		if (!flushed || stored_.size() != 1 || stored_[0] != stored_batch_t{{"1", 12}} || cache->dirty_count() != 0)
+		{
+			report_failure() << "write test failed: write-behind flush didn't store the coalesced value" << std::endl;
+		}
+		
+		// reaching the batch limit flushes a batch
+		
+		stored_.clear();
+		for (auto i = 2; i < 6; ++i)
+		{
+			cache->put(std::to_string(i), make_value(i * 10));
+		}
+		release_stores();
+		if (stored_.size() != 1 || stored_[0].size() != 4 || cache->dirty_count() != 0)
+		{
+			report_failure() << "write test failed: write-behind didn't flush a full batch" << std::endl;
+		}
+		
+		// evicting a dirty entry writes it first
+		
+		stored_.clear();
+		cache->put("1", make_value(13));
+		for (auto key : {"2", "3", "4", "5"})
+		{
+			cache->get(key, [] (cache_type::const_iterator, const std::error_code&) {});
+		}
+		cache->put("6", make_value(60));
+		
+		if (stored_.empty() || cache->dirty_count() != 1 || cache->find("1") != cache->cend())
+		{
+			report_failure() << "write test failed: dirty entry evicted without being written" << std::endl;
+		}
+		else
+		{
+			stored_batch_t expected{{"1", 13}};
+			if (stored_[0] != expected)
+			{
+				report_failure() << "write test failed: unexpected batch written before eviction" << std::endl;
+			}
+		}
+		
+		// a get for the evicted key waits for its store, rather than reading the old value
+		
+		std::uint64_t received = 0;
+		auto misses = misses_;
+		cache->get("1", [&] (cache_type::const_iterator iter, const std::error_code& err)
+		{
+			received = (err || iter == cache->cend()) ? 0 : iter->get();
+		});
+		if (misses_ != misses)
+		{
+			report_failure() << "write test failed: evicted dirty key read before its store completed" << std::endl;
+		}
+		release_stores();
+		release_misses();
+		if (received != 13)
+		{
+			report_failure() << "write test failed: get after evicting a dirty key received " << received << ", expected 13" << std::endl;
+		}
+		
+		// as does a get after invalidate or flush
+		
+		for (bool flush : {false, true})
+		{
+			received = 0;
+			cache->put("7", make_value(70 + flush));
+			if (flush)
+			{
+				cache->flush();
+			}
+			else
+			{
+				cache->invalidate("7");
+			}
+			cache->get("7", [&] (cache_type::const_iterator iter, const std::error_code& err)
+			{
+				received = (err || iter == cache->cend()) ? 0 : iter->get();
+			});
+			release_misses();
+			release_stores();
+			release_misses();
+			if (received != 70 + flush)
+			{
+				report_failure() << "write test failed: get after " << (flush ? "flush" : "invalidate") << " of a dirty key received "
+					<< received << std::endl;
+			}
+		}
+	}
+	
+	void run()
+	{
+		std::cout << "starting write test" << std::endl;
+		
+		write_through_test();
+		write_behind_test();
+	}
+	
+private:
+	std::size_t misses_;
+	std::vector<std::pair<std::string, cache_type::miss_handler_reply_f>> pending_misses_;
+	std::vector<std::pair<stored_batch_t, cache_type::store_handler_reply_f>> pending_stores_;
+	std::vector<stored_batch_t> stored_;
+	std::map<std::string, std::uint64_t> backend_;
+};
+
+// removal_listener_test checks the causes reported to the removal listener, and that removals
+// are delivered in batches after the replies of the operation that caused them
+
+class removal_listener_test
+{
+public:
+	using cache_type = utils::lru_cache<std::string, test_value_move_constructible>;
+	using cause_t = cache_type::removal_cause;
+	
+	removal_listener_test()
+	:
+	cache_(
+		[] (const std::string& key, cache_type::miss_handler_reply_f reply)
+		{
+			reply(cache_type::value_uptr_t(new test_value_move_constructible(std::stoull(key))), std::error_code());
+		}, 3)
+	{
+		cache_.set_removal_listener([this] (cache_type::removal_batch_t& batch)
+		{
+			log_.push_back("batch");
+			for (auto& removed : batch)
+			{
+				if (removed.value()->get() != std::stoull(removed.key()))
+				{
+					report_failure() << "removal listener test failed: value doesn't match key " << removed.key() << std::endl;
+				}
+				log_.push_back(removed.key() + ":" + cause_name(removed.cause()));
+				kept_.push_back(std::move(removed.value()));
+			}
+		});
+	}
+	
+	static std::string cause_name(cause_t cause)
+	{
+		switch (cause)
+		{
+			case cause_t::size: return "size";
+			case cause_t::invalidated: return "invalidated";
+			case cause_t::flushed: return "flushed";
+			case cause_t::replaced: return "replaced";
+		}
+		return "unknown";
+	}
+	
+	void get(const std::string& key)
+	{
+		cache_.get(key, [this, key] (cache_type::const_iterator, const std::error_code&)
+		{
+			log_.push_back("reply " + key);
+		});
+	}
+	
+	void expect(const std::vector<std::string>& expected)
+	{
+		if (log_ != expected)
+		{
+			report_failure() << "removal listener test failed: unexpected event sequence:";
+			for (auto& event : log_)
+			{
+				std::cout << " [" << event << "]";
+			}
+			std::cout << std::endl;
+		}
+		log_.clear();
+	}
+	
+	void run()
+	{
+		std::cout << "starting removal listener test" << std::endl;
+		
+		get("0");
+		get("1");
+		get("2");
+		expect({"reply 0", "reply 1", "reply 2"});
+		
+		// the eviction is reported after the reply to the get that caused it
+		
+		get("3");
+		expect({"reply 3", "batch", "0:size"});
+		
+		cache_.invalidate("1");
+		expect({"batch", "1:invalidated"});
+		
+		cache_.put("2", cache_type::value_uptr_t(new test_value_move_constructible(2)));
+		expect({"batch", "2:replaced"});
+		
+		// evictions caused by a batch of gets are delivered together
+		
+		std::vector<std::string> keys{"4", "5", "6"};
+		cache_.get_many(keys.begin(), keys.end(), [this] (const std::string& key, cache_type::const_iterator, const std::error_code&)
+		{
+			log_.push_back("reply " + key);
+		});
+		expect({"reply 4", "reply 5", "reply 6", "batch", "3:size", "2:size"});
+		
+		cache_.flush();
+		expect({"batch", "6:flushed", "5:flushed", "4:flushed"});
+		
+		// the listener took ownership of every removed value
+		
+		if (kept_.size() != 8 || kept_.back()->get() != 4)
+		{
+			report_failure() << "removal listener test failed: listener didn't receive ownership of the values" << std::endl;
+		}
+		
+		// with deferred delivery, a removal by an operation deferred during a hit's reply is
+		// reported before the get returns
+		
+		cache_.set_deferred_delivery(true);
+		get("7");
+		get("8");
+		expect({"reply 7", "reply 8"});
+		
+		cache_.get("7", [this] (cache_type::const_iterator, const std::error_code&)
+		{
+			log_.push_back("reply 7");
+			cache_.invalidate("8");
+		});
+		expect({"reply 7", "batch", "8:invalidated"});
+		cache_.set_deferred_delivery(false);
+	}
+	
+private:
+	std::vector<std::string> log_;
+	std::vector<cache_type::value_uptr_t> kept_;
+	cache_type cache_;
+};
+
+// file_tier_test runs a small cache over a file tier in a local temporary file, checking
+// that evicted values are served from the tier rather than the miss handler, that the tier
+// is compacted in usage order, and that invalidation and writes through the tier remove
+// stale records. Without an I/O executor, compaction copies two records per removal batch,
+// so values are read back while their records are still moving.
+
+class file_tier_test
+{
+public:
+	using tier_type = utils::file_tier<std::string, test_value_move_constructible>;
+	using cache_type = tier_type::cache_type;
+	
+	static const std::size_t record_size = sizeof(std::uint64_t);
+	
+	file_tier_test(bool use_io_executor)
+	:
+	use_io_executor_{use_io_executor},
+	remote_misses_{0},
+	tier_("lru_file_tier_test." + std::to_string(use_io_executor) + ".tmp", 20 * record_size, serialize, deserialize),
+	cache_(tier_.miss_handler(
+		[this] (const std::string& key, cache_type::miss_handler_reply_f reply)
+		{
+			++remote_misses_;
+			reply(cache_type::value_uptr_t(new test_value_move_constructible(std::stoull(key))), std::error_code());
+		}), 4)
+	{
+		tier_.attach(cache_);
+		if (use_io_executor_)
+		{
+			auto post = [this] (cache_type::task_f task) { loop_.post(std::move(task)); };
+			tier_.set_io_executor(post, post);
+			cache_.set_executor(post);
+		}
+		else
+		{
+			tier_.set_compaction_step(2 * record_size);
+		}
+	}
+	
+	static void serialize(const test_value_move_constructible& value, std::string& out)
+	{
+		auto n = value.get();
+		out.append(reinterpret_cast<const char*>(&n), sizeof(n));
+	}
+	
+	static cache_type::value_uptr_t deserialize(const char* data, std::size_t size)
+	{
+		std::uint64_t n = 0;
+		if (size != sizeof(n))
+		{
+			return cache_type::value_uptr_t();
+		}
+		std::memcpy(&n, data, sizeof(n));
+		return cache_type::value_uptr_t(new test_value_move_constructible(n));
+	}
+	
+	std::string name() const
+	{
+		return use_io_executor_ ? "file tier test (io executor)" : "file tier test";
+	}
+	
+	// destroy_while_reading destroys a tier (after its cache) while a read is queued on the
+	// I/O executor; the read's completion must be dropped rather than reach the destroyed tier
+	
+	void destroy_while_reading()
+	{
+		auto post = [this] (cache_type::task_f task) { loop_.post(std::move(task)); };
+		bool replied = false;
+		{
+			tier_type tier("lru_file_tier_test.destroyed.tmp", 20 * record_size, serialize, deserialize);
+			cache_type cache(tier.miss_handler(
+				[] (const std::string& key, cache_type::miss_handler_reply_f reply)
+				{
+					reply(cache_type::value_uptr_t(new test_value_move_constructible(std::stoull(key))), std::error_code());
+				}), 1);
+			tier.attach(cache);
+			tier.set_io_executor(post, post);
+			
+			cache.get("1", [] (cache_type::const_iterator, const std::error_code&) {});
+			cache.get("2", [] (cache_type::const_iterator, const std::error_code&) {});
+			if (!tier.contains("1"))
+			{
+				report_failure() << name() << " failed: value wasn't spilled before the tier was destroyed" << std::endl;
+			}
+			cache.get("1", [&] (cache_type::const_iterator, const std::error_code&) { replied = true; });
+		}
+		loop_.run();
+		if (replied)
+		{
+			report_failure() << name() << " failed: read completed after the tier was destroyed" << std::endl;
+		}
+	}
+	
+	void get(std::size_t n)
+	{
+		auto key = std::to_string(n);
+		bool replied = false;
+		cache_.get(key, [&, key, n] (cache_type::const_iterator iter, const std::error_code& err)
+		{
+			replied = true;
+			if (err || iter == cache_.cend() || iter->get() != n)
+			{
+				report_failure() << name() << " failed: wrong value for key " << key << std::endl;
+			}
+		});
+		loop_.run();
+		if (!replied)
+		{
+			report_failure() << name() << " failed: no reply for key " << key << std::endl;
+		}
+	}
+	
+	void run()
+	{
+		std::cout << "starting " << name() << std::endl;
+		
+		if (!tier_.is_open())
+		{
+			report_failure() << name() << " failed: couldn't open the tier file" << std::endl;
+			return;
+		}
+		
+		for (std::size_t i = 0; i < 10; ++i)
+		{
+			get(i);
+		}
+		
+		if (remote_misses_ != 10 || tier_.size() != 6)
+		{
+			report_failure() << name() << " failed: " << tier_.size() << " values spilled to the tier, expected 6" << std::endl;
+		}
+		
+		// evicted values come back from the tier, and aren't written again when evicted again
+		
+		for (std::size_t i = 0; i < 6; ++i)
+		{
+			get(i);
+		}
+		
+		if (remote_misses_ != 10 || tier_.hits() != 6 || tier_.file_bytes() != 10 * record_size)
+		{
+			report_failure() << name() << " failed: tier hits " << tier_.hits() << ", remote misses " << remote_misses_
+				<< ", file bytes " << tier_.file_bytes() << std::endl;
+		}
+		
+		// overflowing the tier compacts it, keeping the most recently used values
+		
+		bool read_while_compacting = false;
+		for (std::size_t i = 10; i < 30; ++i)
+		{
+			get(i);
+			if (tier_.compacting() && tier_.contains(std::to_string(i - 4)))
+			{
+				auto misses = remote_misses_;
+				get(i - 4);
+				read_while_compacting = (remote_misses_ == misses);
+				if (!read_while_compacting)
+				{
+					report_failure() << name() << " failed: value moving during compaction wasn't read back" << std::endl;
+				}
+			}
+		}
+		
+		if (!use_io_executor_ && !read_while_compacting)
+		{
+			report_failure() << name() << " failed: compaction finished in one step" << std::endl;
+		}
+		
+		// cycling through more keys than the cache holds evicts values the tier already has,
+		// each removal batch taking compaction another step
+		
+		for (std::size_t i = 0; i < 40 && tier_.compacting(); ++i)
+		{
+			get(20 + i % 10);
+		}
+		
+		if (tier_.compacting())
+		{
+			report_failure() << name() << " failed: compaction didn't finish" << std::endl;
+		}
+		
+		if (tier_.file_bytes() > tier_.capacity() || !tier_.contains("25") || tier_.contains("6"))
+		{
+			report_failure() << name() << " failed: compaction didn't keep the most recently used values" << std::endl;
+		}
+		
+		auto misses = remote_misses_;
+		get(25);
+		get(24);
+		if (remote_misses_ != misses)
+		{
+			report_failure() << name() << " failed: value lost by compaction" << std::endl;
+		}
+		
+		// invalidation and writes through the tier remove its records
+		
+		tier_.invalidate("24");
+		tier_.put("23", cache_type::value_uptr_t(new test_value_move_constructible(23)));
+		loop_.run();
+		if (tier_.contains("24") || tier_.contains("23"))
+		{
+			report_failure() << name() << " failed: stale record left in the tier" << std::endl;
+		}
+		get(24);
+		if (remote_misses_ != misses + 1)
+		{
+			report_failure() << name() << " failed: invalidated value served from the tier" << std::endl;
+		}
+		
+		// a value written with the cache's own put, for a key that is only in the tier, replaces
+		// the key's record when it's evicted
+		
+		std::size_t written = 0;
+		for (std::size_t i = 10; i < 30 && written == 0; ++i)
+		{
+			if (tier_.contains(std::to_string(i)) && cache_.find(std::to_string(i)) == cache_.cend())
+			{
+				written = i;
+			}
+		}
+		cache_.put(std::to_string(written), cache_type::value_uptr_t(new test_value_move_constructible(written + 1000)));
+		loop_.run();
+		for (std::size_t i = 40; i < 44; ++i)
+		{
+			get(i);
+		}
+		bool rewritten = false;
+		cache_.get(std::to_string(written), [&] (cache_type::const_iterator iter, const std::error_code& err)
+		{
+			rewritten = !err && iter != cache_.cend() && iter->get() == written + 1000;
+		});
+		loop_.run();
+		if (written == 0 || !rewritten)
+		{
+			report_failure() << name() << " failed: stale record served after a put through the cache" << std::endl;
+		}
+		
+		tier_.flush();
+		if (tier_.size() != 0 || tier_.file_bytes() != 0 || cache_.size() != 0)
+		{
+			report_failure() << name() << " failed: flush didn't empty the tier" << std::endl;
+		}
+		
+		if (use_io_executor_)
+		{
+			destroy_while_reading();
+		}
+	}
+	
+private:
+	bool use_io_executor_;
+	std::size_t remote_misses_;
+	test_loop loop_;
+	tier_type tier_;
+	cache_type cache_;
+};
+
+// uring_test serves a cache from files with uring_file_source, starting many misses at once
+// so their reads are submitted together. A loop with no ring entries can't set up io_uring,
+// which exercises the pread fallback.
+
+class uring_test
+{
+public:
+	using source_type = utils::uring_file_source<std::size_t, test_value_move_constructible>;
+	using cache_type = source_type::cache_type;
+	
+	static const std::size_t file_count = 32;
+	static const std::size_t large_file = 7;
+	static const std::size_t bad_file = 9;
+	static const std::size_t buffer_size = 4096;
+	
+	uring_test(bool use_uring)
+	:
+	use_uring_{use_uring},
+	loop_(use_uring ? 64 : 0, 8, buffer_size),
+	source_(loop_, [] (const std::size_t& key) { return path(key); }, [] (const char* data, std::size_t size)
+	{
+		std::string contents(data, size);
+		if (contents.empty() || !std::isdigit(static_cast<unsigned char>(contents[0])))
+		{
+			return cache_type::value_uptr_t();
+		}
+		return cache_type::value_uptr_t(new test_value_move_constructible(std::stoull(contents)));
+	}),
+	cache_(source_.miss_handler(), file_count)
+	{
+		for (std::size_t i = 0; i < file_count; ++i)
+		{
+			std::string contents = (i == bad_file) ? "x" : std::to_string(i * 10);
+			if (i == large_file)
+			{
+				contents.append(3 * buffer_size, ' ');
+			}
+			auto file = std::fopen(path(i).c_str(), "w");
+			std::fwrite(contents.data(), 1, contents.size(), file);
+			std::fclose(file);
+		}
+	}
+	
+	~uring_test()
+	{
+		for (std::size_t i = 0; i < file_count; ++i)
+		{
+			::unlink(path(i).c_str());
+		}
+	}
+	
+	static std::string path(std::size_t key)
+	{
+		return "lru_uring_test." + std::to_string(key) + ".tmp";
+	}
+	
+	std::string name() const
+	{
+		return use_uring_ ? "uring test" : "uring test (pread fallback)";
+	}
+	
+	void run()
+	{
+		std::cout << "starting " << name() << std::endl;
+		
+		if (use_uring_ && !loop_.is_open())
+		{
+			std::cout << name() << ": io_uring isn't available, testing the fallback" << std::endl;
+		}
+		
+		std::size_t replies = 0;
+		
+		// every key is requested twice, and the key past the last file is missing
+		
+		loop_.post([&] ()
+		{
+			for (std::size_t i = 0; i <= file_count; ++i)
+			{
+				for (int j = 0; j < 2; ++j)
+				{
+					cache_.get(i, [&, i] (cache_type::const_iterator iter, const std::error_code& err)
+					{
+						++replies;
+						if (i == file_count)
+						{
+							if (err != std::errc::no_such_file_or_directory)
+							{
+								report_failure() << name() << " failed: expected an error for a missing file" << std::endl;
+							}
+						}
+						else if (i == bad_file)
+						{
+							if (err != std::errc::bad_message)
+							{
+								report_failure() << name() << " failed: expected an error for a bad file" << std::endl;
+							}
+						}
+						else if (err || iter == cache_.cend() || iter->get() != i * 10)
+						{
+							report_failure() << name() << " failed: wrong value for key " << i << std::endl;
+						}
+					});
+				}
+			}
+		});
+		
+		loop_.run();
+		
+		if (replies != 2 * (file_count + 1))
+		{
+			report_failure() << name() << " failed: " << replies << " replies, expected " << 2 * (file_count + 1) << std::endl;
+		}
+		
+		if (cache_.size() != file_count - 1)
+		{
+			report_failure() << name() << " failed: cache size " << cache_.size() << ", expected " << file_count - 1 << std::endl;
+		}
+		
+		if (loop_.is_open() && (loop_.completions() < file_count || loop_.submits() >= file_count))
+		{
+			report_failure() << name() << " failed: " << loop_.completions() << " reads in "
+				<< loop_.submits() << " submissions; reads weren't batched" << std::endl;
+		}
+		
+		// hits don't touch the loop
+		
+		auto completions = loop_.completions();
+		cache_.get(3, [&] (cache_type::const_iterator iter, const std::error_code& err)
+		{
+			++replies;
+		});
+		if (replies != 2 * (file_count + 1) + 1 || loop_.pending() != 0 || loop_.completions() != completions)
+		{
+			report_failure() << name() << " failed: hit wasn't served from the cache" << std::endl;
+		}
+		
+		// a miss outside the loop starts a read that the next run submits
+		
+		cache_.invalidate(5);
+		bool reloaded = false;
+		cache_.get(5, [&] (cache_type::const_iterator iter, const std::error_code& err)
+		{
+			reloaded = !err && iter != cache_.cend() && iter->get() == 50;
+		});
+		loop_.run();
+		if (!reloaded)
+		{
+			report_failure() << name() << " failed: miss outside the loop wasn't completed" << std::endl;
+		}
+	}
+	
+private:
+	bool use_uring_;
+	utils::uring_loop loop_;
+	source_type source_;
+	cache_type cache_;
+};
+
+// hot_keys_test checks that keys are replicated once they are popular enough, that replicas are
+// served without going through the cache's executor, and that invalidation, writes, flushes and
+// evictions withdraw them. A reader on a second thread then reads a hot key while the cache's
+// thread repeatedly invalidates it.
+
+class hot_keys_test
+{
+public:
+	using cache_type = utils::lru_cache<std::string, test_value_copy_constructible>;
+	using replicator_type = utils::hot_key_replicator<std::string, test_value_copy_constructible>;
+	
+	hot_keys_test()
+	:
+	misses_{0},
+	cache_(
+		[this] (const std::string& key, cache_type::miss_handler_reply_f reply)
+		{
+			++misses_;
+			reply(cache_type::value_uptr_t(new test_value_copy_constructible(std::stoull(key))), std::error_code());
+		}, 8),
+	replicator_(cache_, [this] (cache_type::task_f task) { loop_.post(std::move(task)); }, replicator_type::copy_value, 2, 4),
+	reader_(replicator_, [this] (cache_type::task_f task) { loop_.post(std::move(task)); })
+	{
+		replicator_.attach();
+	}
+	
+	// read returns the value read through the reader, and whether it was served by the replica
+	
+	std::pair<std::uint64_t, bool> read(const std::string& key)
+	{
+		std::uint64_t result = 0;
+		bool replied = false;
+		reader_.get(key,
+			[] (const test_value_copy_constructible* value, std::error_code err)
+			{
+				return value ? value->get() : 0;
+			},
+			[&] (std::uint64_t value)
+			{
+				result = value;
+				replied = true;
+			});
+		bool immediate = replied;
+		loop_.run();
+		return std::make_pair(result, immediate);
+	}
+	
+	void promote(const std::string& key, std::size_t reads)
+	{
+		for (std::size_t i = 0; i < reads; ++i)
+		{
+			auto result = read(key);
+			if (result.first != std::stoull(key))
+			{
+				report_failure() << "hot keys test failed: wrong value for key " << key << std::endl;
+			}
+		}
+	}
+	
+	void run()
+	{
+		std::cout << "starting hot keys test" << std::endl;
+		
+		promote("1", 4);
+		if (!replicator_.is_hot("1") || replicator_.epoch() != 1)
+		{
+			report_failure() << "hot keys test failed: key wasn't replicated at the threshold" << std::endl;
+		}
+		
+		auto misses = misses_;
+		auto result = read("1");
+		if (!result.second || result.first != 1 || reader_.hits() != 1 || misses_ != misses)
+		{
+			report_failure() << "hot keys test failed: replicated key wasn't served by the replica" << std::endl;
+		}
+		
+		// with the replica set full, a key replaces the coldest replicated key only
+		// when it's more popular
+		
+		promote("2", 4);
+		promote("3", 4);
+		if (replicator_.is_hot("3") || replicator_.hot_count() != 2)
+		{
+			report_failure() << "hot keys test failed: replicated key replaced by a key no more popular" << std::endl;
+		}
+		promote("3", 1);
+		if (!replicator_.is_hot("3") || replicator_.hot_count() != 2)
+		{
+			report_failure() << "hot keys test failed: coldest replicated key wasn't replaced" << std::endl;
+		}
+		
+		// invalidate and put withdraw replicas before they return
+		
+		auto epoch = replicator_.epoch();
+		cache_.invalidate("3");
+		if (replicator_.is_hot("3") || reader_.find("3") != nullptr || replicator_.epoch() == epoch)
+		{
+			report_failure() << "hot keys test failed: invalidated key still replicated" << std::endl;
+		}
+		
+		promote("2", 1);
+		cache_.put("2", cache_type::value_uptr_t(new test_value_copy_constructible(20)));
+		if (reader_.find("2") != nullptr || read("2").first != 20)
+		{
+			report_failure() << "hot keys test failed: replaced key still replicated" << std::endl;
+		}
+		
+		// replica hits periodically refresh the cache entry
+		
+		promote("1", 1);
+		for (std::size_t i = 10; i < 16; ++i)
+		{
+			cache_.get(std::to_string(i), [] (cache_type::const_iterator, std::error_code) {});
+		}
+		for (std::size_t i = 0; i < replicator_type::touch_interval; ++i)
+		{
+			read("1");
+		}
+		if (cache_.cbegin() == cache_.cend() || cache_.cbegin()->get() != 1)
+		{
+			report_failure() << "hot keys test failed: replica hits didn't refresh the cache entry" << std::endl;
+		}
+		
+		cache_.flush();
+		if (replicator_.hot_count() != 0 || reader_.find("1") != nullptr)
+		{
+			report_failure() << "hot keys test failed: flush didn't withdraw the replicas" << std::endl;
+		}
+		
+		// a second thread reads a hot key while this thread invalidates it
+		
+		std::atomic<bool> done{false};
+		std::atomic<std::size_t> wrong{0};
+		std::atomic<std::size_t> replies{0};
+		const std::size_t reads = 20000;
+		std::size_t replica_hits = 0;
+		
+		std::thread worker([&] ()
+		{
+			replicator_type::reader reader(replicator_, [this] (cache_type::task_f task) { loop_.post(std::move(task)); });
+			for (std::size_t i = 0; i < reads; ++i)
+			{
+				// bound the reads outstanding on the loop, so that (even on a single core) the
+				// worker can't issue them all before the loop has replicated the key
+				
+				while (i - replies > 64)
+				{
+					std::this_thread::yield();
+				}
+				reader.get("7",
+					[] (const test_value_copy_constructible* value, std::error_code err)
+					{
+						return value ? value->get() : 0;
+					},
+					[&] (std::uint64_t value)
+					{
+						if (value != 7)
+						{
+							++wrong;
+						}
+						++replies;
+					});
+			}
+			replica_hits = reader.hits();
+			done = true;
+		});
+		
+		std::size_t rounds = 0;
+		while (!done || replies != reads)
+		{
+			if (loop_.run() == 0)
+			{
+				std::this_thread::yield();
+			}
+			if (++rounds % 64 == 0)
+			{
+				cache_.invalidate("7");
+			}
+		}
+		worker.join();
+		loop_.run();
+		
+		if (wrong != 0 || replies != reads || replica_hits == 0)
+		{
+			report_failure() << "hot keys test failed: " << wrong << " wrong values, " << replies << " replies, "
+				<< replica_hits << " replica hits" << std::endl;
+		}
+	}
+	
+private:
+	std::size_t misses_;
+	test_loop loop_;
+	cache_type cache_;
+	replicator_type replicator_;
+	replicator_type::reader reader_;
+};
+
+// inflight_group_test populates two caches, with different key and value types, from the same
+// upstream records, and checks that concurrent misses in both caches share one fetch per record,
+// that errors reach every waiting miss, and that a fetch completed on another thread is delivered
+// on the group's executor.
+
+class inflight_group_test
+{
+public:
+	class user_record
+	{
+	public:
+		std::uint64_t id_;
+		std::string name_;
+	};
+	
+	using group_type = utils::inflight_group<std::uint64_t, user_record>;
+	using id_cache_type = utils::lru_cache<std::string, test_value_move_constructible>;
+	using name_cache_type = utils::lru_cache<std::string, std::string>;
+	
+	inflight_group_test()
+	:
+	group_(
+		[this] (const std::uint64_t& id, group_type::fetch_reply_f reply)
+		{
+			pending_.emplace_back(id, reply);
+		}),
+	ids_(group_.miss_handler<id_cache_type>(
+		[] (const std::string& key) { return std::stoull(key.substr(3)); },
+		[] (const std::string& key, const user_record& record)
+		{
+			return id_cache_type::value_uptr_t(new test_value_move_constructible(record.id_));
+		}), 10),
+	names_(group_.miss_handler<name_cache_type>(
+		[] (const std::string& key) { return std::stoull(key.substr(5)); },
+		[] (const std::string& key, const user_record& record)
+		{
+			return record.id_ == 9 ? nullptr : name_cache_type::value_uptr_t(new std::string(record.name_));
+		}), 10)
+	{}
+	
+	void complete(std::size_t index, std::error_code err = std::error_code())
+	{
+		auto id = pending_[index].first;
+		pending_[index].second(err ? nullptr : group_type::upstream_uptr_t(new user_record{id, "user" + std::to_string(id)}), err);
+	}
+	
+	void run()
+	{
+		std::cout << "starting inflight group test" << std::endl;
+		
+		std::size_t id_replies = 0;
+		std::size_t name_replies = 0;
+		
+		for (auto i = 0; i < 2; ++i)
+		{
+			ids_.get("id/7", [&] (id_cache_type::const_iterator iter, const std::error_code& err)
+			{
+				++id_replies;
+				if (err || iter->get() != 7)
+				{
+					report_failure() << "inflight group test failed: wrong id for user 7" << std::endl;
+				}
+			});
+		}
+		names_.get("name/7", [&] (name_cache_type::const_iterator iter, const std::error_code& err)
+		{
+			++name_replies;
+			if (err || *iter != "user7")
+			{
+				report_failure() << "inflight group test failed: wrong name for user 7" << std::endl;
+			}
+		});
+		ids_.get("id/8", [&] (id_cache_type::const_iterator iter, const std::error_code& err)
+		{
+			++id_replies;
+			if (err != std::errc::host_unreachable)
+			{
+				report_failure() << "inflight group test failed: expected the fetch error for user 8" << std::endl;
+			}
+		});
+		names_.get("name/8", [&] (name_cache_type::const_iterator iter, const std::error_code& err)
+		{
+			++name_replies;
+			if (err != std::errc::host_unreachable)
+			{
+				report_failure() << "inflight group test failed: expected the fetch error for user 8" << std::endl;
+			}
+		});
+		
+		// the second get for id/7 is coalesced by its cache, so it doesn't reach the group
+		
+		if (pending_.size() != 2 || group_.fetches() != 2 || group_.collapsed() != 2 || group_.inflight() != 2)
+		{
+			report_failure() << "inflight group test failed: " << group_.fetches() << " fetches started, "
+				<< group_.collapsed() << " collapsed" << std::endl;
+		}
+		
+		complete(0);
+		complete(1, std::make_error_code(std::errc::host_unreachable));
+		
+		if (id_replies != 3 || name_replies != 2 || ids_.size() != 1 || names_.size() != 1 || group_.inflight() != 0)
+		{
+			report_failure() << "inflight group test failed: fetched record wasn't delivered to both caches" << std::endl;
+		}
+		
+		// a converter that can't make a value fails only its own cache's miss
+		
+		bool name_failed = false;
+		bool id_found = false;
+		names_.get("name/9", [&] (name_cache_type::const_iterator iter, const std::error_code& err)
+		{
+			name_failed = (err == std::errc::bad_message);
+		});
+		ids_.get("id/9", [&] (id_cache_type::const_iterator iter, const std::error_code& err)
+		{
+			id_found = !err && iter->get() == 9;
+		});
+		complete(2);
+		if (!name_failed || !id_found)
+		{
+			report_failure() << "inflight group test failed: converter failure not isolated to its cache" << std::endl;
+		}
+		
+		// with an executor, a fetch completed on another thread is delivered by the executor
+		
+		test_loop loop;
+		group_.set_executor([&loop] (group_type::task_f task) { loop.post(std::move(task)); });
+		auto loop_thread = std::this_thread::get_id();
+		bool delivered = false;
+		names_.get("name/11", [&] (name_cache_type::const_iterator iter, const std::error_code& err)
+		{
+			delivered = !err && *iter == "user11" && std::this_thread::get_id() == loop_thread;
+		});
+		std::thread backend([this] () { complete(3); });
+		backend.join();
+		if (delivered || loop.run() != 1 || !delivered)
+		{
+			report_failure() << "inflight group test failed: completion wasn't delivered on the executor" << std::endl;
+		}
+	}
+	
+private:
+	std::vector<std::pair<std::uint64_t, group_type::fetch_reply_f>> pending_;
+	group_type group_;
+	id_cache_type ids_;
+	name_cache_type names_;
+};
+
+// gdsf_test checks that with GreedyDual-Size-Frequency eviction, costly entries (with costs supplied
+// by a cost function, or measured from the miss handler) and frequently used entries outlive cheap ones,
+// and that invalidation, flushes and puts leave the eviction heap consistent.
+
+class gdsf_test
+{
+public:
+	using cache_type = utils::lru_cache<std::string, test_value_move_constructible, std::hash<std::string>, std::equal_to<std::string>, utils::cache_policies<utils::gdsf_eviction>>;
+	
+	gdsf_test()
+	:
+	cache_(
+		[this] (const std::string& key, cache_type::miss_handler_reply_f reply)
+		{
+			if (key.compare(0, 4, "slow") == 0 || key.compare(0, 4, "fast") == 0)
+			{
+				pending_.emplace_back(key, reply);
+			}
+			else
+			{
+				reply(cache_type::value_uptr_t(new test_value_move_constructible(key.size())), std::error_code());
+			}
+		}, 3)
+	{}
+	
+	void get(const std::string& key)
+	{
+		cache_.get(key, [] (cache_type::const_iterator, std::error_code) {});
+	}
+	
+	bool cached(const std::string& key)
+	{
+		return cache_.find(key) != cache_.cend();
+	}
+	
+	void run()
+	{
+		std::cout << "starting gdsf test" << std::endl;
+		
+		cache_.set_cost_function([] (const std::string& key, const test_value_move_constructible&, double measured)
+		{
+			return key == "x1" ? 100.0 : 1.0;
+		});
+		
+		// a costly key outlives many cheap ones, although it's the least recently used
+		
+		get("x1");
+		for (char c = 'a'; c <= 'z'; ++c)
+		{
+			get(std::string(1, c));
+		}
+		if (!cached("x1") || cache_.size() != 3)
+		{
+			report_failure() << "gdsf test failed: costly entry was evicted" << std::endl;
+		}
+		
+		// a frequently used cheap key outlives other cheap keys
+		
+		get("h");
+		for (auto i = 0; i < 10; ++i)
+		{
+			get("h");
+		}
+		get("i");
+		get("j");
+		get("k");
+		if (!cached("h") || !cached("x1") || cached("i") || cached("j"))
+		{
+			report_failure() << "gdsf test failed: frequently used entry was evicted" << std::endl;
+		}
+		
+		// invalidating, putting and flushing keep the eviction heap consistent
+		
+		cache_.invalidate("x1");
+		cache_.put("p", cache_type::value_uptr_t(new test_value_move_constructible(16)));
+		get("l");
+		get("m");
+		if (cached("x1") || !cached("m") || cache_.size() != 3)
+		{
+			report_failure() << "gdsf test failed: wrong entries after invalidate and put" << std::endl;
+		}
+		cache_.flush();
+		for (char c = 'a'; c <= 'f'; ++c)
+		{
+			get(std::string(1, c));
+		}
+		if (cache_.size() != 3 || !cached("f"))
+		{
+			report_failure() << "gdsf test failed: wrong entries after flush" << std::endl;
+		}
+		
+		// without a cost function, the measured miss latency is the cost
+		
+		cache_.set_cost_function(nullptr);
+		cache_.flush();
+		get("slow");
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		pending_.back().second(cache_type::value_uptr_t(new test_value_move_constructible(1)), std::error_code());
+		for (auto i = 1; i <= 4; ++i)
+		{
+			get("fast" + std::to_string(i));
+			pending_.back().second(cache_type::value_uptr_t(new test_value_move_constructible(i)), std::error_code());
+		}
+		if (!cached("slow") || !cached("fast4") || cache_.size() != 3)
+		{
+			report_failure() << "gdsf test failed: entry with a slow miss was evicted" << std::endl;
+		}
+	}
+	
+private:
+	std::vector<std::pair<std::string, cache_type::miss_handler_reply_f>> pending_;
+	cache_type cache_;
+};
+
+// node_size_probe exposes the size of a cache type's node. The default policies must add nothing
+// to a node, which holds only its value pointer and list links; statistics (and write-behind
+// dirtiness) are kept per cache, not per entry.
+
+template<class Cache>
+class node_size_probe : public Cache
+{
+public:
+	static const std::size_t node_size = sizeof(typename Cache::node);
+};
+
+using default_node_probe = node_size_probe<utils::lru_cache<std::string, test_value>>;
+using counting_node_probe = node_size_probe<utils::lru_cache<std::string, test_value, std::hash<std::string>,
+	std::equal_to<std::string>, utils::cache_policies<utils::lru_eviction, utils::counting_stats>>>;
+using ttl_node_probe = node_size_probe<utils::lru_cache<std::string, test_value, std::hash<std::string>,
+	std::equal_to<std::string>, utils::cache_policies<utils::lru_eviction, utils::no_stats, utils::ttl_expiry>>>;
+
+static_assert(default_node_probe::node_size == sizeof(std::unique_ptr<test_value>) + 2 * sizeof(void*),
+	"the default policies must not enlarge the node");
+static_assert(counting_node_probe::node_size == default_node_probe::node_size, "statistics must not enlarge the node");
+static_assert(ttl_node_probe::node_size == default_node_probe::node_size + sizeof(std::chrono::steady_clock::time_point),
+	"expiry adds exactly a time point to the node");
+
+// cache_group_test gives two caches in a group the same limit, although one has a working set
+// larger than its limit, and the other a much smaller one, and checks that rebalancing moves
+// capacity to the first without exceeding the budget, and that set_limit evicts the excess.
+
+class cache_group_test
+{
+public:
+	using cache_type = utils::lru_cache<std::size_t, test_value_move_constructible, std::hash<std::size_t>,
+		std::equal_to<std::size_t>, utils::cache_policies<utils::lru_eviction, utils::mrc_stats>>;
+	
+	static const std::size_t budget = 200;
+	
+	cache_group_test()
+	:
+	rng_(20161),
+	large_(miss_handler(), budget / 2),
+	small_(miss_handler(), budget / 2),
+	group_(budget, 16)
+	{
+		group_.add(large_);
+		group_.add(small_, 1, 10);
+	}
+	
+	cache_type::miss_handler_f miss_handler()
+	{
+		return [] (const std::size_t& key, cache_type::miss_handler_reply_f reply)
+		{
+			reply(cache_type::value_uptr_t(new test_value_move_constructible(key)), std::error_code());
+		};
+	}
+	
+	void get(cache_type& cache, std::size_t key)
+	{
+		cache.get(key, [key] (cache_type::const_iterator iter, const std::error_code& err)
+		{
+			if (err || iter->get() != key)
+			{
+				report_failure() << "cache group test failed: wrong value for key " << key << std::endl;
+			}
+		});
+	}
+	
+	// run_round makes uniformly random requests for 150 keys of the large cache and 20 keys of
+	// the small one, and returns the total misses
+	
+	std::uint64_t run_round()
+	{
+		auto misses = large_.stats().misses() + small_.stats().misses();
+		for (std::size_t i = 0; i < 4000; ++i)
+		{
+			get(large_, rng_() % 150);
+			get(small_, 1000 + rng_() % 20);
+		}
+		return large_.stats().misses() + small_.stats().misses() - misses;
+	}
+	
+	// sampled_curve_test checks that a curve sampled at 1/16 is close to the exact one
+	
+	void sampled_curve_test()
+	{
+		utils::detail::shards_sampler exact;
+		utils::detail::shards_sampler sampled;
+		exact.configure(1, 1 << 15);
+		sampled.configure(1.0 / 16, 1024);
+		for (std::size_t i = 0; i < 200000; ++i)
+		{
+			auto key = (rng_() % 2 == 0) ? rng_() % 1000 : rng_() % 10000;
+			exact.access(key);
+			sampled.access(key);
+		}
+		
+		for (std::size_t size : {100, 1000, 5000, 10000})
+		{
+			auto expected = exact.misses(size) / exact.accesses();
+			auto estimate = sampled.misses(size) / sampled.accesses();
+			if (std::abs(expected - estimate) > 0.03)
+			{
+				report_failure() << "cache group test failed: sampled miss ratio " << estimate << " at size " << size
+					<< ", exact " << expected << std::endl;
+			}
+		}
+	}
+	
+	void run()
+	{
+		std::cout << "starting cache group test" << std::endl;
+		
+		// with a sampling rate of one, the curve is exact: a cache of 150 or more would hit every
+		// request for the large cache's keys after the first
+		
+		run_round();
+		auto& sampler = large_.stats().sampler();
+		if (sampler.rate() != 1 || sampler.misses(150) != 150 || sampler.misses(100) <= 150)
+		{
+			report_failure() << "cache group test failed: wrong miss-ratio curve" << std::endl;
+		}
+		
+		sampled_curve_test();
+		
+		auto first = run_round();
+		std::size_t rounds = 0;
+		while (group_.rebalance())
+		{
+			if (large_.limit() + small_.limit() > budget || small_.size() > small_.limit())
+			{
+				report_failure() << "cache group test failed: limits " << large_.limit() << " and " << small_.limit()
+					<< " exceed the budget" << std::endl;
+			}
+			run_round();
+			++rounds;
+		}
+		auto last = run_round();
+		
+		if (rounds == 0 || large_.limit() < 150 || small_.limit() < 20 || large_.limit() + small_.limit() != budget || last * 10 > first)
+		{
+			report_failure() << "cache group test failed: limits " << large_.limit() << " and " << small_.limit() << " after "
+				<< rounds << " rounds, misses " << first << " before and " << last << " after" << std::endl;
+		}
+	}
+	
+private:
+	std::mt19937 rng_;
+	cache_type large_;
+	cache_type small_;
+	utils::cache_group group_;
+};
+
+// manual_clock is a clock that only moves when it is advanced, so that expiry can be tested
+// without sleeping
+
+class manual_clock
+{
+public:
+	using duration = std::chrono::steady_clock::duration;
+	using rep = duration::rep;
+	using period = duration::period;
+	using time_point = std::chrono::time_point<manual_clock>;
+	
+	static const bool is_steady = true;
+	
+	static time_point now()
+	{
+		return current();
+	}
+	
+	static void advance(duration elapsed)
+	{
+		current() += elapsed;
+	}
+	
+private:
+	static time_point& current()
+	{
+		static time_point now;
+		return now;
+	}
+};
+
+// policy_test checks the optional statistics and expiry policies
+
+class policy_test
+{
+public:
+	using cache_type = utils::lru_cache<std::string, test_value_move_constructible, std::hash<std::string>,
+		std::equal_to<std::string>, utils::cache_policies<utils::lru_eviction, utils::counting_stats, utils::basic_ttl_expiry<manual_clock>>>;
+	
+	policy_test()
+	:
+	misses_{0},
+	cache_(
+		[this] (const std::string& key, cache_type::miss_handler_reply_f reply)
+		{
+			++misses_;
+			reply(cache_type::value_uptr_t(new test_value_move_constructible(std::stoull(key))), std::error_code());
+		}, 2)
+	{}
+	
+	void get(const std::string& key)
+	{
+		cache_.get(key, [key] (cache_type::const_iterator iter, const std::error_code& err)
+		{
+			if (err || iter->get() != std::stoull(key))
+			{
+				report_failure() << "policy test failed: wrong value for key " << key << std::endl;
+			}
+		});
+	}
+	
+	void run()
+	{
+		std::cout << "starting policy test" << std::endl;
+		
+		std::vector<cache_type::removal_cause> causes;
+		cache_.set_removal_listener([&] (cache_type::removal_batch_t& batch)
+		{
+			for (auto& removed : batch)
+			{
+				causes.push_back(removed.cause());
+			}
+		});
+		
+		get("1");
+		get("1");
+		get("2");
+		get("3");
+		
+		auto& stats = cache_.stats();
+		if (stats.hits() != 1 || stats.misses() != 3 || stats.evictions() != 1 || stats.expirations() != 0)
+		{
+			report_failure() << "policy test failed: wrong counts " << stats.hits() << "/" << stats.misses() << "/" << stats.evictions() << std::endl;
+		}
+		
+		// entries added before the time to live is set don't expire
+		
+		cache_.set_time_to_live(std::chrono::milliseconds(10));
+		get("4");
+		manual_clock::advance(std::chrono::milliseconds(20));
+		
+		if (cache_.find("4") != cache_.cend() || cache_.find("3") == cache_.cend())
+		{
+			report_failure() << "policy test failed: find returned an expired entry" << std::endl;
+		}
+		
+		std::vector<std::string> keys{"4", "3"};
+		std::vector<cache_type::const_iterator> found;
+		cache_.find_many(keys.begin(), keys.end(), std::back_inserter(found));
+		if (found.size() != 2 || found[0] != cache_.cend() || found[1] == cache_.cend())
+		{
+			report_failure() << "policy test failed: find_many returned an expired entry" << std::endl;
+		}
+		
+		auto misses = misses_;
+		get("4");
+		get("3");
+		if (misses_ != misses + 1 || stats.expirations() != 1 || causes.size() != 3 || causes.back() != cache_type::removal_cause::expired)
+		{
+			report_failure() << "policy test failed: expired entry wasn't reloaded" << std::endl;
+		}
+		
+		manual_clock::advance(std::chrono::milliseconds(9));
+		get("4");
+		if (misses_ != misses + 1)
+		{
+			report_failure() << "policy test failed: reloaded entry expired early" << std::endl;
+		}
+		
+		manual_clock::advance(std::chrono::milliseconds(1));
+		get("4");
+		if (misses_ != misses + 2)
+		{
+			report_failure() << "policy test failed: reloaded entry didn't expire on time" << std::endl;
+		}
+		
+		// a write-behind put that rewrites an entry in place gives it a new life
+		
+		cache_.set_store_handler([] (const cache_type::write_batch_t&, cache_type::store_handler_reply_f reply)
+		{
+			reply(std::error_code());
+		}, cache_type::write_policy::write_behind);
+		cache_.put("9", cache_type::value_uptr_t(new test_value_move_constructible(9)));
+		manual_clock::advance(std::chrono::milliseconds(6));
+		cache_.put("9", cache_type::value_uptr_t(new test_value_move_constructible(9)));
+		manual_clock::advance(std::chrono::milliseconds(6));
+		if (cache_.find("9") == cache_.cend())
+		{
+			report_failure() << "policy test failed: rewritten entry kept its old expiry time" << std::endl;
+		}
+	}
+	
+private:
+	std::size_t misses_;
+	cache_type cache_;
+};
+
+// tier_chain_test runs a file tier and a hot key replicator over one cache with gdsf eviction
+// and expiry, the replicator's removal listener chained after the tier's. It checks that evicted
+// values are spilled to the tier, that invalidation through the tier withdraws a replica, that
+// expired values, in memory or spilled, are dropped from the tier rather than served from it, and
+// that an expired replica isn't served.
+
+class tier_chain_test
+{
+public:
+	using cache_type = utils::lru_cache<std::string, test_value_copy_constructible, std::hash<std::string>,
+		std::equal_to<std::string>, utils::cache_policies<utils::gdsf_eviction, utils::no_stats, utils::basic_ttl_expiry<manual_clock>>>;
+	using tier_type = utils::basic_file_tier<cache_type>;
+	using replicator_type = utils::basic_hot_key_replicator<cache_type>;
+	
+	tier_chain_test()
+	:
+	remote_misses_{0},
+	tier_(
+		"lru_tier_chain_test.tmp",
+		1024,
+		[] (const test_value_copy_constructible& value, std::string& out)
+		{
+			auto n = value.get();
+			out.append(reinterpret_cast<const char*>(&n), sizeof(n));
+		},
+		[] (const char* data, std::size_t size)
+		{
+			std::uint64_t n = 0;
+			if (size != sizeof(n))
+			{
+				return cache_type::value_uptr_t();
+			}
+			std::memcpy(&n, data, sizeof(n));
+			return cache_type::value_uptr_t(new test_value_copy_constructible(n));
+		}),
+	cache_(tier_.miss_handler(
+		[this] (const std::string& key, cache_type::miss_handler_reply_f reply)
+		{
+			++remote_misses_;
+			reply(cache_type::value_uptr_t(new test_value_copy_constructible(std::stoull(key))), std::error_code());
+		}), 4),
+	replicator_(cache_, [this] (cache_type::task_f task) { loop_.post(std::move(task)); }, replicator_type::copy_value, 2, 4),
+	reader_(replicator_, [this] (cache_type::task_f task) { loop_.post(std::move(task)); })
+	{
+		tier_.attach(cache_, replicator_.removal_listener());
+		cache_.set_time_to_live(std::chrono::milliseconds(100));
+	}
+	
+	void get(const std::string& key)
+	{
+		cache_.get(key, [key] (cache_type::const_iterator iter, const std::error_code& err)
+		{
+			if (err || iter->get() != std::stoull(key))
+			{
+				report_failure() << "tier chain test failed: wrong value for key " << key << std::endl;
+			}
+		});
+	}
+	
+	// read returns the value read through the reader, and whether it was served by the replica
+	
+	std::pair<std::uint64_t, bool> read(const std::string& key)
+	{
+		std::uint64_t result = 0;
+		bool replied = false;
+		reader_.get(key,
+			[] (const test_value_copy_constructible* value, std::error_code err)
+			{
+				return value ? value->get() : 0;
+			},
+			[&] (std::uint64_t value)
+			{
+				result = value;
+				replied = true;
+			});
+		bool immediate = replied;
+		loop_.run();
+		return std::make_pair(result, immediate);
+	}
+	
+	void run()
+	{
+		std::cout << "starting tier chain test" << std::endl;
+		
+		for (std::size_t i = 0; i < 4; ++i)
+		{
+			read("1");
+		}
+		if (!replicator_.is_hot("1"))
+		{
+			report_failure() << "tier chain test failed: key wasn't replicated" << std::endl;
+		}
+		
+		for (std::size_t i = 2; i < 10; ++i)
+		{
+			get(std::to_string(i));
+		}
+		if (tier_.size() != 9 - cache_.size())
+		{
+			report_failure() << "tier chain test failed: " << tier_.size() << " values spilled to the tier, expected "
+				<< 9 - cache_.size() << std::endl;
+		}
+		
+		std::string spilled;
+		for (std::size_t i = 2; i < 10 && spilled.empty(); ++i)
+		{
+			if (tier_.contains(std::to_string(i)))
+			{
+				spilled = std::to_string(i);
+			}
+		}
+		auto misses = remote_misses_;
+		get(spilled);
+		if (remote_misses_ != misses || tier_.hits() != 1)
+		{
+			report_failure() << "tier chain test failed: spilled value wasn't read back from the tier" << std::endl;
+		}
+		
+		// the replicator sees removals passed on by the tier
+		
+		tier_.invalidate("1");
+		if (replicator_.is_hot("1") || reader_.find("1") != nullptr)
+		{
+			report_failure() << "tier chain test failed: invalidated key still replicated" << std::endl;
+		}
+		
+		// the value read back from the tier stays in it until it expires, and is then dropped
+		
+		manual_clock::advance(std::chrono::milliseconds(100));
+		get(spilled);
+		if (remote_misses_ != misses + 1 || tier_.hits() != 1 || tier_.contains(spilled))
+		{
+			report_failure() << "tier chain test failed: expired value served from the tier" << std::endl;
+		}
+		
+		// a value spilled to the tier expires there too
+		
+		for (std::size_t i = 30; i < 40; ++i)
+		{
+			get(std::to_string(i));
+		}
+		std::string stale;
+		for (std::size_t i = 30; i < 40 && stale.empty(); ++i)
+		{
+			if (tier_.contains(std::to_string(i)))
+			{
+				stale = std::to_string(i);
+			}
+		}
+		misses = remote_misses_;
+		auto hits = tier_.hits();
+		manual_clock::advance(std::chrono::milliseconds(100));
+		get(stale);
+		if (stale.empty() || remote_misses_ != misses + 1 || tier_.hits() != hits || tier_.contains(stale))
+		{
+			report_failure() << "tier chain test failed: value served from the tier after its deadline" << std::endl;
+		}
+		
+		// a replica isn't served after its entry's deadline, though fewer than touch_interval
+		// replica hits have reached the cache
+		
+		for (std::size_t i = 0; i < 4; ++i)
+		{
+			read("50");
+		}
+		if (!read("50").second)
+		{
+			report_failure() << "tier chain test failed: key wasn't replicated" << std::endl;
+		}
+		misses = remote_misses_;
+		manual_clock::advance(std::chrono::milliseconds(100));
+		if (reader_.find("50") != nullptr)
+		{
+			report_failure() << "tier chain test failed: expired replica found" << std::endl;
+		}
+		auto result = read("50");
+		if (result.second || result.first != 50 || remote_misses_ != misses + 1)
+		{
+			report_failure() << "tier chain test failed: expired replica served" << std::endl;
+		}
+	}
+	
+private:
+	std::size_t remote_misses_;
+	test_loop loop_;
+	tier_type tier_;
+	cache_type cache_;
+	replicator_type replicator_;
+	replicator_type::reader reader_;
+};
+
+// promotion_test checks that buffered promotions are applied, in the order of the hits, before
+// an entry is added or evicted, when the buffer fills, and when the application applies them
+
+class promotion_test
+{
+public:
+	using cache_type = utils::lru_cache<std::string, test_value_move_constructible, std::hash<std::string>,
+		std::equal_to<std::string>, utils::cache_policies<utils::lru_eviction, utils::no_stats, utils::no_expiry, utils::buffered_promotion<4>>>;
+	
+	promotion_test()
+	:
+	cache_(
+		[] (const std::string& key, cache_type::miss_handler_reply_f reply)
+		{
+			reply(cache_type::value_uptr_t(new test_value_move_constructible(std::stoull(key))), std::error_code());
+		}, 4)
+	{}
+	
+	void get(const std::string& key)
+	{
+		cache_.get(key, [key] (cache_type::const_iterator iter, const std::error_code& err)
+		{
+			if (err || iter->get() != std::stoull(key))
+			{
+				report_failure() << "promotion test failed: wrong value for key " << key << std::endl;
+			}
+		});
+	}
+	
+	std::string order()
+	{
+		std::string keys;
+		for (auto it = cache_.cbegin(); it != cache_.cend(); ++it)
+		{
+			keys += std::to_string(it->get());
+		}
+		return keys;
+	}
+	
+	void expect(const std::string& expected, const char* when)
+	{
+		auto actual = order();
+		if (actual != expected)
+		{
+			report_failure() << "promotion test failed: order " << actual << " " << when << ", expected " << expected << std::endl;
+		}
+	}
+	
+	void run()
+	{
+		std::cout << "starting promotion test" << std::endl;
+		
+		std::string evicted;
+		cache_.set_removal_listener([&] (cache_type::removal_batch_t& batch)
+		{
+			for (auto& removed : batch)
+			{
+				evicted += removed.key();
+			}
+		});
+		
+		get("1");
+		get("2");
+		get("3");
+		get("4");
+		get("1");
+		get("2");
+		expect("4321", "before the promotions were applied");
+		
+		// eviction sees the buffered hits
+		
+		cache_.set_limit(2);
+		expect("21", "after eviction");
+		if (evicted != "34")
+		{
+			report_failure() << "promotion test failed: evicted " << evicted << ", expected 34" << std::endl;
+		}
+		
+		// so does an insert
+		
+		cache_.set_limit(4);
+		get("1");
+		get("5");
+		expect("512", "after an insert");
+		
+		// a full buffer is applied
+		
+		get("2");
+		get("1");
+		get("5");
+		get("2");
+		expect("251", "after the buffer filled");
+		
+		get("1");
+		cache_.apply_promotions();
+		expect("125", "after apply_promotions");
+		
+		// flush discards the buffered hits with their entries
+		
+		get("5");
+		cache_.flush();
+		cache_.apply_promotions();
+		expect("", "after flush");
+	}
+	
+private:
+	cache_type cache_;
+};
+
+// scan_test checks that scans visit each entry exactly once: whole, split into parts scanned on
+// separate threads, and resumed slab by slab while gets, invalidations and a growing table change
+// the cache between slabs
+
+class scan_test
+{
+public:
+	using cache_type = utils::lru_cache<std::string, test_value_move_constructible>;
+	
+	static const std::size_t key_count = 4096;
+	
+	scan_test()
+	:
+	rng_{20161},
+	visits_(key_count, 0),
+	cache_(
+		[] (const std::string& key, cache_type::miss_handler_reply_f reply)
+		{
+			reply(cache_type::value_uptr_t(new test_value_move_constructible(std::stoull(key))), std::error_code());
+		}, 1000)
+	{}
+	
+	void get(std::size_t key)
+	{
+		cache_.get(std::to_string(key), [] (cache_type::const_iterator, std::error_code) {});
+	}
+	
+	std::size_t visit(const std::string& key, const test_value_move_constructible& value, std::vector<unsigned>& visits)
+	{
+		auto k = std::stoull(key);
+		if (value.get() != k)
+		{
+			report_failure() << "scan test failed: key " << key << " visited with value " << value.get() << std::endl;
+		}
+		return ++visits[k];
+	}
+	
+	// expect checks that the keys in expected were each visited exactly once, and that no other key
+	// was visited more than once
+	
+	void expect(const std::vector<bool>& expected, const char* which)
+	{
+		for (std::size_t k = 0; k < key_count; ++k)
+		{
+			if ((expected[k] && visits_[k] != 1) || visits_[k] > 1)
+			{
+				report_failure() << "scan test failed: " << which << " visited key " << k << " " << visits_[k] << " times" << std::endl;
+				break;
+			}
+		}
+		std::fill(visits_.begin(), visits_.end(), 0);
+	}
+	
+	std::vector<bool> contents()
+	{
+		std::vector<bool> present(key_count, false);
+		for (auto it = cache_.cbegin(); it != cache_.cend(); ++it)
+		{
+			present[it->get()] = true;
+		}
+		return present;
+	}
+	
+	void run()
+	{
+		std::cout << "starting scan test" << std::endl;
+		
+		for (std::size_t key = 0; key < 1000; ++key)
+		{
+			get(key * 3);
+		}
+		
+		auto present = contents();
+		cache_.scan([&] (const std::string& key, const test_value_move_constructible& value)
+		{
+			visit(key, value, visits_);
+		});
+		expect(present, "whole scan");
+		
+		// split part of the way through a scan, scanning the parts in parallel
+		
+		cache_type::scan_cursor cursor;
+		cache_.scan(cursor, 100, [&] (const std::string& key, const test_value_move_constructible& value)
+		{
+			visit(key, value, visits_);
+		});
+		
+		std::vector<cache_type::scan_cursor> parts(5);
+		cursor.split(parts.begin(), parts.end());
+		std::vector<std::vector<unsigned>> part_visits(parts.size(), std::vector<unsigned>(key_count, 0));
+		std::vector<std::thread> threads;
+		for (std::size_t i = 0; i < parts.size(); ++i)
+		{
+			threads.emplace_back([&, i] ()
+			{
+				while (!parts[i].done())
+				{
+					cache_.scan(parts[i], 7, [&] (const std::string& key, const test_value_move_constructible& value)
+					{
+						visit(key, value, part_visits[i]);
+					});
+				}
+			});
+		}
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+		for (auto& visits : part_visits)
+		{
+			for (std::size_t k = 0; k < key_count; ++k)
+			{
+				visits_[k] += visits[k];
+			}
+		}
+		expect(present, "split scan");
+		
+		// resumed a slab at a time, with the cache changing between slabs; the table grows partway
+		
+		std::vector<bool> removed(key_count, false);
+		cache_.set_removal_listener([&] (cache_type::removal_batch_t& batch)
+		{
+			for (auto& removal : batch)
+			{
+				removed[std::stoull(removal.key())] = true;
+			}
+		});
+		
+		cursor = cache_type::scan_cursor{};
+		for (std::size_t slab = 0; !cursor.done(); ++slab)
+		{
+			if (slab == 20)
+			{
+				cache_.set_limit(3000);
+			}
+			for (std::size_t i = 0; i < 40; ++i)
+			{
+				auto key = rng_() % key_count;
+				if (rng_() % 8 == 0)
+				{
+					cache_.invalidate(std::to_string(key));
+				}
+				else
+				{
+					get(key);
+				}
+			}
+			cache_.scan(cursor, 16, [&] (const std::string& key, const test_value_move_constructible& value)
+			{
+				visit(key, value, visits_);
+			});
+		}
+		for (std::size_t k = 0; k < key_count; ++k)
+		{
+			present[k] = present[k] && !removed[k];
+		}
+		expect(present, "resumed scan");
+		
+		// the table starts with 2048 buckets, and grows when it holds that many entries
+		
+		if (cache_.size() <= 2048)
+		{
+			report_failure() << "scan test failed: the table didn't grow during the scan (" << cache_.size() << " entries)" << std::endl;
+		}
+	}
+	
+private:
+	std::mt19937 rng_;
+	std::vector<unsigned> visits_;
+	cache_type cache_;
+};
+
+#if defined(__cpp_impl_coroutine)
+
+// coroutine_async_test awaits misses that complete later (as they would with an asynchronous
+// miss handler), checking that concurrent co_gets for the same key are coalesced into one call
+// to the miss handler and are all resumed by its reply.
+
+class coroutine_async_test
+{
+public:
+	using cache_type = utils::lru_cache<std::string, test_value_move_constructible>;
+	
+	coroutine_async_test()
+	:
+	cache_(
+		[this] (const std::string& key, cache_type::miss_handler_reply_f reply)
+		{
+			pending_.emplace_back(key, reply);
+		}, 5)
+	{}
+	
+	// key is taken by value: the callers pass temporaries, which are gone once the coroutine
+	// suspends
+	
+	test_task await_value(std::string key, std::uint64_t expected)
+	{
+		auto result = co_await cache_.co_get(key);
+		if (!result || result->get() != expected)
+		{
+			report_failure() << "coroutine async test failed: unexpected result for key " << key << std::endl;
+		}
+		++resumed_;
+	}
+	
+	void run()
+	{
+		std::cout << "starting coroutine async test" << std::endl;
+		
+		await_value("4", 4);
+		await_value("4", 4);
+		await_value("6", 6);
+		
+		if (resumed_ != 0 || pending_.size() != 2)
+		{
+			report_failure() << "coroutine async test failed: expected 2 pending misses and no resumed coroutines, found "
+				<< pending_.size() << " and " << resumed_ << std::endl;
+		}
+		
+		for (auto& pending : pending_)
+		{
+			pending.second(cache_type::value_uptr_t(new test_value_move_constructible(std::stoull(pending.first))), std::error_code());
+		}
+		
+		if (resumed_ != 3)
+		{
+			report_failure() << "coroutine async test failed: " << resumed_ << " coroutines resumed, expected 3" << std::endl;
+		}
+		
+		// now a hit, which must complete without suspending
+		
+		await_value("6", 6);
+		
+		if (resumed_ != 4)
+		{
+			report_failure() << "coroutine async test failed: co_get suspended on a hit" << std::endl;
+		}
+	}
+	
+private:
+	std::vector<std::pair<std::string, cache_type::miss_handler_reply_f>> pending_;
+	cache_type cache_;
+	int resumed_ = 0;
+};
+
+#endif
+
 #endif /* guard_async_lru_cache_test_h */
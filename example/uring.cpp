@@ -0,0 +1,123 @@
+/*
+MIT License
+
+Copyright © 2016 David Curtis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include "../include/lru_uring.h"
+
+using namespace utils;
+
+// This example serves a cache from a directory of small text files, one file per key, with
+// reads performed by io_uring (Linux only). The cache and the loop run on the main thread;
+// the miss handler starts a read and returns, and the cache replies to get() when the read
+// completes, in the loop.
+
+using ex_cache_type = lru_cache<std::string, std::string>;
+
+int main(int argc, const char * argv[])
+{
+	// make a few files to read
+	
+	char dir_template[] = "/tmp/lru_uring_example.XXXXXX";
+	if (!::mkdtemp(dir_template))
+	{
+		std::cout << "couldn't make a temporary directory" << std::endl;
+		return 1;
+	}
+	std::string dir{dir_template};
+	
+	const char* animals[] = {"cow", "horse", "goat", "pig"};
+	for (auto animal : animals)
+	{
+		std::ofstream(dir + "/" + animal) << "a " << animal << " was read from " << dir << "/" << animal;
+	}
+	
+	// The loop runs tasks, and the completions of the reads they start. The file source's miss
+	// handler maps a key to a file name, and deserializes the file's contents into a value.
+	
+	uring_loop loop;
+	std::cout << (loop.is_open() ? "using io_uring" : "io_uring isn't available; using pread") << std::endl;
+	
+	uring_file_source<std::string, std::string> source(loop, [&] (const std::string& key)
+	{
+		return dir + "/" + key;
+	},
+	[] (const char* data, std::size_t size)
+	{
+		return ex_cache_type::value_uptr_t(new std::string(data, size));
+	});
+	
+	ex_cache_type cache(source.miss_handler(), 3);
+	
+	auto show = [&] (const std::string& key)
+	{
+		cache.get(key, [key] (ex_cache_type::const_iterator it, std::error_code err)
+		{
+			if (err)
+			{
+				std::cout << key << ": " << err.message() << std::endl;
+			}
+			else
+			{
+				std::cout << key << ": " << *it << std::endl;
+			}
+		});
+	};
+	
+	// All of these requests are made before the loop runs, so the misses' reads are submitted
+	// together. Two requests for the same key share one read. The replies are invoked as the
+	// reads complete, so they may not be in the order of the requests.
+	
+	loop.post([&] ()
+	{
+		show("cow");
+		show("horse");
+		show("cow");
+		show("goat");
+		show("zebra");
+	});
+	
+	loop.run();
+	
+	// goat, horse and cow are cached; asking for goat is a hit, replied to immediately,
+	// and pig evicts cow, the least recently used value
+	
+	show("goat");
+	show("pig");
+	loop.run();
+	
+	for (auto it = cache.cbegin(); it != cache.cend(); ++it)
+	{
+		std::cout << "cached: " << *it << std::endl;
+	}
+	
+	for (auto animal : animals)
+	{
+		::unlink((dir + "/" + animal).c_str());
+	}
+	::rmdir(dir.c_str());
+	
+	return 0;
+}
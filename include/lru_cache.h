@@ -26,309 +26,2435 @@ SOFTWARE.
 #define guard_utils_lru_cache_h
 
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include <iterator>
 #include <deque>
 #include <vector>
+#include <functional>
+#include <system_error>
+#include <tuple>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
 
 namespace utils
 {
-	template <class Key, class T, class Hash = std::hash<Key>, class KeyEquals = std::equal_to<Key>>
-	class lru_cache
+	namespace detail
 	{
-	public:
-	
-		using key_t = Key;
-		using value_t = T;
-		using value_uptr_t = std::unique_ptr<T>;
+		inline void prefetch(const void* addr)
+		{
+#if defined(__GNUC__) || defined(__clang__)
+			__builtin_prefetch(addr);
+#else
+			(void)addr;
+#endif
+		}
+
+		// table_entry is the element type of chained_table. It extends the std::pair used by
+		// std::unordered_map with the cached hash value and the bucket chain link, so that
+		// erasure and bucket lookups never need to invoke the hash function again.
+
+		template<class Key, class Mapped>
+		class table_entry : public std::pair<const Key, Mapped>
+		{
+		public:
+
+			template<class... Args>
+			inline table_entry(std::size_t hash, const Key& key, Args&&... args)
+			:
+			std::pair<const Key, Mapped>{std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...)},
+			hash_{hash},
+			chain_{nullptr}
+			{}
+
+			inline table_entry()
+			:
+			std::pair<const Key, Mapped>{},
+			hash_{0},
+			chain_{nullptr}
+			{}
+
+			table_entry(const table_entry& that) = delete;
+
+			table_entry(table_entry&& that) = delete;
+
+			std::size_t		hash_;
+			table_entry*	chain_;
+		};
+
+		// chained_table is a minimal separately-chained hash table with a power-of-two bucket
+		// array. Unlike std::unordered_map, it exposes the hash value and the bucket array, which
+		// allows callers to hash a batch of keys up front and prefetch the buckets and entries
+		// before probing them.
+
+		template<class Key, class Mapped, class Hash, class KeyEquals>
+		class chained_table
+		{
+		public:
+
+			using entry = table_entry<Key, Mapped>;
+			using entry_ptr = entry*;
+
+			inline chained_table(std::size_t min_buckets)
+			:
+			hash_{},
+			equals_{},
+			buckets_{},
+			shift_{63},
+			size_{0}
+			{
+				std::size_t count = 2;
+				while (count < min_buckets)
+				{
+					count <<= 1;
+					--shift_;
+				}
+				buckets_.assign(count, nullptr);
+			}
+
+			inline ~chained_table()
+			{
+				clear();
+			}
+
+			chained_table(const chained_table& that) = delete;
+
+			chained_table& operator=(const chained_table& that) = delete;
+
+			inline std::size_t hash(const Key& key) const
+			{
+				return hash_(key);
+			}
+
+			inline std::size_t size() const
+			{
+				return size_;
+			}
+
+			inline std::size_t bucket_count() const
+			{
+				return buckets_.size();
+			}
+
+			inline void prefetch_bucket(std::size_t hash) const
+			{
+				prefetch(&buckets_[bucket_index(hash)]);
+			}
+
+			inline entry_ptr bucket_head(std::size_t hash) const
+			{
+				return buckets_[bucket_index(hash)];
+			}
+
+			// An entry's position is its mixed hash value, whose high bits are its bucket index at every
+			// bucket count, so the buckets partition the positions into consecutive ranges, in order.
+
+			inline std::uint64_t position(std::size_t hash) const
+			{
+				return static_cast<std::uint64_t>(hash) * 0x9E3779B97F4A7C15ULL;
+			}
+
+			// scan visits the entries whose positions are in [first, last], in bucket order, stopping after
+			// max_buckets buckets. It returns true if it stopped before reaching last, with first advanced
+			// to the first position not yet visited. Since positions don't change when the table is rehashed,
+			// a scan resumed after a rehash neither skips nor repeats an entry. visit must not add or
+			// remove entries.
+
+			template<class Visit>
+			inline bool scan(std::uint64_t& first, std::uint64_t last, std::size_t max_buckets, Visit&& visit) const
+			{
+				static const std::size_t prefetch_distance = 8;
+
+				std::size_t bucket = static_cast<std::size_t>(first >> shift_);
+				std::size_t end = static_cast<std::size_t>(last >> shift_);
+				for (; max_buckets > 0; --max_buckets, ++bucket)
+				{
+					if (bucket + prefetch_distance <= end && buckets_[bucket + prefetch_distance])
+					{
+						prefetch(buckets_[bucket + prefetch_distance]);
+					}
+					for (entry_ptr p = buckets_[bucket]; p; p = p->chain_)
+					{
+						auto pos = position(p->hash_);
+						if (pos >= first && pos <= last)
+						{
+							visit(p);
+						}
+					}
+					if (bucket == end)
+					{
+						return false;
+					}
+					first = static_cast<std::uint64_t>(bucket + 1) << shift_;
+				}
+				return true;
+			}
+
+			inline entry_ptr find(const Key& key, std::size_t hash) const
+			{
+				entry_ptr p = bucket_head(hash);
+				while (p && !(p->hash_ == hash && equals_(p->first, key)))
+				{
+					p = p->chain_;
+				}
+				return p;
+			}
+
+			// the caller is responsible for verifying that the key is not already present
+
+			template<class... Args>
+			inline entry_ptr emplace(const Key& key, std::size_t hash, Args&&... args)
+			{
+				entry_ptr e = new entry(hash, key, std::forward<Args>(args)...);
+				if (size_ >= buckets_.size())
+				{
+					rehash(buckets_.size() << 1);
+				}
+				entry_ptr& head = buckets_[bucket_index(hash)];
+				e->chain_ = head;
+				head = e;
+				++size_;
+				return e;
+			}
+
+			inline void erase(entry_ptr e)
+			{
+				entry_ptr* link = &buckets_[bucket_index(e->hash_)];
+				while (*link != e)
+				{
+					link = &((*link)->chain_);
+				}
+				*link = e->chain_;
+				--size_;
+				delete e;
+			}
+
+			inline void clear()
+			{
+				for (auto& head : buckets_)
+				{
+					while (head)
+					{
+						entry_ptr next = head->chain_;
+						delete head;
+						head = next;
+					}
+				}
+				size_ = 0;
+			}
+
+			// rehash relinks the entries into a bucket array of bucket_count buckets (which must be a power of two),
+			// using the cached hash values
+
+			inline void rehash(std::size_t bucket_count)
+			{
+				std::vector<entry_ptr> old_buckets(bucket_count, nullptr);
+				old_buckets.swap(buckets_);
+				shift_ = 64;
+				while (bucket_count > 1)
+				{
+					bucket_count >>= 1;
+					--shift_;
+				}
+				for (auto head : old_buckets)
+				{
+					while (head)
+					{
+						entry_ptr next = head->chain_;
+						entry_ptr& new_head = buckets_[bucket_index(head->hash_)];
+						head->chain_ = new_head;
+						new_head = head;
+						head = next;
+					}
+				}
+			}
+
+		private:
+
+			// Fibonacci hashing spreads weak hash functions (such as the identity hash
+			// std::hash uses for integers) across the power-of-two bucket array
+
+			inline std::size_t bucket_index(std::size_t hash) const
+			{
+				return static_cast<std::size_t>(position(hash) >> shift_);
+			}
+
+			Hash					hash_;
+			KeyEquals				equals_;
+			std::vector<entry_ptr>	buckets_;
+			unsigned				shift_;
+			std::size_t				size_;
+		};
+	}
+
+	// Optional features of the cache are selected at compile time, by a bundle of policies
+	// (cache_policies, below), so that a cache doesn't pay for features it doesn't use. Each policy
+	// supplies the per-entry state it needs as a node_data class, from which the cache's nodes
+	// derive (so an empty node_data adds nothing to the node), and a class that holds the policy's
+	// per-cache state, whose hooks the cache calls at fixed points. The default policies' hooks are
+	// empty inline functions, so their calls compile to nothing.
 	
-	protected:
+	// Eviction policies. The evictor is notified as entries are added, used, and removed, and
+	// is asked for the entry to evict when the cache is over its limit. (The usage order list is
+	// maintained regardless of the policy; the cache's iterators walk it.)
+
+	// lru_eviction (the default) evicts the least recently used entry.
+
+	class lru_eviction
+	{
+	public:
 	
-		class node;
+		static const bool measures_cost = false;
 		
-		using lru_map_t = std::unordered_map<Key, node, Hash, KeyEquals>;
-		using map_iterator = typename lru_map_t::iterator;
-		using map_entry = std::pair<const Key , node>;
-		using entry_ptr = map_entry *;
+		class node_data
+		{};
 		
-		class node
+		template<class Entry>
+		class evictor
 		{
 		public:
 		
-			inline node(std::unique_ptr<T> val_ptr)
-			:
-			value_{std::move(val_ptr)},
-			older_{nullptr},
-			newer_{nullptr}
+			inline void added(Entry*, double, double)
 			{}
 			
-			inline node()
-			:
-			value_{nullptr},
-			older_{nullptr},
-			newer_{nullptr}
+			inline void touched(Entry*)
 			{}
-		
-			inline node(const node& that) = delete;
 			
-			inline node(node&& that) = delete;
-
-			std::unique_ptr<T> value_;
-			entry_ptr older_;
-			entry_ptr newer_;
+			inline void removed(Entry*)
+			{}
+			
+			inline void cleared()
+			{}
+			
+			inline Entry* victim(Entry& sentinel)
+			{
+				return sentinel.second.newer_;
+			}
 		};
+	};
+
+	// gdsf_eviction evicts by GreedyDual-Size-Frequency. Each entry has a priority of
+	//
+	//	L + frequency * cost / size
+	//
+	// where frequency is the number of hits since it was added (plus one), cost is what it cost to
+	// get (by default, the wall time from the call to the miss handler to its reply), size defaults
+	// to one, and L is the priority of the last entry evicted. The entry with the lowest priority is
+	// evicted; since L only grows, entries that aren't used are eventually evicted, however costly.
+	// Entries are kept in a binary heap, so hits and evictions are O(log n), rather than O(1).
+	//
+	// Costs can be supplied explicitly (or the measured cost adjusted) with the cache's set_cost_function,
+	// and sizes with set_size_function. Entries added by put(), which have no measured cost, are given
+	// the mean of the measured costs.
 
+	class gdsf_eviction
+	{
 	public:
 	
-		class const_iterator
+		static const bool measures_cost = true;
+		
+		class node_data
 		{
-		private:
-			entry_ptr ptr_;
+		public:
+		
+			inline node_data()
+			:
+			priority_{0},
+			cost_{0},
+			frequency_{0},
+			heap_index_{0}
+			{}
 			
-			inline const_iterator(const entry_ptr ptr)
+			double			priority_;
+			double			cost_;
+			std::uint32_t	frequency_;
+			std::uint32_t	heap_index_;
+		};
+		
+		template<class Entry>
+		class evictor
+		{
+		public:
+		
+			inline evictor()
 			:
-			ptr_{ptr}
+			inflation_{0},
+			measured_total_{0},
+			measured_count_{0}
 			{}
+			
+			// cost is the measured cost in nanoseconds, or negative if it wasn't measured;
+			// the cache has already applied its cost and size functions
+			
+			inline void added(Entry* entry, double cost, double size)
+			{
+				if (cost < 0)
+				{
+					cost = measured_count_ > 0 ? measured_total_ / static_cast<double>(measured_count_) : 1;
+				}
+				else
+				{
+					measured_total_ += cost;
+					++measured_count_;
+				}
+				auto& data = entry->second;
+				data.cost_ = cost / (size > 0 ? size : 1);
+				data.frequency_ = 1;
+				data.priority_ = inflation_ + data.cost_;
+				data.heap_index_ = static_cast<std::uint32_t>(heap_.size());
+				heap_.push_back(entry);
+				sift_up(data.heap_index_);
+			}
+			
+			inline void touched(Entry* entry)
+			{
+				auto& data = entry->second;
+				if (data.frequency_ < UINT32_MAX)
+				{
+					++data.frequency_;
+				}
+				data.priority_ = inflation_ + data.frequency_ * data.cost_;
+				sift_down(data.heap_index_);
+			}
+			
+			inline void removed(Entry* entry)
+			{
+				auto index = entry->second.heap_index_;
+				if (index >= heap_.size() || heap_[index] != entry)
+				{
+					return;
+				}
+				auto last = heap_.back();
+				heap_.pop_back();
+				if (last != entry)
+				{
+					place(last, index);
+					sift_down(index);
+					sift_up(last->second.heap_index_);
+				}
+			}
+			
+			inline void cleared()
+			{
+				heap_.clear();
+				inflation_ = 0;
+			}
+			
+			inline Entry* victim(Entry& sentinel)
+			{
+				if (heap_.empty())
+				{
+					return sentinel.second.newer_;
+				}
+				auto entry = heap_.front();
+				inflation_ = entry->second.priority_;
+				return entry;
+			}
+			
+			inline double inflation() const
+			{
+				return inflation_;
+			}
+			
+		private:
 		
-			friend class lru_cache;
+			inline void place(Entry* entry, std::size_t index)
+			{
+				heap_[index] = entry;
+				entry->second.heap_index_ = static_cast<std::uint32_t>(index);
+			}
+			
+			inline void sift_up(std::size_t index)
+			{
+				auto entry = heap_[index];
+				while (index > 0)
+				{
+					auto parent = (index - 1) / 2;
+					if (heap_[parent]->second.priority_ <= entry->second.priority_)
+					{
+						break;
+					}
+					place(heap_[parent], index);
+					index = parent;
+				}
+				place(entry, index);
+			}
+			
+			inline void sift_down(std::size_t index)
+			{
+				auto entry = heap_[index];
+				auto size = heap_.size();
+				while (true)
+				{
+					auto child = 2 * index + 1;
+					if (child >= size)
+					{
+						break;
+					}
+					if (child + 1 < size && heap_[child + 1]->second.priority_ < heap_[child]->second.priority_)
+					{
+						++child;
+					}
+					if (entry->second.priority_ <= heap_[child]->second.priority_)
+					{
+						break;
+					}
+					place(heap_[child], index);
+					index = child;
+				}
+				place(entry, index);
+			}
 			
+			std::vector<Entry*>		heap_;
+			double					inflation_;
+			double					measured_total_;
+			std::size_t				measured_count_;
+		};
+	};
+
+	// Statistics policies. no_stats (the default) keeps none; counting_stats counts hits, misses,
+	// evictions and expirations, available from the cache's stats(). The hit and miss hooks are
+	// given the key's hash, for policies that sample accesses by key (mrc_stats, in lru_cache_group.h).
+
+	class no_stats
+	{
+	public:
+	
+		class counters
+		{
 		public:
-			typedef std::forward_iterator_tag iterator_category;
-			typedef T value_t;
-			typedef const T& const_reference;
-			typedef const T* const const_pointer;
-			typedef ptrdiff_t difference_type;
 		
-			inline const_iterator(const const_iterator& that)
-			:
-			ptr_{that.ptr_}
+			inline void hit(std::size_t)
 			{}
 			
-			inline const_iterator()
+			inline void miss(std::size_t)
+			{}
+			
+			inline void eviction()
+			{}
+			
+			inline void expiration()
+			{}
+		};
+	};
+	
+	class counting_stats
+	{
+	public:
+	
+		class counters
+		{
+		public:
+		
+			inline counters()
 			:
-			ptr_{nullptr}
+			hits_{0},
+			misses_{0},
+			evictions_{0},
+			expirations_{0}
 			{}
 			
-			inline const_iterator& operator=(const const_iterator& that)
+			inline void hit(std::size_t)
 			{
-				ptr_ = that.ptr_;
-				return *this;
+				++hits_;
 			}
 			
-			inline ~const_iterator()
+			inline void miss(std::size_t)
 			{
-				ptr_ = nullptr; // the iterator doesn't own this pointer, don't delete
+				++misses_;
 			}
 			
-			inline const_iterator operator++()
+			inline void eviction()
 			{
-				ptr_ = ptr_->second.older_;
-				return const_iterator{*this};
+				++evictions_;
 			}
 			
-			inline const_iterator operator++(int)
+			inline void expiration()
 			{
-				const_iterator retval{*this};
-				ptr_ = ptr_->second.older_;
-				return retval;
+				++expirations_;
+			}
+			
+			inline std::uint64_t hits() const
+			{
+				return hits_;
+			}
+			
+			// misses counts gets that weren't hits, including those that joined a miss in progress
+			
+			inline std::uint64_t misses() const
+			{
+				return misses_;
+			}
+			
+			inline std::uint64_t evictions() const
+			{
+				return evictions_;
+			}
+			
+			inline std::uint64_t expirations() const
+			{
+				return expirations_;
+			}
+			
+		private:
+		
+			std::uint64_t	hits_;
+			std::uint64_t	misses_;
+			std::uint64_t	evictions_;
+			std::uint64_t	expirations_;
+		};
+	};
+	
+	// Expiry policies. no_expiry (the default) never expires entries; with ttl_expiry, each entry
+	// expires a fixed time (set with the cache's set_time_to_live) after it was added. An expired
+	// entry is removed (with removal_cause::expired) when a get finds it, and the get proceeds as a
+	// miss; find doesn't return expired entries. Hits don't extend an entry's life.
+	// basic_ttl_expiry takes the clock as a parameter (any type with the interface of the standard
+	// clocks, such as a manually advanced clock for tests); ttl_expiry uses std::chrono::steady_clock.
+	// A policy's deadline is an entry's expiry time, detached from the entry, so that components
+	// holding copies of values outside the cache (in removals, or the cache's deadline function)
+	// can tell when the copies go stale.
+	
+	class no_expiry
+	{
+	public:
+	
+		class node_data
+		{};
+		
+		class deadline
+		{
+		public:
+		
+			inline bool passed() const
+			{
+				return false;
+			}
+		};
+		
+		template<class Entry>
+		class expirer
+		{
+		public:
+		
+			inline void added(Entry*)
+			{}
+			
+			inline bool expired(const Entry*) const
+			{
+				return false;
+			}
+			
+			inline deadline deadline_of(const Entry*) const
+			{
+				return deadline{};
+			}
+		};
+	};
+	
+	template<class Clock = std::chrono::steady_clock>
+	class basic_ttl_expiry
+	{
+	public:
+	
+		using clock = Clock;
+		
+		class node_data
+		{
+		public:
+			typename clock::time_point	expires_;
+		};
+		
+		class deadline
+		{
+		public:
+		
+			inline deadline(typename clock::time_point expires = clock::time_point::max())
+			:
+			expires_{expires}
+			{}
+			
+			inline bool passed() const
+			{
+				return expires_ <= clock::now();
+			}
+			
+			typename clock::time_point	expires_;
+		};
+		
+		template<class Entry>
+		class expirer
+		{
+		public:
+		
+			inline expirer()
+			:
+			time_to_live_{clock::duration::max()}
+			{}
+			
+			inline void set_time_to_live(std::chrono::steady_clock::duration time_to_live)
+			{
+				time_to_live_ = (time_to_live == std::chrono::steady_clock::duration::max())
+					? clock::duration::max() : std::chrono::duration_cast<typename clock::duration>(time_to_live);
+			}
+			
+			inline void added(Entry* entry)
+			{
+				entry->second.expires_ = (time_to_live_ == clock::duration::max()) ? clock::time_point::max() : clock::now() + time_to_live_;
+			}
+			
+			inline bool expired(const Entry* entry) const
+			{
+				return entry->second.expires_ <= clock::now();
+			}
+			
+			inline deadline deadline_of(const Entry* entry) const
+			{
+				return deadline{entry->second.expires_};
+			}
+			
+		private:
+		
+			typename clock::duration	time_to_live_;
+		};
+	};
+	
+	using ttl_expiry = basic_ttl_expiry<>;
+	
+	// Promotion policies. With eager_promotion (the default), a hit moves its entry to the head
+	// of the usage list immediately. With buffered_promotion, a hit only appends the entry to a
+	// buffer of Capacity entries, and the moves (and the evictor's touched hooks) are applied in
+	// bulk, in the order of the hits: when the buffer is full, before any entry is added or removed
+	// (so eviction chooses exactly the victim it would have chosen with eager promotion), and when
+	// the application calls apply_promotions (from a timer, for example). Between drains, the
+	// usage order seen by the iterators lags behind the hits.
+	
+	class eager_promotion
+	{
+	public:
+	
+		template<class Entry>
+		class promoter
+		{
+		public:
+		
+			static const bool buffers = false;
+			
+			inline bool record(Entry*)
+			{
+				return false;
+			}
+			
+			template<class Touch>
+			inline void drain(Touch)
+			{}
+			
+			inline void clear()
+			{}
+		};
+	};
+	
+	template<std::size_t Capacity = 64>
+	class buffered_promotion
+	{
+	public:
+	
+		template<class Entry>
+		class promoter
+		{
+		public:
+		
+			static const bool buffers = true;
+			
+			inline promoter()
+			:
+			count_{0}
+			{}
+			
+			// record returns true when the buffer is full
+			
+			inline bool record(Entry* entry)
+			{
+				buffer_[count_] = entry;
+				return ++count_ == Capacity;
+			}
+			
+			template<class Touch>
+			inline void drain(Touch touch)
+			{
+				for (std::size_t i = 0; i < count_; ++i)
+				{
+					touch(buffer_[i]);
+				}
+				count_ = 0;
+			}
+			
+			inline void clear()
+			{
+				count_ = 0;
+			}
+			
+		private:
+		
+			std::size_t		count_;
+			Entry*			buffer_[Capacity];
+		};
+	};
+	
+	// cache_policies bundles the policies for lru_cache's Policies template parameter:
+	//
+	//	lru_cache<Key, T, Hash, KeyEquals, cache_policies<gdsf_eviction, counting_stats>>
+	//
+	// Its node_data combines the policies' per-entry state. Empty node_data classes are distinct
+	// empty bases, so the default bundle adds nothing to the size of a node.
+	
+	template <class Eviction = lru_eviction, class Stats = no_stats, class Expiry = no_expiry, class Promotion = eager_promotion>
+	class cache_policies
+	{
+	public:
+	
+		using eviction = Eviction;
+		using stats = Stats;
+		using expiry = Expiry;
+		using promotion = Promotion;
+		
+		class node_data : public Eviction::node_data, public Expiry::node_data
+		{};
+	};
+
+	template <class Key, class T, class Hash = std::hash<Key>, class KeyEquals = std::equal_to<Key>, class Policies = cache_policies<>>
+	class lru_cache
+	{
+	public:
+	
+		using key_t = Key;
+		using value_t = T;
+		using hash_t = Hash;
+		using key_equals_t = KeyEquals;
+		using value_uptr_t = std::unique_ptr<T>;
+		using stats_type = typename Policies::stats::counters;
+		using deadline_t = typename Policies::expiry::deadline;
+	
+	protected:
+	
+		class node;
+		
+		using lru_map_t = detail::chained_table<Key, node, Hash, KeyEquals>;
+		using map_entry = typename lru_map_t::entry;
+		using entry_ptr = map_entry *;
+		using eviction_policy = typename Policies::eviction;
+		using expiry_policy = typename Policies::expiry;
+		using evictor_type = typename eviction_policy::template evictor<map_entry>;
+		using expirer_type = typename expiry_policy::template expirer<map_entry>;
+		using promoter_type = typename Policies::promotion::template promoter<map_entry>;
+		
+		class node : public Policies::node_data
+		{
+		public:
+		
+			inline node(std::unique_ptr<T> val_ptr)
+			:
+			value_{std::move(val_ptr)},
+			older_{nullptr},
+			newer_{nullptr}
+			{}
+			
+			inline node()
+			:
+			value_{nullptr},
+			older_{nullptr},
+			newer_{nullptr}
+			{}
+		
+			inline node(const node& that) = delete;
+			
+			inline node(node&& that) = delete;
+
+			std::unique_ptr<T> value_;
+			entry_ptr older_;
+			entry_ptr newer_;
+		};
+
+	public:
+	
+		class const_iterator
+		{
+		private:
+			entry_ptr ptr_;
+			
+			inline const_iterator(const entry_ptr ptr)
+			:
+			ptr_{ptr}
+			{}
+		
+			friend class lru_cache;
+			
+		public:
+			typedef std::forward_iterator_tag iterator_category;
+			typedef T value_t;
+			typedef const T& const_reference;
+			typedef const T* const const_pointer;
+			typedef ptrdiff_t difference_type;
+		
+			inline const_iterator(const const_iterator& that)
+			:
+			ptr_{that.ptr_}
+			{}
+			
+			inline const_iterator()
+			:
+			ptr_{nullptr}
+			{}
+			
+			inline const_iterator& operator=(const const_iterator& that)
+			{
+				ptr_ = that.ptr_;
+				return *this;
+			}
+			
+			inline ~const_iterator()
+			{
+				ptr_ = nullptr; // the iterator doesn't own this pointer, don't delete
+			}
+			
+			inline const_iterator operator++()
+			{
+				ptr_ = ptr_->second.older_;
+				return const_iterator{*this};
+			}
+			
+			inline const_iterator operator++(int)
+			{
+				const_iterator retval{*this};
+				ptr_ = ptr_->second.older_;
+				return retval;
+			}
+			
+			inline bool operator==(const const_iterator& that) const
+			{
+				return ptr_ == that.ptr_;
+			}
+			
+			inline bool operator!=(const const_iterator& that) const
+			{
+				return ptr_ != that.ptr_;
+			}
+			
+			inline const_reference operator*() const
+			{
+				return ptr_->second.value_.operator*();
+			}
+			
+			inline const_pointer operator->() const
+			{
+				return ptr_->second.value_.operator->();
+			}
+			
+			inline friend void swap(const_iterator& a, const_iterator& b)
+			{
+				const_iterator tmp{a};
+				a = b;
+				b = tmp;
+			}
+			
+			// added for test purposes
+			
+			inline bool check_linkage() const
+			{
+				return (ptr_->second.older_->second.newer_ == ptr_) && (ptr_->second.newer_->second.older_ == ptr_);
+			}
+			
+		};
+		
+		// A scan_cursor holds the progress of a scan (see scan, below): the range of hash positions
+		// that remain to be visited. A default-constructed cursor covers the whole cache.
+		
+		class scan_cursor
+		{
+		public:
+		
+			inline scan_cursor()
+			:
+			first_{0},
+			last_{~std::uint64_t{0}},
+			done_{false}
+			{}
+			
+			inline bool done() const
+			{
+				return done_;
+			}
+			
+			// split divides the rest of this cursor's range among the cursors in [first, last), in
+			// consecutive parts of (nearly) equal size, so that scanning all the parts visits the same
+			// entries as scanning this cursor would. The parts may be scanned independently, in parallel.
+			
+			template<class ForwardIt>
+			inline void split(ForwardIt first, ForwardIt last) const
+			{
+				auto count = static_cast<std::uint64_t>(std::distance(first, last));
+				if (count == 0)
+				{
+					return;
+				}
+				
+				std::uint64_t step = (last_ - first_) / count;
+				std::uint64_t begin = first_;
+				for (std::uint64_t i = 1; first != last; ++first, ++i)
+				{
+					if (done_ || (step == 0 && i < count))
+					{
+						*first = scan_cursor{0, 0, true};
+					}
+					else
+					{
+						std::uint64_t end = (i < count) ? begin + step - 1 : last_;
+						*first = scan_cursor{begin, end, false};
+						begin = end + 1;
+					}
+				}
+			}
+			
+		private:
+		
+			inline scan_cursor(std::uint64_t first, std::uint64_t last, bool done)
+			:
+			first_{first},
+			last_{last},
+			done_{done}
+			{}
+			
+			friend class lru_cache;
+			
+			std::uint64_t	first_;
+			std::uint64_t	last_;
+			bool			done_;
+		};
+		
+		using get_reply_f = std::function< void (const_iterator, std::error_code) >;
+		using miss_handler_reply_f = std::function< void (value_uptr_t, std::error_code) >;
+		using miss_handler_f = std::function< void (const Key&, miss_handler_reply_f) >;
+		
+		// An executor is represented by its post function, which must arrange for the task
+		// to be invoked later on the executor's thread (or event loop).
+		
+		using task_f = std::function< void () >;
+		using post_f = std::function< void (task_f) >;
+		
+		// The store handler writes values to the underlying store on behalf of put. It is passed
+		// a batch of key/value pointers, which are only valid for the duration of the call: an
+		// asynchronous handler must copy or serialize what it needs before returning. It must invoke
+		// the reply (on any thread, if the cache has an executor) when the write is complete.
+		
+		using put_reply_f = std::function< void (std::error_code) >;
+		using write_batch_t = std::vector< std::pair<const Key*, const T*> >;
+		using store_handler_reply_f = std::function< void (std::error_code) >;
+		using store_handler_f = std::function< void (const write_batch_t&, store_handler_reply_f) >;
+		
+		enum class write_policy
+		{
+			write_through,
+			write_behind
+		};
+		
+		// removal_cause tells the removal listener why a value left the cache
+		
+		enum class removal_cause
+		{
+			size,			// evicted as the least recently used entry
+			invalidated,	// removed by invalidate
+			flushed,		// removed by flush
+			replaced,		// superseded by a value from put (or a miss handler reply that raced with one)
+			expired			// found expired by get (expiry policies only)
+		};
+		
+		class removal
+		{
+		public:
+		
+			inline removal(const Key& key, value_uptr_t value, removal_cause cause, deadline_t deadline = deadline_t{})
+			:
+			key_{key},
+			value_{std::move(value)},
+			cause_{cause},
+			deadline_{deadline}
+			{}
+			
+			inline const Key& key() const
+			{
+				return key_;
+			}
+			
+			// the listener may take ownership of the value (by moving it)
+			
+			inline value_uptr_t& value()
+			{
+				return value_;
+			}
+			
+			inline removal_cause cause() const
+			{
+				return cause_;
+			}
+			
+			// deadline is when the value would have expired in the cache (expiry policies only)
+			
+			inline const deadline_t& deadline() const
+			{
+				return deadline_;
+			}
+			
+		private:
+			Key					key_;
+			value_uptr_t		value_;
+			removal_cause		cause_;
+			deadline_t			deadline_;
+		};
+		
+		using removal_batch_t = std::vector<removal>;
+		using removal_listener_f = std::function< void (removal_batch_t&) >;
+		
+		// Cost and size functions, for eviction policies that use them (gdsf_eviction). measured is
+		// the cost measured by the cache (in nanoseconds), or negative if the value wasn't obtained
+		// from the miss handler.
+		
+		using cost_f = std::function< double (const Key&, const T&, double measured) >;
+		using size_f = std::function< double (const Key&, const T&) >;
+		
+	protected:
+		
+		using pending_reply_list_t = std::vector<get_reply_f>;
+		
+		// A pending_request holds the get replies waiting for a key's value, which arrives either
+		// from the miss handler or from a write-through put. Miss handler calls and write-through
+		// puts are numbered from one sequence: miss_ holds the number of the latest miss handler call,
+		// and, while a write-through put is in flight, write_ holds its number. The request awaits
+		// the write, if there is one, and otherwise the miss; any other result for the key is stale
+		// (for example, the reply to a miss handler call abandoned by a put, which would otherwise
+		// complete a later request for the key). If the eviction policy measures cost, started_ is
+		// the time the miss handler was called.
+		
+		class pending_request
+		{
+		public:
+		
+			inline pending_request()
+			:
+			replies_{},
+			miss_{0},
+			write_{0},
+			started_{}
+			{}
+			
+			inline std::uint64_t awaited() const
+			{
+				return (write_ != 0) ? write_ : miss_;
+			}
+			
+			pending_reply_list_t					replies_;
+			std::uint64_t							miss_;
+			std::uint64_t							write_;
+			std::chrono::steady_clock::time_point	started_;
+		};
+		
+		using pending_map_t = detail::chained_table<Key, pending_request, Hash, KeyEquals>;
+		using pending_entry_ptr = typename pending_map_t::entry_ptr;
+		
+		// storing_map_t maps each key with a write-behind store in flight to the sequence number of
+		// its latest store. Gets for such a key, once its entry has been removed, wait for the store
+		// (see hold_for_store), so the miss handler can't return the value the store is replacing.
+		
+		using storing_map_t = detail::chained_table<Key, std::uint64_t, Hash, KeyEquals>;
+		using stored_keys_t = std::vector<std::pair<Key, std::size_t>>;
+		using pending_reply_iterator_t = typename pending_reply_list_t::iterator;
+		
+		static const std::size_t pending_map_buckets = 16;
+		
+		class miss_completion
+		{
+		public:
+		
+			inline miss_completion(const Key& key, std::size_t hash, std::uint64_t miss, value_uptr_t value, std::error_code error)
+			:
+			key_{key},
+			hash_{hash},
+			miss_{miss},
+			value_{std::move(value)},
+			error_{error}
+			{}
+			
+			Key					key_;
+			std::size_t			hash_;
+			std::uint64_t		miss_;
+			value_uptr_t		value_;
+			std::error_code		error_;
+		};
+		
+		using completion_list_t = std::vector<miss_completion>;
+		
+		// An operation_scope brackets each public operation (and each externally-triggered
+		// completion). Values removed during the operation are retained until the outermost
+		// scope ends, after all replies have been delivered, and then handed to the removal
+		// listener (if any) in one batch, and destroyed.
+		
+		class operation_scope
+		{
+		public:
+		
+			inline operation_scope(lru_cache& cache)
+			:
+			cache_{cache}
+			{
+				++cache_.operation_depth_;
+			}
+			
+			inline ~operation_scope()
+			{
+				if (--cache_.operation_depth_ == 0 && (!cache_.removals_.empty() || !cache_.retired_.empty()))
+				{
+					cache_.release_removals();
+				}
+			}
+			
+			operation_scope(const operation_scope& that) = delete;
+			
+			operation_scope& operator=(const operation_scope& that) = delete;
+			
+		private:
+			lru_cache&			cache_;
+		};
+		
+	public:
+		
+		inline lru_cache(miss_handler_f miss_handler, std::size_t limit, float load = 0.75)
+		:
+		miss_handler_{miss_handler},
+		map_{static_cast<std::size_t>( static_cast<float>(limit) / ((load < 0.5) ? 0.5 : ((load > 0.95) ? 0.95 : load))) + 1},
+		sentinel_{},
+		limit_{limit},
+		pending_replies_{pending_map_buckets},
+		storing_{pending_map_buckets},
+		mutations_{0},
+		deferred_delivery_{false},
+		delivering_{false},
+		write_policy_{write_policy::write_through},
+		write_batch_limit_{64},
+		request_sequence_{0},
+		operation_depth_{0}
+		{
+			sentinel_.second.newer_ = &sentinel_;
+			sentinel_.second.older_ = &sentinel_;
+		}
+		
+		inline ~lru_cache()
+		{}
+		
+		// set_executor supplies the executor that owns the cache (typically, the event loop
+		// on which the cache is used). Once it is set, the miss handler reply may be invoked on
+		// any thread: completions are queued, and the executor is asked to drain the queue, so the
+		// cache is only ever modified (and get replies only invoked) on the owning executor.
+		// Completions that arrive while a drain is already scheduled are handled by that drain,
+		// so a burst of completions costs a single wakeup. The executor must be set before the
+		// first call to get, and the cache must outlive any drain tasks posted to it.
+		
+		inline void set_executor(post_f post)
+		{
+			executor_ = std::move(post);
+		}
+		
+		lru_cache() = delete;
+		
+		lru_cache(const lru_cache& that) = delete;
+		
+		lru_cache(lru_cache&& that) = delete;
+		
+		lru_cache& operator=(const lru_cache& that) = delete;
+	
+		lru_cache& operator=(lru_cache&& that) = delete;
+		
+		inline const_iterator cbegin() const
+		{
+			return const_iterator(sentinel_.second.older_);
+		}
+		
+		inline const_iterator cend() const
+		{
+			return const_iterator(const_cast<const entry_ptr>(&sentinel_));
+		}
+		
+		inline std::size_t size() const
+		{
+			return map_.size();
+		}
+		
+		inline std::size_t limit() const
+		{
+			return limit_;
+		}
+		
+		// apply_promotions applies the buffered promotions (buffered_promotion only; see above).
+		// With buffered promotion, call it before iterating over the cache, if the iterators must
+		// see the current usage order.
+		
+		inline void apply_promotions()
+		{
+			promoter_.drain([this] (entry_ptr entry)
+			{
+				touch(entry);
+			});
+		}
+		
+		// set_limit changes the maximum number of entries (at least one). Lowering the limit
+		// evicts the excess entries immediately, in eviction order, and raising it lets the cache
+		// grow; the hash table grows with it, so the limit may exceed the one it was constructed with.
+		
+		inline void set_limit(std::size_t limit)
+		{
+			operation_scope scope{*this};
+			
+			if (deferring())
+			{
+				defer([this, limit] ()
+				{
+					set_limit_now(limit);
+				});
+			}
+			else
+			{
+				set_limit_now(limit);
+			}
+		}
+		
+		inline void flush()
+		{
+			operation_scope scope{*this};
+			
+			if (deferring())
+			{
+				defer([this] ()
+				{
+					flush_now();
+				});
+			}
+			else
+			{
+				flush_now();
+			}
+		}
+		
+		// hash returns the value of the cache's Hash function for key. The overloads of get, find
+		// and invalidate that take a hash parameter expect exactly this value; they allow
+		// applications that already have a key's hash (or need several operations on the same key)
+		// to avoid computing it again.
+		
+		inline std::size_t hash(const Key& key) const
+		{
+			return map_.hash(key);
+		}
+		
+		inline void get(const Key& key, get_reply_f reply)
+		{
+			get(key, map_.hash(key), std::move(reply));
+		}
+		
+		void get(const Key& key, std::size_t hash, get_reply_f reply)
+		{
+			// A hit removes nothing, a miss handler reply has a scope of its own, and deliver opens
+			// one to drain deferred operations, so (unlike the other operations) get doesn't need an
+			// operation_scope, which would cost the hit path.
+			
+			if (deferring())
+			{
+				defer([this, key, hash, reply] ()
+				{
+					get_now(key, hash, reply);
+				});
+			}
+			else
+			{
+				get_now(key, hash, std::move(reply));
+			}
+		}
+		
+		// This form of get returns the result to a different executor than the cache's. Like every
+		// other operation, it must itself be called on the cache's executor: a caller on another
+		// executor posts a task to the cache's executor that calls it. extract is invoked on the
+		// cache's executor as extract(iter, err), where it can safely read the value; its result
+		// (which must be copyable) is then posted to the origin executor, and passed to reply there.
+		// The iterator itself must not be passed to another thread, since the entry may be evicted
+		// by the time the other thread uses it.
+		
+		template<class Extract, class Reply>
+		void get(const Key& key, post_f origin, Extract extract, Reply reply)
+		{
+			get(key, [origin, extract, reply] (const_iterator iter, std::error_code err) mutable
+			{
+				auto result = extract(iter, err);
+				origin([reply, result] () mutable
+				{
+					reply(std::move(result));
+				});
+			});
+		}
+		
+		inline const_iterator find(const Key& key) const
+		{
+			return find(key, map_.hash(key));
+		}
+		
+		inline const_iterator find(const Key& key, std::size_t hash) const
+		{
+			const_iterator retval;
+			
+			auto hit = map_.find(key, hash);
+			if (hit && !expirer_.expired(hit))
+			{
+				retval = const_iterator{hit};
+			}
+			else
+			{
+				retval = cend();
+			}
+			
+			return retval;
+		}
+
+		inline void invalidate(const Key& key)
+		{
+			invalidate(key, map_.hash(key));
+		}
+		
+		inline void invalidate(const Key& key, std::size_t hash)
+		{
+			operation_scope scope{*this};
+			
+			if (deferring())
+			{
+				defer([this, key, hash] ()
+				{
+					invalidate_now(key, hash);
+				});
+			}
+			else
+			{
+				invalidate_now(key, hash);
+			}
+		}
+		
+		// In deferred delivery mode, cache operations (get, invalidate and flush, as well as
+		// miss handler replies) that are invoked while get replies are being delivered are queued,
+		// rather than performed immediately. The queue is drained, in order, by the outermost
+		// delivery before it returns. This guarantees that every reply in a batch of coalesced
+		// replies receives a valid iterator (even if an earlier reply invalidates the entry), and
+		// that replies which call get, with a miss handler that replies synchronously, are
+		// processed iteratively rather than recursively, so the stack doesn't grow. The cost is
+		// that such nested operations complete after the reply that invoked them returns.
+		
+		inline void set_deferred_delivery(bool deferred)
+		{
+			deferred_delivery_ = deferred;
+		}
+		
+		inline bool deferring() const
+		{
+			return deferred_delivery_ && delivering_;
+		}
+		
+		// set_removal_listener supplies a listener that is told about every value removed from
+		// the cache, and why, and that may take ownership of the values. The listener is invoked
+		// with a batch of removals at the end of the operation that caused them (after that
+		// operation's get replies have been delivered), so neither the listener nor the destruction
+		// of removed values delays the replies. Values left in the batch are destroyed when the
+		// listener returns. Values are also retained until the end of the operation when there is
+		// no listener, for the same reason.
+		
+		inline void set_removal_listener(removal_listener_f listener)
+		{
+			removal_listener_ = std::move(listener);
+		}
+		
+		// set_cost_function replaces the measured cost of each new entry with the function's result
+		// (for example, a known cost per key, or the measured cost clamped to a range); set_size_function
+		// supplies each new entry's size. Both apply only to eviction policies that use costs, and only
+		// to entries added after they are set.
+		
+		inline void set_cost_function(cost_f cost)
+		{
+			cost_function_ = std::move(cost);
+		}
+		
+		inline void set_size_function(size_f size)
+		{
+			size_function_ = std::move(size);
+		}
+		
+		// set_time_to_live sets the life of entries added after it is called (ttl_expiry only)
+		
+		inline void set_time_to_live(std::chrono::steady_clock::duration time_to_live)
+		{
+			expirer_.set_time_to_live(time_to_live);
+		}
+
+		// deadline returns the time at which the entry referred to by iter expires (never, with
+		// no_expiry), for copies of its value held outside the cache
+
+		inline deadline_t deadline(const_iterator iter) const
+		{
+			return expirer_.deadline_of(iter.ptr_);
+		}
+
+		// stats returns the cache's statistics; with no_stats, there are none. The non-const form
+		// allows statistics policies that have settings to be configured.
+		
+		inline const stats_type& stats() const
+		{
+			return stats_;
+		}
+		
+		inline stats_type& stats()
+		{
+			return stats_;
+		}
+		
+		// set_store_handler enables put to write values to the underlying store.
+		//
+		// With write_through, put passes the value to the store handler immediately. Calls to get
+		// for the key wait until the write completes, and then receive the written value (or, if
+		// the write fails, the value obtained from the miss handler). The put reply is invoked when
+		// the write completes.
+		//
+		// With write_behind, put stores the value in the cache, marks it dirty, and replies
+		// immediately. Repeated puts of a dirty key simply replace its value, so only the last is
+		// written. Dirty values are written in batches of up to batch_limit: when that many are
+		// dirty, when flush_writes is called, and before any dirty entry is removed from the cache
+		// (by eviction, invalidate or flush). Gets for a key removed while its store is in flight
+		// wait for the store to complete before calling the miss handler, so they don't receive the
+		// value being replaced. Errors from write-behind stores are reported only to the reply of
+		// flush_writes, if any; a store handler that must not lose writes should retry them itself.
+		//
+		// The store handler must not call the cache synchronously. The policy should be set before
+		// the first call to put.
+		
+		inline void set_store_handler(store_handler_f handler, write_policy policy = write_policy::write_through, std::size_t batch_limit = 64)
+		{
+			store_handler_ = std::move(handler);
+			write_policy_ = policy;
+			write_batch_limit_ = (batch_limit > 0) ? batch_limit : 1;
+		}
+		
+		// put sets the value for key. Without a store handler, it only updates the cache (and
+		// completes any pending gets for the key with the new value).
+		
+		inline void put(const Key& key, value_uptr_t val_uptr, put_reply_f reply = put_reply_f{})
+		{
+			put(key, map_.hash(key), std::move(val_uptr), std::move(reply));
+		}
+		
+		void put(const Key& key, std::size_t hash, value_uptr_t val_uptr, put_reply_f reply = put_reply_f{})
+		{
+			operation_scope scope{*this};
+			
+			if (deferring())
+			{
+				auto holder = std::make_shared<value_uptr_t>(std::move(val_uptr));
+				defer([this, key, hash, holder, reply] ()
+				{
+					put_now(key, hash, std::move(*holder), reply);
+				});
+			}
+			else
+			{
+				put_now(key, hash, std::move(val_uptr), std::move(reply));
+			}
+		}
+		
+		// flush_writes writes all dirty values (write_behind only). The reply, if any, is invoked
+		// when all of the resulting stores have completed, with the first error reported.
+		
+		void flush_writes(put_reply_f reply = put_reply_f{})
+		{
+			static const std::error_code no_error{0, std::system_category()};
+			
+			if (dirty_.empty() || !store_handler_)
+			{
+				if (reply)
+				{
+					reply(no_error);
+				}
+				return;
+			}
+			
+			std::vector<entry_ptr> flushing(dirty_.begin(), dirty_.end());
+			dirty_.clear();
+			
+			class flush_state
+			{
+			public:
+				std::size_t			remaining_;
+				std::error_code		error_;
+				put_reply_f			reply_;
+			};
+			
+			auto state = std::make_shared<flush_state>();
+			state->remaining_ = (flushing.size() + write_batch_limit_ - 1) / write_batch_limit_;
+			state->reply_ = std::move(reply);
+			
+			write_batch_t batch;
+			batch.reserve(std::min(flushing.size(), write_batch_limit_));
+			
+			for (std::size_t i = 0; i < flushing.size(); i += write_batch_limit_)
+			{
+				auto write = ++request_sequence_;
+				auto keys = std::make_shared<stored_keys_t>();
+				
+				batch.clear();
+				for (std::size_t j = i; j < flushing.size() && j < i + write_batch_limit_; ++j)
+				{
+					entry_ptr entry = flushing[j];
+					batch.emplace_back(&entry->first, entry->second.value_.get());
+					keys->emplace_back(entry->first, entry->hash_);
+					
+					auto storing = storing_.find(entry->first, entry->hash_);
+					if (storing)
+					{
+						storing->second = write;
+					}
+					else
+					{
+						storing_.emplace(entry->first, entry->hash_, write);
+					}
+				}
+				
+				store_handler_(batch, [this, state, keys, write] (std::error_code err)
+				{
+					on_executor([this, state, keys, write, err] ()
+					{
+						complete_store(*keys, write);
+						if (err && !state->error_)
+						{
+							state->error_ = err;
+						}
+						if (--state->remaining_ == 0 && state->reply_)
+						{
+							state->reply_(state->error_);
+						}
+					});
+				});
+			}
+		}
+		
+		inline std::size_t dirty_count() const
+		{
+			return dirty_.size();
+		}
+		
+#if defined(__cpp_impl_coroutine)
+
+		// get_result is the result of co_await co_get(key). Like std::expected, it holds either a
+		// value (accessed through the iterator, or operator* and operator->) or an error code.
+		
+		class get_result
+		{
+		public:
+		
+			inline get_result()
+			:
+			iter_{},
+			error_{},
+			has_value_{false}
+			{}
+			
+			inline get_result(const_iterator iter, std::error_code error, bool has_value)
+			:
+			iter_{iter},
+			error_{error},
+			has_value_{has_value}
+			{}
+			
+			inline bool has_value() const
+			{
+				return has_value_;
+			}
+			
+			inline explicit operator bool() const
+			{
+				return has_value_;
+			}
+			
+			inline const std::error_code& error() const
+			{
+				return error_;
+			}
+			
+			inline const_iterator iterator() const
+			{
+				return iter_;
+			}
+			
+			inline const T& operator*() const
+			{
+				return *iter_;
+			}
+			
+			inline const T* operator->() const
+			{
+				return iter_.operator->();
+			}
+			
+		private:
+			const_iterator		iter_;
+			std::error_code		error_;
+			bool				has_value_;
+		};
+		
+		// get_awaiter is the awaitable returned by co_get. A hit completes in await_ready,
+		// so the awaiting coroutine is neither suspended nor allocates anything. A miss goes
+		// through get, so concurrent requests for the key are coalesced as usual, and the
+		// coroutine resumes (on the thread that invokes the miss handler reply) when the
+		// value arrives. If the miss handler replies synchronously, the coroutine doesn't suspend.
+		
+		class get_awaiter
+		{
+		public:
+		
+			inline get_awaiter(lru_cache& cache, const Key& key, std::size_t hash)
+			:
+			cache_{cache},
+			key_{key},
+			hash_{hash},
+			result_{},
+			suspending_{false},
+			completed_{false}
+			{}
+			
+			inline bool await_ready()
+			{
+				static const std::error_code no_error{0, std::system_category()};
+				
+				if (cache_.deferring())
+				{
+					// let get defer the request, to be resumed when it is drained
+					
+					return false;
+				}
+				
+				auto hit = cache_.live(cache_.map_.find(key_, hash_));
+				if (hit)
+				{
+					cache_.stats_.hit(hash_);
+					cache_.promote(hit);
+					result_ = get_result{const_iterator{hit}, no_error, true};
+				}
+				return hit != nullptr;
+			}
+			
+			inline bool await_suspend(std::coroutine_handle<> handle)
+			{
+				suspending_ = true;
+				cache_.get(key_, hash_, [this, handle] (const_iterator iter, std::error_code err)
+				{
+					result_ = get_result{iter, err, !err && iter != cache_.cend()};
+					completed_ = true;
+					if (!suspending_)
+					{
+						handle.resume();
+					}
+				});
+				suspending_ = false;
+				return !completed_;
+			}
+			
+			inline get_result await_resume() const
+			{
+				return result_;
+			}
+			
+		private:
+			lru_cache&			cache_;
+			const Key&			key_;
+			std::size_t			hash_;
+			get_result			result_;
+			bool				suspending_;
+			bool				completed_;
+		};
+		
+		// co_get is the coroutine equivalent of get:
+		//
+		//	auto result = co_await cache.co_get(key);
+		//	if (result) { use(*result); } else { handle(result.error()); }
+		//
+		// The key must remain valid until the co_await expression completes.
+		
+		inline get_awaiter co_get(const Key& key)
+		{
+			return get_awaiter{*this, key, map_.hash(key)};
+		}
+		
+		inline get_awaiter co_get(const Key& key, std::size_t hash)
+		{
+			return get_awaiter{*this, key, hash};
+		}
+
+#endif
+
+		// scan visits the cache's entries by walking its hash table rather than its usage list, calling
+		// visit(key, value) for each entry that hasn't expired, in no particular order. It stops after
+		// max_buckets buckets (one slab), or at the end of the cursor's range, and leaves the cursor
+		// where it stopped, so a large scan can be spread over several turns of the event loop. A cursor
+		// is a position in the hash space rather than a pointer to an entry, so it remains valid while
+		// gets, puts and evictions change the cache, and when the table grows: an entry that is in the
+		// cache for the whole scan is visited exactly once, and one added or removed during the scan
+		// at most once. visit must not change the cache (to invalidate entries, collect their keys and
+		// invalidate them after the call). The parts of a split cursor may be scanned on different
+		// threads at once, as long as nothing changes the cache meanwhile.
+		
+		template<class Visitor>
+		inline void scan(scan_cursor& cursor, std::size_t max_buckets, Visitor&& visit) const
+		{
+			if (cursor.done_)
+			{
+				return;
+			}
+			cursor.done_ = !map_.scan(cursor.first_, cursor.last_, max_buckets, [&] (entry_ptr entry)
+			{
+				if (!expirer_.expired(entry))
+				{
+					visit(entry->first, *entry->second.value_);
+				}
+			});
+		}
+		
+		template<class Visitor>
+		inline void scan(Visitor&& visit) const
+		{
+			scan_cursor cursor;
+			scan(cursor, std::numeric_limits<std::size_t>::max(), std::forward<Visitor>(visit));
+		}
+		
+		// find_many and get_many are batched equivalents of find and get. Keys are processed in
+		// blocks of batch_width: every key in a block is hashed first, and the bucket slots, chain heads
+		// and (for hits) list neighbors are prefetched in successive passes, so that the memory latency
+		// of one key's probe overlaps with the others' rather than stalling each lookup in turn.
+		
+		static constexpr std::size_t batch_width = 16;
+		
+		// find_many writes one const_iterator per key to results (cend() for keys not in the cache,
+		// or expired). Like find, it does not change the usage order.
+		
+		template<class ForwardIt, class OutputIt>
+		void find_many(ForwardIt first, ForwardIt last, OutputIt results) const
+		{
+			std::size_t hashes[batch_width];
+			entry_ptr hits[batch_width];
+			
+			while (first != last)
+			{
+				std::size_t count = resolve_batch(first, last, hashes, hits);
+				for (std::size_t i = 0; i < count; ++i, ++first)
+				{
+					*results = (hits[i] && !expirer_.expired(hits[i])) ? const_iterator{hits[i]} : cend();
+					++results;
+				}
+			}
+		}
+		
+		// get_many is equivalent to calling get for each key in sequence, except that reply is
+		// invoked with the key as its first argument, as in reply(key, iter, err). Hits are promoted
+		// and replied to in key order, exactly as sequential calls to get would leave them. Misses are
+		// passed to the miss handler as they are encountered. The reply functor must be copyable if
+		// any of the keys may miss.
+		
+		template<class ForwardIt, class Reply>
+		void get_many(ForwardIt first, ForwardIt last, Reply reply)
+		{
+			static const std::error_code no_error{0, std::system_category()};
+			
+			std::size_t hashes[batch_width];
+			entry_ptr hits[batch_width];
+			operation_scope scope{*this};
+			
+			if (deferring())
+			{
+				for (; first != last; ++first)
+				{
+					const Key& key = *first;
+					get(key, [reply, key] (const_iterator it, std::error_code err) mutable
+					{
+						reply(key, it, err);
+					});
+				}
+				return;
+			}
+			
+			while (first != last)
+			{
+				std::size_t count = resolve_batch(first, last, hashes, hits);
+				std::uint64_t mutations = mutations_;
+				
+				for (std::size_t i = 0; i < count; ++i, ++first)
+				{
+					const Key& key = *first;
+					
+					if (mutations != mutations_)
+					{
+						// a reply or a synchronous miss handler has inserted or removed entries
+						// since the block was resolved, so the remaining results may be stale
+						
+						hits[i] = map_.find(key, hashes[i]);
+					}
+					
+					hits[i] = live(hits[i]);
+					if (hits[i])
+					{
+						stats_.hit(hashes[i]);
+						promote(hits[i]);
+						deliver([&] ()
+						{
+							reply(key, const_iterator{hits[i]}, no_error);
+						});
+					}
+					else
+					{
+						get(key, hashes[i], [reply, key] (const_iterator it, std::error_code err) mutable
+						{
+							reply(key, it, err);
+						});
+					}
+				}
+			}
+		}
+
+	protected:
+		
+		void get_now(const Key& key, std::size_t hash, get_reply_f reply)
+		{
+			static const std::error_code no_error{0, std::system_category()};
+			
+			auto hit = live(map_.find(key, hash));
+			if (hit)
+			{
+				stats_.hit(hash);
+				promote(hit);
+				deliver([&] ()
+				{
+					reply(const_iterator{hit}, no_error);
+				});
+			}
+			else
+			{
+				stats_.miss(hash);
+				auto pending_iter = pending_replies_.find(key, hash);
+				if (pending_iter)
+				{
+					//	a previous call to miss_handler is still pending
+					//	add this reply to the list for the key
+					
+					pending_iter->second.replies_.push_back(reply);
+				}
+				else
+				{
+					// create an entry in pending_replies for the key
+					// with this reply in the list
+					
+					pending_iter = pending_replies_.emplace(key, hash);
+					pending_iter->second.replies_.push_back(reply);
+					
+					// call the miss_handler
+
+					call_miss_handler(key, hash, pending_iter->second);
+				}
+			}
+		}
+		
+		inline void call_miss_handler(const Key& key, std::size_t hash, pending_request& request)
+		{
+			if (eviction_policy::measures_cost)
+			{
+				request.started_ = std::chrono::steady_clock::now();
+			}
+			
+			auto miss = request.miss_ = ++request_sequence_;
+			miss_handler_(key,
+			[this,key,hash,miss] (value_uptr_t val_uptr, std::error_code err = std::error_code())
+			{
+				if (executor_)
+				{
+					post_completion(key, hash, miss, std::move(val_uptr), err);
+				}
+				else
+				{
+					operation_scope scope{*this};
+					complete_miss(key, hash, miss, std::move(val_uptr), err);
+				}
+			});
+		}
+		
+		inline void complete_miss(const Key& key, std::size_t hash, std::uint64_t miss, value_uptr_t val_uptr, std::error_code err)
+		{
+			if (deferring())
+			{
+				// std::function requires a copyable target, so the completion is held by a shared_ptr
+				
+				auto completion = std::make_shared<miss_completion>(key, hash, miss, std::move(val_uptr), err);
+				defer([this, completion] ()
+				{
+					complete_miss_now(completion->key_, completion->hash_, std::move(completion->value_), completion->error_, completion->miss_);
+				});
 			}
-			
-			inline bool operator==(const const_iterator& that) const
+			else
 			{
-				return ptr_ == that.ptr_;
+				complete_miss_now(key, hash, std::move(val_uptr), err, miss);
 			}
+		}
+		
+		void put_now(const Key& key, std::size_t hash, value_uptr_t val_uptr, put_reply_f reply)
+		{
+			static const std::error_code no_error{0, std::system_category()};
 			
-			inline bool operator!=(const const_iterator& that) const
+			if (store_handler_ && write_policy_ == write_policy::write_behind)
 			{
-				return ptr_ != that.ptr_;
+				auto entry = map_.find(key, hash);
+				if (entry)
+				{
+					// the entry is reused for the new value, which the evictor and expirer treat
+					// as newly added
+					
+					std::swap(entry->second.value_, val_uptr);
+					retire(entry->first, std::move(val_uptr), removal_cause::replaced, expirer_.deadline_of(entry));
+					apply_promotions();
+					evictor_.removed(entry);
+					extract(entry);
+					insert_at_head(entry);
+					admit(entry, -1);
+				}
+				else
+				{
+					entry = add_entry(key, hash, std::move(val_uptr)).ptr_;
+				}
+				
+				dirty_.insert(entry);
+				
+				// pending gets for the key receive the new value, and the pending miss is abandoned
+				
+				auto pending_entry = pending_replies_.find(key, hash);
+				if (pending_entry)
+				{
+					pending_reply_list_t replies{std::move(pending_entry->second.replies_)};
+					pending_replies_.erase(pending_entry);
+					
+					deliver([&] ()
+					{
+						for (auto& pending_reply : replies)
+						{
+							pending_reply(const_iterator{entry}, no_error);
+						}
+					});
+				}
+				
+				if (reply)
+				{
+					reply(no_error);
+				}
+				
+				if (dirty_.size() >= write_batch_limit_)
+				{
+					flush_writes();
+				}
 			}
-			
-			inline const_reference operator*() const
+			else
 			{
-				return ptr_->second.value_.operator*();
+				// Remove the stale entry and hold any gets for the key until the write completes.
+				// The sequence number supersedes any pending miss, and any earlier write.
+				
+				auto stale = map_.find(key, hash);
+				if (stale)
+				{
+					remove(stale, removal_cause::replaced);
+				}
+				
+				auto pending_entry = pending_replies_.find(key, hash);
+				if (!pending_entry)
+				{
+					pending_entry = pending_replies_.emplace(key, hash);
+				}
+				auto write = ++request_sequence_;
+				pending_entry->second.write_ = write;
+				
+				if (!store_handler_)
+				{
+					complete_write(key, hash, std::move(val_uptr), write, no_error, reply);
+				}
+				else
+				{
+					auto holder = std::make_shared<value_uptr_t>(std::move(val_uptr));
+					write_batch_t batch{{&key, holder->get()}};
+					
+					store_handler_(batch, [this, key, hash, holder, write, reply] (std::error_code err)
+					{
+						on_executor([this, key, hash, holder, write, reply, err] ()
+						{
+							complete_write(key, hash, std::move(*holder), write, err, reply);
+						});
+					});
+				}
 			}
+		}
+		
+		inline void complete_write(const Key& key, std::size_t hash, value_uptr_t val_uptr, std::uint64_t write, std::error_code err, const put_reply_f& reply)
+		{
+			operation_scope scope{*this};
 			
-			inline const_pointer operator->() const
+			if (!err)
 			{
-				return ptr_->second.value_.operator->();
+				complete_miss_now(key, hash, std::move(val_uptr), err, write);
 			}
-			
-			inline friend void swap(const_iterator& a, const_iterator& b)
+			else
 			{
-				const_iterator tmp{a};
-				a = b;
-				b = tmp;
+				// The write failed, so the value is discarded. If it is still the latest write
+				// for the key, any waiting gets are served from the miss handler instead.
+				
+				auto pending_entry = pending_replies_.find(key, hash);
+				if (pending_entry && pending_entry->second.write_ == write)
+				{
+					pending_entry->second.write_ = 0;
+					if (pending_entry->second.replies_.empty())
+					{
+						pending_replies_.erase(pending_entry);
+					}
+					else
+					{
+						call_miss_handler(key, hash, pending_entry->second);
+					}
+				}
 			}
 			
-			// added for test purposes
-			
-			inline bool check_linkage() const
+			if (reply)
 			{
-				return (ptr_->second.older_->second.newer_ == ptr_) && (ptr_->second.newer_->second.older_ == ptr_);
+				reply(err);
 			}
-			
-		};
-		
-		using get_reply_f = std::function< void (const_iterator, std::error_code) >;
-		using miss_handler_reply_f = std::function< void (value_uptr_t, std::error_code) >;
-		using miss_handler_f = std::function< void (const Key&, miss_handler_reply_f) >;
-		
-	protected:
-		
-		using pending_reply_list_t = std::vector<get_reply_f>;
-		using pending_map_t = std::unordered_map<Key, pending_reply_list_t>;
-		using pending_map_iterator_t = typename pending_map_t::iterator;
-		using pending_reply_iterator_t = typename pending_reply_list_t::iterator;
+		}
 		
-	public:
+		// complete_store releases the gets held for the keys of a completed write-behind store.
+		// Whether or not the store succeeded, the underlying store now holds whatever value the
+		// miss handler will return, so the held gets are passed to the miss handler.
 		
-		inline lru_cache(miss_handler_f miss_handler, std::size_t limit, float load = 0.75)
-		:
-		miss_handler_{miss_handler},
-		map_{static_cast<std::size_t>( static_cast<float>(limit) / ((load < 0.5) ? 0.5 : ((load > 0.95) ? 0.95 : load))) + 1},
-		sentinel_{},
-		limit_{limit}
+		inline void complete_store(const stored_keys_t& keys, std::uint64_t write)
 		{
-			sentinel_.second.newer_ = &sentinel_;
-			sentinel_.second.older_ = &sentinel_;
+			operation_scope scope{*this};
+			
+			for (auto& key : keys)
+			{
+				auto storing = storing_.find(key.first, key.second);
+				if (storing && storing->second == write)
+				{
+					storing_.erase(storing);
+				}
+				
+				auto pending_entry = pending_replies_.find(key.first, key.second);
+				if (pending_entry && pending_entry->second.write_ == write)
+				{
+					pending_entry->second.write_ = 0;
+					if (pending_entry->second.replies_.empty())
+					{
+						pending_replies_.erase(pending_entry);
+					}
+					else
+					{
+						call_miss_handler(key.first, key.second, pending_entry->second);
+					}
+				}
+			}
 		}
 		
-		inline ~lru_cache()
-		{}
-		
-		lru_cache() = delete;
-		
-		lru_cache(const lru_cache& that) = delete;
+		// hold_for_store is called when an entry is removed. If a write-behind store of the key is
+		// in flight, gets for the key wait for it, as they would for a write-through put.
 		
-		lru_cache(lru_cache&& that) = delete;
+		inline void hold_for_store(const Key& key, std::size_t hash)
+		{
+			auto storing = storing_.find(key, hash);
+			if (storing)
+			{
+				auto pending_entry = pending_replies_.find(key, hash);
+				if (!pending_entry)
+				{
+					pending_entry = pending_replies_.emplace(key, hash);
+				}
+				pending_entry->second.write_ = storing->second;
+			}
+		}
 		
-		lru_cache& operator=(const lru_cache& that) = delete;
-	
-		lru_cache& operator=(lru_cache&& that) = delete;
+		// on_executor runs task on the cache's executor, if it has one, and otherwise immediately
 		
-		inline const_iterator cbegin() const
+		inline void on_executor(task_f task)
 		{
-			return const_iterator(sentinel_.second.older_);
+			if (executor_)
+			{
+				executor_(std::move(task));
+			}
+			else
+			{
+				task();
+			}
 		}
 		
-		inline const_iterator cend() const
+		// complete_miss_now inserts the value from a miss handler reply or a completed write-through
+		// put (request is its sequence number), and delivers it to the waiting replies. The result is
+		// discarded unless it is the one the pending request awaits.
+		
+		inline void complete_miss_now(const Key& key, std::size_t hash, value_uptr_t val_uptr, std::error_code err, std::uint64_t request)
 		{
-			return const_iterator(const_cast<const entry_ptr>(&sentinel_));
+			auto pending_entry = pending_replies_.find(key, hash);
+			if (!pending_entry || pending_entry->second.awaited() != request)
+			{
+				return;
+			}
+			auto write = pending_entry->second.write_;
+			
+			const_iterator result_iter{cend()};
+			
+			if (val_uptr)
+			{
+				double cost = -1;
+				if (eviction_policy::measures_cost && write == 0 && pending_entry->second.started_ != std::chrono::steady_clock::time_point{})
+				{
+					cost = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - pending_entry->second.started_).count();
+				}
+				result_iter = replace_entry(key, hash, std::move(val_uptr), cost);
+			}
+			
+			// The reply list is removed from pending_replies_ before any of the replies are invoked,
+			// so a reply that calls get for the same key (after an error, for example) starts a new
+			// request, rather than appending to the list being iterated.
+			
+			pending_reply_list_t replies{std::move(pending_entry->second.replies_)};
+			pending_replies_.erase(pending_entry);
+			
+			deliver([&] ()
+			{
+				for (auto& pending_reply : replies)
+				{
+					pending_reply(result_iter, err);
+				}
+			});
 		}
 		
-		inline std::size_t size() const
+		inline void invalidate_now(const Key& key, std::size_t hash)
 		{
-			return map_.size();
+			auto fit = map_.find(key, hash);
+			if (fit)
+			{
+				remove(fit, removal_cause::invalidated);
+			}
 		}
 		
-		inline std::size_t limit() const
+		inline void set_limit_now(std::size_t limit)
 		{
-			return limit_;
+			limit_ = (limit > 0) ? limit : 1;
+			enforce_limit();
 		}
 		
-		inline void flush()
+		inline void flush_now()
 		{
+			flush_writes();
+			for (auto entry = sentinel_.second.older_; entry != &sentinel_; entry = entry->second.older_)
+			{
+				if (storing_.size() != 0)
+				{
+					hold_for_store(entry->first, entry->hash_);
+				}
+				retire(entry->first, std::move(entry->second.value_), removal_cause::flushed, expirer_.deadline_of(entry));
+			}
+			promoter_.clear();
 			map_.clear();
+			evictor_.cleared();
+			++mutations_;
 			sentinel_.second.newer_ = &sentinel_;
 			sentinel_.second.older_ = &sentinel_;
 			
 			// pending_replies_ should decidedly NOT be cleared
 		}
 		
-		void get(const Key& key, get_reply_f reply)
+		// deliver invokes get replies. In deferred delivery mode, the outermost delivery drains
+		// the operations deferred while the replies ran (including any deferred by the operations
+		// it drains) before returning.
+		
+		template<class Replies>
+		inline void deliver(Replies replies)
 		{
-			static const std::error_code no_error{0, std::system_category()};
-			
-			auto hit = map_.find(key);
-			if (hit != map_.end())
+			if (!deferred_delivery_ || delivering_)
 			{
-				touch(hit);
-				reply(const_iterator{&(*hit)}, no_error);
+				replies();
 			}
 			else
 			{
-				auto pending_iter = pending_replies_.find(key);
-				if (pending_iter != pending_replies_.end())
+				// the deferred operations may remove entries, so their removals are released
+				// when the drain ends (a hit has no operation_scope of its own)
+				
+				operation_scope scope{*this};
+				delivering_ = true;
+				replies();
+				while (!deferred_ops_.empty())
 				{
-					//	a previous call to miss_handler is still pending
-					//	add this reply to the list for the key
-					
-					pending_iter->second.push_back(reply);
+					task_f op{std::move(deferred_ops_.front())};
+					deferred_ops_.pop_front();
+					op();
 				}
-				else
+				delivering_ = false;
+			}
+		}
+		
+		inline void defer(task_f op)
+		{
+			deferred_ops_.push_back(std::move(op));
+		}
+		
+		inline void post_completion(const Key& key, std::size_t hash, std::uint64_t miss, value_uptr_t val_uptr, std::error_code err)
+		{
+			bool schedule_drain = false;
+			{
+				std::lock_guard<std::mutex> lock{completions_mutex_};
+				schedule_drain = completions_.empty();
+				completions_.emplace_back(key, hash, miss, std::move(val_uptr), err);
+			}
+			
+			if (schedule_drain)
+			{
+				executor_([this] ()
 				{
-					// create an entry in pending_replies for the key
-					// with this reply in the list
-					
-					auto pending_emplaced = pending_replies_.emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(pending_reply_list_t()));
-					pending_iter = pending_emplaced.first;
-					pending_iter->second.push_back(reply);
-					
-					// call the miss_handler
-
-					miss_handler_(key,
-					[this,key] (value_uptr_t val_uptr, std::error_code err = std::error_code())
-					{
-						const_iterator result_iter{cend()};
-						
-						if (val_uptr)
-						{
-							result_iter = add_entry(key, std::move(val_uptr));
-						}
-							
-						auto pending_reply_iter = pending_replies_.find(key);
-						for (auto& pending_reply : pending_reply_iter->second)
-						{
-							pending_reply(result_iter, err);
-						}
-						pending_replies_.erase(pending_reply_iter);
-					});
-				}
+					drain_completions();
+				});
 			}
 		}
 		
-		inline const_iterator find(const Key& key) const
+		inline void drain_completions()
 		{
-			const_iterator retval;
+			operation_scope scope{*this};
+			completion_list_t batch;
+			{
+				std::lock_guard<std::mutex> lock{completions_mutex_};
+				batch.swap(completions_);
+			}
 			
-			auto hit = map_.find(key);
-			if (hit != map_.end())
+			for (auto& completion : batch)
 			{
-				retval = const_iterator{&(*hit)};
+				complete_miss(completion.key_, completion.hash_, completion.miss_, std::move(completion.value_), completion.error_);
 			}
-			else
+		}
+		
+		// resolve_batch hashes and probes up to batch_width keys starting at first, storing the
+		// hash and the matching entry (or nullptr) for each. It returns the number of keys resolved.
+		
+		template<class ForwardIt>
+		std::size_t resolve_batch(ForwardIt first, ForwardIt last, std::size_t* hashes, entry_ptr* hits) const
+		{
+			std::size_t count = 0;
+			
+			for (auto it = first; it != last && count < batch_width; ++it, ++count)
 			{
-				retval = cend();
+				hashes[count] = map_.hash(*it);
+				map_.prefetch_bucket(hashes[count]);
 			}
 			
-			return retval;
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				detail::prefetch(map_.bucket_head(hashes[i]));
+			}
+			
+			for (std::size_t i = 0; i < count; ++i, ++first)
+			{
+				hits[i] = map_.find(*first, hashes[i]);
+				if (hits[i])
+				{
+					// touch() writes to both neighbors, and the caller will most likely read the value
+					
+					detail::prefetch(hits[i]->second.older_);
+					detail::prefetch(hits[i]->second.newer_);
+					detail::prefetch(hits[i]->second.value_.get());
+				}
+			}
+			
+			return count;
 		}
-
-		inline void invalidate(const Key& key)
+		
+		inline const_iterator replace_entry(const Key& key, std::size_t hash, std::unique_ptr<T> val_uptr, double cost = -1)
 		{
-			auto fit = map_.find(key);
-			if (fit != map_.end())
+			auto existing = map_.find(key, hash);
+			if (existing)
 			{
-				remove(fit);
+				remove(existing, removal_cause::replaced);
 			}
+			return add_entry(key, hash, std::move(val_uptr), cost);
 		}
-
-	protected:
 		
-		inline const_iterator add_entry(const Key& key, std::unique_ptr<T> val_uptr)
+		// cost is the measured cost of the value, in nanoseconds, or negative if it wasn't measured.
+		// The limit is enforced before the new entry is given to the evictor, so it can't be
+		// chosen as the victim.
+		
+		inline const_iterator add_entry(const Key& key, std::size_t hash, std::unique_ptr<T> val_uptr, double cost = -1)
 		{
-			auto emplaced = map_.emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::move(val_uptr)));
+			apply_promotions();
 			
-			insert_at_head(&(*emplaced.first));
+			auto emplaced = map_.emplace(key, hash, std::move(val_uptr));
+			++mutations_;
+			
+			insert_at_head(emplaced);
 			enforce_limit();
-			return const_iterator{&(*emplaced.first)};
+			admit(emplaced, cost);
+			
+			return const_iterator{emplaced};
+		}
+		
+		// admit gives an entry with a new value to the evictor (applying the cost and size
+		// functions) and to the expirer
+		
+		inline void admit(entry_ptr entry, double cost)
+		{
+			double size = 1;
+			if (eviction_policy::measures_cost)
+			{
+				if (cost_function_)
+				{
+					cost = cost_function_(entry->first, *entry->second.value_, cost);
+				}
+				if (size_function_)
+				{
+					size = size_function_(entry->first, *entry->second.value_);
+				}
+			}
+			evictor_.added(entry, cost, size);
+			expirer_.added(entry);
 		}
 
 
-		inline void remove(map_iterator& it)
+		inline void remove(entry_ptr entry, removal_cause cause)
 		{
-			extract(&(*it));
-			map_.erase(it);
+			apply_promotions();
+			
+			if (!dirty_.empty() && dirty_.count(entry) != 0)
+			{
+				// dirty values are never dropped without being written
+				
+				flush_writes();
+			}
+			if (storing_.size() != 0 && cause != removal_cause::replaced)
+			{
+				hold_for_store(entry->first, entry->hash_);
+			}
+
+			retire(entry->first, std::move(entry->second.value_), cause, expirer_.deadline_of(entry));
+			evictor_.removed(entry);
+			extract(entry);
+			map_.erase(entry);
+			++mutations_;
 		}
 
 		inline void extract(entry_ptr node)
@@ -348,29 +2474,87 @@ namespace utils
 			sentinel_.second.older_ = node;
 		}
 		
-		inline void evict_lru()
+		inline void evict()
+		{
+			apply_promotions();
+			stats_.eviction();
+			remove(evictor_.victim(sentinel_), removal_cause::size);
+		}
+		
+		// live returns entry, unless it has expired, in which case it is removed, and live
+		// returns nullptr
+		
+		inline entry_ptr live(entry_ptr entry)
+		{
+			if (entry && expirer_.expired(entry))
+			{
+				operation_scope scope{*this};
+				stats_.expiration();
+				remove(entry, removal_cause::expired);
+				return nullptr;
+			}
+			return entry;
+		}
+		
+		// retire holds a removed value until the end of the current operation
+		
+		inline void retire(const Key& key, value_uptr_t value, removal_cause cause, deadline_t deadline)
+		{
+			if (removal_listener_)
+			{
+				removals_.emplace_back(key, std::move(value), cause, deadline);
+			}
+			else
+			{
+				retired_.push_back(std::move(value));
+			}
+		}
+		
+		inline void release_removals()
 		{
-			auto lru = sentinel_.second.newer_;
-			auto found = map_.find(lru->first);
-			remove(found);
+			// Removals caused by the listener's own calls to the cache are released
+			// by the next iteration, rather than recursively.
+			
+			++operation_depth_;
+			while (!removals_.empty() || !retired_.empty())
+			{
+				removal_batch_t batch;
+				batch.swap(removals_);
+				retired_.clear();
+				if (removal_listener_ && !batch.empty())
+				{
+					removal_listener_(batch);
+				}
+			}
+			--operation_depth_;
 		}
 
+		// promote records a hit: it touches the entry now, or buffers the touch (buffered_promotion)
+		
+		inline void promote(entry_ptr node)
+		{
+			if (!promoter_type::buffers)
+			{
+				touch(node);
+			}
+			else if (promoter_.record(node))
+			{
+				apply_promotions();
+			}
+		}
+		
 		inline void touch(entry_ptr node)
 		{
 			extract(node);
 			insert_at_head(node);
-		}
-
-		inline void touch(const map_iterator& it)
-		{
-			touch(&(*it));
+			evictor_.touched(node);
 		}
 		
 		inline void enforce_limit()
 		{
 			while (map_.size() > limit_)
 			{
-				evict_lru();
+				evict();
 			}
 		}
 		
@@ -379,6 +2563,29 @@ namespace utils
 		std::size_t			limit_;
 		miss_handler_f		miss_handler_;
 		pending_map_t		pending_replies_;
+		storing_map_t		storing_;
+		std::uint64_t		mutations_;
+		post_f				executor_;
+		std::mutex			completions_mutex_;
+		completion_list_t	completions_;
+		bool				deferred_delivery_;
+		bool				delivering_;
+		std::deque<task_f>	deferred_ops_;
+		store_handler_f		store_handler_;
+		write_policy		write_policy_;
+		std::size_t			write_batch_limit_;
+		std::uint64_t		request_sequence_;
+		std::unordered_set<entry_ptr>	dirty_;	// written by put, but not yet stored (write_behind only)
+		removal_listener_f	removal_listener_;
+		std::size_t			operation_depth_;
+		removal_batch_t		removals_;
+		std::vector<value_uptr_t>	retired_;
+		evictor_type		evictor_;
+		cost_f				cost_function_;
+		size_f				size_function_;
+		expirer_type		expirer_;
+		stats_type			stats_;
+		promoter_type		promoter_;
 	};
 	
 }
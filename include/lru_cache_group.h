@@ -0,0 +1,585 @@
+/*
+MIT License
+
+Copyright © 2016 David Curtis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef guard_utils_lru_cache_group_h
+#define guard_utils_lru_cache_group_h
+
+#include "lru_cache.h"
+#include <unordered_map>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+
+namespace utils
+{
+	namespace detail
+	{
+		// shards_sampler estimates a cache's miss-ratio curve (the misses it would have had at every
+		// size) by spatial sampling (SHARDS). An access is sampled if its key's mixed hash falls below a
+		// threshold, so a key is either always or never sampled, and the sampled keys see the same
+		// reuse pattern as the whole. For each sampled access, the sampler finds the LRU stack distance:
+		// the number of other sampled keys used since the key's last use. A cache of size c would
+		// have hit the access if the distance, scaled by the sampling rate, were less than c.
+		//
+		// Distances are found with a Fenwick tree over access times, in which only each key's latest
+		// access is marked, so each costs O(log n); the times are renumbered when they run out. At
+		// most max_keys sampled keys are tracked (the least recently used is forgotten), which bounds
+		// the memory used, and the sizes the curve covers, to max_keys / rate.
+
+		class shards_sampler
+		{
+		public:
+
+			static const std::uint64_t modulus = std::uint64_t{1} << 24;
+
+			// an unconfigured sampler samples nothing
+
+			inline shards_sampler()
+			:
+			threshold_{0},
+			rate_{0},
+			max_keys_{0},
+			capacity_{0},
+			now_{0},
+			oldest_{1},
+			cold_{0},
+			sampled_{0}
+			{}
+
+			// configure sets the sampling rate (in (0, 1]) and the number of sampled keys tracked,
+			// and discards any samples
+
+			inline void configure(double rate, std::size_t max_keys)
+			{
+				threshold_ = (rate >= 1) ? modulus : std::max<std::uint64_t>(1, static_cast<std::uint64_t>(rate * modulus));
+				rate_ = static_cast<double>(threshold_) / modulus;
+				max_keys_ = std::max<std::size_t>(max_keys, 1);
+				capacity_ = 2 * max_keys_ + 1;
+				tree_.assign(capacity_, 0);
+				owner_.assign(capacity_, 0);
+				live_.assign(capacity_, 0);
+				last_.clear();
+				last_.reserve(max_keys_);
+				histogram_.assign(max_keys_, 0);
+				now_ = 0;
+				oldest_ = 1;
+				cold_ = 0;
+				sampled_ = 0;
+			}
+
+			inline double rate() const
+			{
+				return rate_;
+			}
+
+			inline void access(std::size_t hash)
+			{
+				auto key = mix(hash);
+				if ((key & (modulus - 1)) < threshold_)
+				{
+					record(key);
+				}
+			}
+
+			// accesses estimates the number of accesses since the samples were last decayed
+
+			inline double accesses() const
+			{
+				return (rate_ > 0) ? sampled_ / rate_ : 0;
+			}
+
+			// misses estimates the number of those accesses that a cache of the given size would
+			// have missed
+
+			inline double misses(std::size_t size) const
+			{
+				if (rate_ == 0)
+				{
+					return 0;
+				}
+				double result = cold_;
+				for (auto distance = first_miss(size); distance < histogram_.size(); ++distance)
+				{
+					result += histogram_[distance];
+				}
+				return result / rate_;
+			}
+
+			// curve returns misses(i * step) for i in [0, points)
+
+			inline std::vector<double> curve(std::size_t step, std::size_t points) const
+			{
+				std::vector<double> suffix(histogram_.size() + 1, cold_);
+				for (auto distance = histogram_.size(); distance > 0; --distance)
+				{
+					suffix[distance - 1] = suffix[distance] + histogram_[distance - 1];
+				}
+
+				std::vector<double> result(points, 0);
+				for (std::size_t i = 0; i < points && rate_ > 0; ++i)
+				{
+					result[i] = suffix[std::min(first_miss(i * step), histogram_.size())] / rate_;
+				}
+				return result;
+			}
+
+			// decay halves the weight of the samples taken so far, so the curve follows recent accesses
+
+			inline void decay()
+			{
+				for (auto& count : histogram_)
+				{
+					count *= 0.5;
+				}
+				cold_ *= 0.5;
+				sampled_ *= 0.5;
+			}
+
+		private:
+
+			static inline std::uint64_t mix(std::uint64_t x)
+			{
+				x ^= x >> 30;
+				x *= 0xBF58476D1CE4E5B9ull;
+				x ^= x >> 27;
+				x *= 0x94D049BB133111EBull;
+				x ^= x >> 31;
+				return x;
+			}
+
+			// the smallest distance that a cache of the given size would miss
+
+			inline std::size_t first_miss(std::size_t size) const
+			{
+				return static_cast<std::size_t>(std::ceil(size * rate_));
+			}
+
+			inline void record(std::uint64_t key)
+			{
+				if (now_ + 1 == capacity_)
+				{
+					compact();
+				}
+				auto now = ++now_;
+
+				auto found = last_.find(key);
+				if (found != last_.end())
+				{
+					auto then = found->second;
+					histogram_[prefix(now - 1) - prefix(then)] += 1;
+					unmark(then);
+					found->second = now;
+				}
+				else
+				{
+					cold_ += 1;
+					if (last_.size() == max_keys_)
+					{
+						forget_oldest();
+					}
+					last_.emplace(key, now);
+				}
+
+				mark(now, key);
+				sampled_ += 1;
+			}
+
+			inline void forget_oldest()
+			{
+				while (!live_[oldest_])
+				{
+					++oldest_;
+				}
+				last_.erase(owner_[oldest_]);
+				unmark(oldest_);
+			}
+
+			// compact renumbers the live access times from one, in order
+
+			inline void compact()
+			{
+				std::size_t next = 0;
+				for (std::size_t time = 1; time <= now_; ++time)
+				{
+					if (live_[time])
+					{
+						owner_[++next] = owner_[time];
+						last_[owner_[next]] = static_cast<std::uint32_t>(next);
+					}
+				}
+
+				std::fill(live_.begin(), live_.end(), 0);
+				std::fill(live_.begin() + 1, live_.begin() + next + 1, 1);
+				std::fill(tree_.begin(), tree_.end(), 0);
+				for (std::size_t time = 1; time < capacity_; ++time)
+				{
+					tree_[time] += live_[time];
+					auto parent = time + (time & (~time + 1));
+					if (parent < capacity_)
+					{
+						tree_[parent] += tree_[time];
+					}
+				}
+				now_ = static_cast<std::uint32_t>(next);
+				oldest_ = 1;
+			}
+
+			inline void mark(std::size_t time, std::uint64_t key)
+			{
+				live_[time] = 1;
+				owner_[time] = key;
+				add(time, 1);
+			}
+
+			inline void unmark(std::size_t time)
+			{
+				live_[time] = 0;
+				add(time, -1);
+			}
+
+			inline void add(std::size_t time, std::int32_t delta)
+			{
+				for (; time < capacity_; time += time & (~time + 1))
+				{
+					tree_[time] += delta;
+				}
+			}
+
+			inline std::size_t prefix(std::size_t time) const
+			{
+				std::int32_t sum = 0;
+				for (; time > 0; time -= time & (~time + 1))
+				{
+					sum += tree_[time];
+				}
+				return static_cast<std::size_t>(sum);
+			}
+
+			std::uint64_t									threshold_;
+			double											rate_;
+			std::size_t										max_keys_;
+			std::size_t										capacity_;
+			std::uint32_t									now_;
+			std::size_t										oldest_;
+			std::vector<std::int32_t>						tree_;
+			std::vector<std::uint64_t>						owner_;
+			std::vector<std::uint8_t>						live_;
+			std::unordered_map<std::uint64_t, std::uint32_t>	last_;
+			std::vector<double>								histogram_;
+			double											cold_;
+			double											sampled_;
+		};
+	}
+
+	// mrc_stats is a statistics policy that counts like counting_stats, and also samples the
+	// cache's accesses to estimate its miss-ratio curve, for a cache_group. The sampler costs a
+	// hash mix and a comparison per get until a group configures it.
+
+	class mrc_stats
+	{
+	public:
+
+		class counters : public counting_stats::counters
+		{
+		public:
+
+			inline void hit(std::size_t hash)
+			{
+				counting_stats::counters::hit(hash);
+				sampler_.access(hash);
+			}
+
+			inline void miss(std::size_t hash)
+			{
+				counting_stats::counters::miss(hash);
+				sampler_.access(hash);
+			}
+
+			inline detail::shards_sampler& sampler()
+			{
+				return sampler_;
+			}
+
+			inline const detail::shards_sampler& sampler() const
+			{
+				return sampler_;
+			}
+
+		private:
+
+			detail::shards_sampler	sampler_;
+		};
+	};
+
+	// cache_group divides one budget of entries among several caches, which must use mrc_stats,
+	// so that it buys the most hits. Each call to rebalance (made periodically, for example from a
+	// timer) reads the caches' estimated miss-ratio curves, finds the division of the budget that
+	// minimizes the total of each cache's estimated misses times its miss cost, and moves each
+	// cache's limit toward its share by at most max_step. Shrinking caches are resized before
+	// growing ones, so the total of the limits never exceeds the budget. The samples are then
+	// decayed, so that the curves follow changes in the workload.
+	//
+	// Shares are found by dynamic programming over the budget divided into granularity units, so
+	// they are exact for curves with cliffs (where a cache gains nothing until its working set
+	// fits). The limits aren't changed unless the estimated gain is at least min_gain of the
+	// current weighted misses, so sampling noise doesn't move capacity back and forth.
+	//
+	// The caches must outlive the group, and the group must be used on the caches' executor.
+
+	class cache_group
+	{
+	public:
+
+		inline cache_group(std::size_t budget, std::size_t max_step = 0, std::size_t granularity = 64, std::size_t sampled_keys = 1024)
+		:
+		budget_{std::max<std::size_t>(budget, 1)},
+		max_step_{(max_step > 0) ? max_step : std::max<std::size_t>(budget_ / 16, 1)},
+		granularity_{std::min(std::max<std::size_t>(granularity, 1), budget_)},
+		sampled_keys_{sampled_keys},
+		min_gain_{0.01}
+		{}
+
+		cache_group(const cache_group& that) = delete;
+
+		cache_group& operator=(const cache_group& that) = delete;
+
+		// add makes cache a member of the group. miss_cost weights the cache's misses (for
+		// example, by the time a miss takes), and min_limit is the smallest share it is given.
+		// The cache keeps its current limit until the next rebalance.
+
+		template<class Cache>
+		void add(Cache& cache, double miss_cost = 1, std::size_t min_limit = 1)
+		{
+			auto& sampler = cache.stats().sampler();
+			sampler.configure(std::min(1.0, static_cast<double>(sampled_keys_) / budget_), sampled_keys_);
+
+			member m;
+			m.sampler_ = &sampler;
+			m.limit_ = [&cache] () { return cache.limit(); };
+			m.set_limit_ = [&cache] (std::size_t limit) { cache.set_limit(limit); };
+			m.miss_cost_ = miss_cost;
+			m.min_limit_ = std::max<std::size_t>(min_limit, 1);
+			m.target_ = cache.limit();
+			members_.push_back(std::move(m));
+		}
+
+		inline std::size_t budget() const
+		{
+			return budget_;
+		}
+
+		inline std::size_t size() const
+		{
+			return members_.size();
+		}
+
+		// target returns the share of the budget the last rebalance chose for the member added
+		// index-th (the cache's limit until the first rebalance)
+
+		inline std::size_t target(std::size_t index) const
+		{
+			return members_[index].target_;
+		}
+
+		inline void set_min_gain(double min_gain)
+		{
+			min_gain_ = min_gain;
+		}
+
+		// rebalance returns true if it changed any cache's limit
+
+		bool rebalance()
+		{
+			if (members_.empty())
+			{
+				return false;
+			}
+
+			auto unit = std::max<std::size_t>(budget_ / granularity_, 1);
+			auto units = budget_ / unit;
+			auto count = members_.size();
+
+			// weighted misses at each number of units, for each member
+
+			std::vector<std::vector<double>> costs(count);
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				costs[i] = members_[i].sampler_->curve(unit, units + 1);
+				for (auto& cost : costs[i])
+				{
+					cost *= members_[i].miss_cost_;
+				}
+			}
+
+			// best[g] is the least total cost of the members so far with g units among them, and
+			// choice[i][g] the units member i has in that division
+
+			static const double infinite = std::numeric_limits<double>::infinity();
+			std::vector<double> best(units + 1, infinite);
+			std::vector<double> next(units + 1);
+			std::vector<std::vector<std::size_t>> choice(count, std::vector<std::size_t>(units + 1, 0));
+
+			best[0] = 0;
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				auto min_units = (members_[i].min_limit_ + unit - 1) / unit;
+				std::fill(next.begin(), next.end(), infinite);
+				for (std::size_t g = 0; g <= units; ++g)
+				{
+					for (auto u = min_units; u <= g; ++u)
+					{
+						auto total = best[g - u] + costs[i][u];
+						if (total < next[g])
+						{
+							next[g] = total;
+							choice[i][g] = u;
+						}
+					}
+				}
+				best.swap(next);
+			}
+
+			if (best[units] == infinite)
+			{
+				// the members' minimum limits exceed the budget
+
+				return false;
+			}
+
+			std::vector<std::size_t> targets(count);
+			auto g = units;
+			for (auto i = count; i > 0; --i)
+			{
+				targets[i - 1] = choice[i - 1][g] * unit;
+				g -= choice[i - 1][g];
+			}
+
+			// what's left of the budget after whole units goes to the member that gains most from it
+
+			auto leftover = budget_ - units * unit;
+			if (leftover > 0)
+			{
+				std::size_t gainer = 0;
+				double most = -1;
+				for (std::size_t i = 0; i < count; ++i)
+				{
+					auto gain = weighted_misses(i, targets[i]) - weighted_misses(i, targets[i] + leftover);
+					if (gain > most)
+					{
+						most = gain;
+						gainer = i;
+					}
+				}
+				targets[gainer] += leftover;
+			}
+
+			double current = 0;
+			double proposed = 0;
+			std::vector<std::size_t> limits(count);
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				limits[i] = members_[i].limit_();
+				current += weighted_misses(i, limits[i]);
+				proposed += weighted_misses(i, targets[i]);
+			}
+
+			bool changed = false;
+			if (current - proposed > min_gain_ * current)
+			{
+				for (std::size_t i = 0; i < count; ++i)
+				{
+					members_[i].target_ = targets[i];
+				}
+				changed = resize(limits);
+			}
+
+			for (auto& m : members_)
+			{
+				m.sampler_->decay();
+			}
+
+			return changed;
+		}
+
+	private:
+
+		class member
+		{
+		public:
+			detail::shards_sampler*					sampler_;
+			std::function<std::size_t()>			limit_;
+			std::function<void(std::size_t)>		set_limit_;
+			double									miss_cost_;
+			std::size_t								min_limit_;
+			std::size_t								target_;
+		};
+
+		inline double weighted_misses(std::size_t index, std::size_t limit) const
+		{
+			return members_[index].miss_cost_ * members_[index].sampler_->misses(limit);
+		}
+
+		// resize moves each member's limit toward its target by at most max_step, shrinking first
+
+		inline bool resize(std::vector<std::size_t>& limits)
+		{
+			bool changed = false;
+			std::size_t total = 0;
+			for (std::size_t i = 0; i < members_.size(); ++i)
+			{
+				auto target = members_[i].target_;
+				if (limits[i] > target)
+				{
+					limits[i] -= std::min(max_step_, limits[i] - target);
+					members_[i].set_limit_(limits[i]);
+					changed = true;
+				}
+				total += limits[i];
+			}
+
+			for (std::size_t i = 0; i < members_.size() && total < budget_; ++i)
+			{
+				auto target = members_[i].target_;
+				if (limits[i] < target)
+				{
+					auto step = std::min(std::min(max_step_, target - limits[i]), budget_ - total);
+					limits[i] += step;
+					total += step;
+					members_[i].set_limit_(limits[i]);
+					changed = true;
+				}
+			}
+			return changed;
+		}
+
+		std::size_t				budget_;
+		std::size_t				max_step_;
+		std::size_t				granularity_;
+		std::size_t				sampled_keys_;
+		double					min_gain_;
+		std::vector<member>		members_;
+	};
+}
+
+#endif /* guard_utils_lru_cache_group_h */
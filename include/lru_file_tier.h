@@ -0,0 +1,778 @@
+/*
+MIT License
+
+Copyright © 2016 David Curtis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef guard_utils_lru_file_tier_h
+#define guard_utils_lru_file_tier_h
+
+#include "lru_cache.h"
+#include <string>
+#include <list>
+#include <limits>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace utils
+{
+	// file_tier is an optional second tier for lru_cache, holding values evicted from memory
+	// in a local, log-structured file (POSIX only). Evicted values are serialized and appended to the
+	// file, and indexed in memory; on a miss, the tier is checked (and the value read back) before the
+	// application's miss handler is invoked. The tier has its own usage order: when the file grows past
+	// the tier's capacity, it is compacted by copying the most recently used records into a new file,
+	// dropping the least recently used ones.
+	//
+	// The tier attaches to the cache through the cache's miss handler and removal listener:
+	//
+	//	file_tier<K, V> tier("/var/tmp/my_cache.tier", 1 << 30, serialize, deserialize);
+	//	lru_cache<K, V> cache(tier.miss_handler(remote_miss_handler), 10000);
+	//	tier.attach(cache);
+	//	tier.set_io_executor(io_post, cache_post);
+	//
+	// Values in memory may also be present in the tier, so a value that is read back and evicted again
+	// isn't rewritten; any other value evicted for a key in the tier (one written with the cache's own
+	// put, for example) replaces its record. Because the tier can hold keys that are not in memory,
+	// invalidation, flushing and writes should go through the tier's invalidate, flush and put, which
+	// forward to the cache.
+	//
+	// All of the tier's functions must be called on the cache's thread. If an I/O executor is supplied,
+	// reads and compaction are performed on it, and their results are posted back to the cache's
+	// executor. Without one, both run on the cache's thread: each read is a single pread, and compaction
+	// copies at most compaction_step() bytes per removal batch. In either case, new records go to the
+	// new file as soon as compaction starts, and records still being copied are read from the old one.
+	// The tier may be destroyed while reads or compaction are in progress on the I/O executor; their
+	// completions are then dropped (and the misses waiting on them are never answered), so the tier
+	// should be destroyed after the cache. The executors must outlive any tasks posted to them.
+	//
+	// basic_file_tier takes the cache's type as a parameter, so it can serve a cache with any
+	// policies (for example, gdsf_eviction or ttl_expiry); file_tier is the tier for a cache with the
+	// default policies. Each record keeps the deadline of the entry it was spilled from (see the
+	// cache's expiry policies), and a record past its deadline is dropped rather than served. A value
+	// read back from the tier starts a new life in the cache, like any value from a miss handler, but
+	// its record keeps the original deadline. Another component that needs the cache's removal
+	// listener can be chained after the tier's:
+	//
+	//	tier.attach(cache, replicator.removal_listener());
+
+	template <class Cache>
+	class basic_file_tier
+	{
+	public:
+
+		using cache_type = Cache;
+		using key_t = typename cache_type::key_t;
+		using value_t = typename cache_type::value_t;
+		using hash_t = typename cache_type::hash_t;
+		using key_equals_t = typename cache_type::key_equals_t;
+		using value_uptr_t = typename cache_type::value_uptr_t;
+		using miss_handler_f = typename cache_type::miss_handler_f;
+		using miss_handler_reply_f = typename cache_type::miss_handler_reply_f;
+		using removal_cause = typename cache_type::removal_cause;
+		using removal_batch_t = typename cache_type::removal_batch_t;
+		using removal_listener_f = typename cache_type::removal_listener_f;
+		using deadline_t = typename cache_type::deadline_t;
+		using post_f = typename cache_type::post_f;
+		using put_reply_f = typename cache_type::put_reply_f;
+
+		// serialize appends the representation of a value to out; deserialize reconstructs it
+		// (returning a null pointer if it can't)
+
+		using serialize_f = std::function< void (const value_t&, std::string& out) >;
+		using deserialize_f = std::function< value_uptr_t (const char* data, std::size_t size) >;
+
+	protected:
+
+		// A segment is one generation of the tier's file. Reads in progress hold a reference to their
+		// segment, so compaction can replace the file without disturbing them.
+
+		class segment
+		{
+		public:
+
+			inline segment(const std::string& path)
+			:
+			fd_{::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600)},
+			size_{0}
+			{}
+
+			inline ~segment()
+			{
+				if (fd_ >= 0)
+				{
+					::close(fd_);
+				}
+			}
+
+			segment(const segment& that) = delete;
+
+			segment& operator=(const segment& that) = delete;
+
+			inline bool append(const std::string& data)
+			{
+				if (!write(size_, data))
+				{
+					return false;
+				}
+				size_ += data.size();
+				return true;
+			}
+
+			// write doesn't change size_, so compaction can fill space reserved at the front of the
+			// file on another thread while records are appended after it
+
+			inline bool write(std::uint64_t offset, const std::string& data) const
+			{
+				std::size_t written = 0;
+				while (written < data.size())
+				{
+					auto result = ::pwrite(fd_, data.data() + written, data.size() - written, static_cast<off_t>(offset + written));
+					if (result < 0)
+					{
+						if (errno == EINTR)
+						{
+							continue;
+						}
+						return false;
+					}
+					written += static_cast<std::size_t>(result);
+				}
+				return true;
+			}
+
+			inline bool read(std::uint64_t offset, std::size_t length, std::string& data) const
+			{
+				data.resize(length);
+				std::size_t done = 0;
+				while (done < length)
+				{
+					auto result = ::pread(fd_, &data[done], length - done, static_cast<off_t>(offset + done));
+					if (result < 0 && errno == EINTR)
+					{
+						continue;
+					}
+					if (result <= 0)
+					{
+						return false;
+					}
+					done += static_cast<std::size_t>(result);
+				}
+				return true;
+			}
+
+			int					fd_;
+			std::uint64_t		size_;
+		};
+
+		using segment_ptr = std::shared_ptr<segment>;
+
+		class record;
+
+		using index_t = std::unordered_map<key_t, record, hash_t, key_equals_t>;
+		using index_entry = typename index_t::value_type;
+		using usage_list_t = std::list<index_entry*>;
+
+		// a record that is moving is still in the old file, at offset_, while compaction copies it.
+		// A record is loaded when the value in the cache is the one the tier served from it.
+		// deadline_ is when the value it was spilled from would have expired in the cache.
+
+		class record
+		{
+		public:
+			std::uint64_t					offset_;
+			std::size_t						length_;
+			typename usage_list_t::iterator	usage_;
+			bool							moving_;
+			bool							loaded_;
+			deadline_t						deadline_;
+		};
+
+		// a relocation copies one record from the old file to its place in the new one
+
+		class relocation
+		{
+		public:
+			key_t				key_;
+			std::uint64_t		from_;
+			std::uint64_t		to_;
+			std::size_t			length_;
+		};
+
+		using relocation_list_t = std::vector<relocation>;
+		using relocation_list_ptr = std::shared_ptr<relocation_list_t>;
+		using alive_ptr = std::shared_ptr<bool>;
+
+		// io_context is what tasks posted to the I/O executor need from the tier, so that they
+		// don't touch the tier itself until their completions are back on the cache's executor.
+		// alive_ is cleared when the tier is destroyed, and completions that arrive after that
+		// are dropped.
+
+		class io_context
+		{
+		public:
+			post_f				io_;
+			post_f				owner_;
+			deserialize_f		deserialize_;
+			alive_ptr			alive_;
+		};
+
+		using io_context_ptr = std::shared_ptr<io_context>;
+
+	public:
+
+		inline basic_file_tier(const std::string& path, std::uint64_t capacity, serialize_f serialize, deserialize_f deserialize)
+		:
+		path_{path},
+		capacity_{capacity},
+		serialize_{std::move(serialize)},
+		deserialize_{std::move(deserialize)},
+		segment_{std::make_shared<segment>(path)},
+		live_bytes_{0},
+		hits_{0},
+		misses_{0},
+		cache_{nullptr},
+		relocated_{0},
+		in_background_{false},
+		compaction_step_{1 << 20},
+		alive_{std::make_shared<bool>(true)}
+		{}
+
+		// reads and compaction still in progress on the I/O executor finish with the files they
+		// hold, and their completions, when they reach the cache's executor, are dropped
+
+		inline ~basic_file_tier()
+		{
+			*alive_ = false;
+			::unlink(path_.c_str());
+		}
+
+		basic_file_tier(const basic_file_tier& that) = delete;
+
+		basic_file_tier& operator=(const basic_file_tier& that) = delete;
+
+		inline bool is_open() const
+		{
+			return segment_->fd_ >= 0;
+		}
+
+		// set_io_executor has reads and compaction performed on io (for example, a thread pool),
+		// with completions posted back to owner (the cache's executor)
+
+		inline void set_io_executor(post_f io, post_f owner)
+		{
+			io_ = std::make_shared<io_context>(io_context{std::move(io), std::move(owner), deserialize_, alive_});
+		}
+
+		// miss_handler returns a miss handler for the cache that checks the tier first,
+		// and invokes next if the key isn't in the tier (or can't be read)
+
+		inline miss_handler_f miss_handler(miss_handler_f next)
+		{
+			return [this, next] (const key_t& key, miss_handler_reply_f reply)
+			{
+				fetch(key, next, std::move(reply));
+			};
+		}
+
+		// attach installs the tier's removal listener in the cache. Removals are passed on to next,
+		// if supplied, after the tier has spilled the evicted values (values the tier doesn't need are
+		// left in the batch).
+
+		inline void attach(cache_type& cache, removal_listener_f next = removal_listener_f{})
+		{
+			cache_ = &cache;
+			cache.set_removal_listener(removal_listener(std::move(next)));
+		}
+
+		// removal_listener returns the tier's removal listener, without installing it. The tier's
+		// invalidate, flush and put forward to the cache only once it is attached, so a tier that
+		// shares the cache with another component should be the one attached, with the other's
+		// listener as next.
+
+		inline removal_listener_f removal_listener(removal_listener_f next = removal_listener_f{})
+		{
+			return [this, next] (removal_batch_t& batch)
+			{
+				on_removals(batch);
+				if (next)
+				{
+					next(batch);
+				}
+			};
+		}
+
+		inline void invalidate(const key_t& key)
+		{
+			erase(key);
+			if (cache_)
+			{
+				cache_->invalidate(key);
+			}
+		}
+
+		inline void flush()
+		{
+			clear();
+			if (cache_)
+			{
+				cache_->flush();
+			}
+		}
+
+		inline void put(const key_t& key, value_uptr_t value, put_reply_f reply = put_reply_f{})
+		{
+			erase(key);
+			if (cache_)
+			{
+				cache_->put(key, std::move(value), std::move(reply));
+			}
+		}
+
+		inline bool contains(const key_t& key) const
+		{
+			return index_.find(key) != index_.end();
+		}
+
+		inline std::size_t size() const
+		{
+			return index_.size();
+		}
+
+		inline std::uint64_t file_bytes() const
+		{
+			return segment_->size_;
+		}
+
+		inline std::uint64_t live_bytes() const
+		{
+			return live_bytes_;
+		}
+
+		inline std::uint64_t capacity() const
+		{
+			return capacity_;
+		}
+
+		// set_compaction_step sets the number of bytes compaction copies per removal batch when
+		// there is no I/O executor
+
+		inline void set_compaction_step(std::size_t bytes)
+		{
+			compaction_step_ = (bytes > 0) ? bytes : 1;
+		}
+
+		inline std::size_t compaction_step() const
+		{
+			return compaction_step_;
+		}
+
+		inline bool compacting() const
+		{
+			return relocating_ != nullptr;
+		}
+
+		inline std::size_t hits() const
+		{
+			return hits_;
+		}
+
+		inline std::size_t misses() const
+		{
+			return misses_;
+		}
+
+	protected:
+
+		void fetch(const key_t& key, const miss_handler_f& next, miss_handler_reply_f reply)
+		{
+			auto found = index_.find(key);
+			if (found == index_.end())
+			{
+				++misses_;
+				next(key, std::move(reply));
+				return;
+			}
+
+			if (found->second.deadline_.passed())
+			{
+				// the value has expired, so it mustn't come back to the cache
+
+				erase(key);
+				++misses_;
+				next(key, std::move(reply));
+				return;
+			}
+
+			touch(found->second);
+
+			auto seg = found->second.moving_ ? retiring_ : segment_;
+			auto offset = found->second.offset_;
+			auto length = found->second.length_;
+
+			if (!io_)
+			{
+				std::string data;
+				value_uptr_t value{seg->read(offset, length, data) ? deserialize_(data.data(), data.size()) : nullptr};
+				complete_fetch(key, next, std::move(reply), std::move(value));
+			}
+			else
+			{
+				auto io = io_;
+				io->io_([this, io, key, next, reply, seg, offset, length] ()
+				{
+					// runs on the I/O executor; the deserialized value is held by a shared_ptr
+					// because std::function requires a copyable target
+
+					std::string data;
+					auto value = std::make_shared<value_uptr_t>(seg->read(offset, length, data) ? io->deserialize_(data.data(), data.size()) : nullptr);
+					io->owner_([this, io, key, next, reply, value] ()
+					{
+						if (*io->alive_)
+						{
+							complete_fetch(key, next, reply, std::move(*value));
+						}
+					});
+				});
+			}
+		}
+
+		inline void complete_fetch(const key_t& key, const miss_handler_f& next, miss_handler_reply_f reply, value_uptr_t value)
+		{
+			if (value)
+			{
+				++hits_;
+				auto found = index_.find(key);
+				if (found != index_.end())
+				{
+					found->second.loaded_ = true;
+				}
+				reply(std::move(value), std::error_code());
+			}
+			else
+			{
+				// the record couldn't be read, so it's dropped, and the application's handler is asked
+
+				erase(key);
+				++misses_;
+				next(key, std::move(reply));
+			}
+		}
+
+		void on_removals(removal_batch_t& batch)
+		{
+			std::string buffer;
+			std::vector<index_entry*> appended;
+			bool flushed = false;
+
+			for (auto& removed : batch)
+			{
+				switch (removed.cause())
+				{
+					case removal_cause::size:
+					{
+						if (!removed.value())
+						{
+							break;
+						}
+						if (removed.deadline().passed())
+						{
+							erase(removed.key());
+							break;
+						}
+
+						auto found = index_.find(removed.key());
+						if (found != index_.end() && found->second.loaded_)
+						{
+							// already in the tier (it was read back from it), so it needn't be rewritten
+
+							found->second.loaded_ = false;
+							touch(found->second);
+						}
+						else
+						{
+							// a value the tier didn't serve (written with the cache's put, for example)
+							// supersedes the record
+
+							if (found != index_.end())
+							{
+								erase(removed.key());
+							}
+
+							auto start = buffer.size();
+							serialize_(*removed.value(), buffer);
+							auto emplaced = index_.emplace(removed.key(), record{segment_->size_ + start, buffer.size() - start, usage_.end(), false, false, removed.deadline()});
+							auto entry = &(*emplaced.first);
+							entry->second.usage_ = usage_.insert(usage_.begin(), entry);
+							live_bytes_ += entry->second.length_;
+							appended.push_back(entry);
+						}
+						break;
+					}
+					case removal_cause::flushed:
+						flushed = true;
+						break;
+					default:
+						erase(removed.key());
+						break;
+				}
+			}
+
+			if (flushed)
+			{
+				clear();
+			}
+			else if (!buffer.empty())
+			{
+				if (!segment_->append(buffer))
+				{
+					// the records never made it to the file
+
+					for (auto entry : appended)
+					{
+						erase(entry->first);
+					}
+				}
+
+				if (segment_->size_ > capacity_ && !relocating_)
+				{
+					compact();
+					return;
+				}
+			}
+
+			if (relocating_ && !in_background_)
+			{
+				relocate_step();
+			}
+		}
+
+		// compact keeps the most recently used records, up to about three quarters of the tier's
+		// capacity, and drops the rest. The kept records are assigned places at the front of a new
+		// file, which receives appends from then on; they are copied there on the I/O executor, or a
+		// step at a time on the cache's thread, and read from the old file until they arrive.
+
+		void compact()
+		{
+			const std::uint64_t target = capacity_ - capacity_ / 4;
+			auto plan = std::make_shared<relocation_list_t>();
+			std::uint64_t size = 0;
+
+			auto it = usage_.begin();
+			while (it != usage_.end())
+			{
+				record& rec = (*it)->second;
+				if (size + rec.length_ > target || rec.deadline_.passed())
+				{
+					auto dropped = it++;
+					live_bytes_ -= (*dropped)->second.length_;
+					index_.erase((*dropped)->first);
+					usage_.erase(dropped);
+					continue;
+				}
+
+				plan->push_back(relocation{(*it)->first, rec.offset_, size, rec.length_});
+				rec.moving_ = true;
+				size += rec.length_;
+				++it;
+			}
+
+			// the old file is unlinked rather than renamed over, since it is read until the copy is done
+
+			::unlink(path_.c_str());
+			auto fresh = std::make_shared<segment>(path_);
+			if (fresh->fd_ < 0)
+			{
+				clear();
+				return;
+			}
+
+			fresh->size_ = size;
+			retiring_ = segment_;
+			segment_ = fresh;
+			relocating_ = plan;
+			relocated_ = 0;
+			in_background_ = (io_ != nullptr);
+
+			if (in_background_)
+			{
+				auto from = retiring_;
+				auto io = io_;
+				io->io_([this, io, plan, from, fresh] ()
+				{
+					// runs on the I/O executor, touching nothing but the plan and the two files
+
+					auto last = relocate(*plan, 0, std::numeric_limits<std::uint64_t>::max(), *from, *fresh);
+					io->owner_([this, io, plan, last] ()
+					{
+						if (*io->alive_)
+						{
+							relocated(plan, last);
+						}
+					});
+				});
+			}
+			else
+			{
+				relocate_step();
+			}
+		}
+
+		inline void relocate_step()
+		{
+			auto plan = relocating_;
+			auto last = relocate(*plan, relocated_, compaction_step_, *retiring_, *segment_);
+			relocated(plan, last);
+		}
+
+		// relocate copies records from first on until about budget bytes have been copied, returning
+		// the index of the first record not copied, or npos if a read or write failed. The records'
+		// places in the new file are consecutive, so they are written a chunk at a time.
+
+		static std::size_t relocate(const relocation_list_t& plan, std::size_t first, std::uint64_t budget, const segment& from, const segment& to)
+		{
+			const std::size_t chunk_size = 1 << 20;
+			std::string buffer;
+			std::string data;
+			std::uint64_t copied = 0;
+			std::size_t next = first;
+			std::size_t chunk = first;
+
+			while (next < plan.size() && copied < budget)
+			{
+				if (!from.read(plan[next].from_, plan[next].length_, data))
+				{
+					return std::string::npos;
+				}
+				buffer.append(data);
+				copied += data.size();
+				++next;
+
+				if (buffer.size() >= chunk_size || next == plan.size() || copied >= budget)
+				{
+					if (!to.write(plan[chunk].to_, buffer))
+					{
+						return std::string::npos;
+					}
+					buffer.clear();
+					chunk = next;
+				}
+			}
+			return next;
+		}
+
+		// relocated moves the records copied so far to the new file, and ends the compaction when
+		// they all have been. If the copy failed, the records that didn't make it are dropped.
+		// Records removed or replaced while the copy was in progress are no longer moving, and are
+		// left alone.
+
+		void relocated(const relocation_list_ptr& plan, std::size_t last)
+		{
+			if (plan != relocating_)
+			{
+				// the tier was cleared while the copy was in progress
+
+				return;
+			}
+
+			bool failed = (last == std::string::npos);
+			std::size_t end = failed ? plan->size() : last;
+			for (std::size_t i = relocated_; i < end; ++i)
+			{
+				auto found = index_.find((*plan)[i].key_);
+				if (found != index_.end() && found->second.moving_)
+				{
+					if (failed)
+					{
+						erase(found->first);
+					}
+					else
+					{
+						found->second.offset_ = (*plan)[i].to_;
+						found->second.moving_ = false;
+					}
+				}
+			}
+
+			relocated_ = end;
+			if (relocated_ == plan->size())
+			{
+				relocating_.reset();
+				retiring_.reset();
+			}
+		}
+
+		inline void touch(record& rec)
+		{
+			usage_.splice(usage_.begin(), usage_, rec.usage_);
+		}
+
+		inline void erase(const key_t& key)
+		{
+			auto found = index_.find(key);
+			if (found != index_.end())
+			{
+				live_bytes_ -= found->second.length_;
+				usage_.erase(found->second.usage_);
+				index_.erase(found);
+			}
+		}
+
+		inline void clear()
+		{
+			index_.clear();
+			usage_.clear();
+			live_bytes_ = 0;
+			relocating_.reset();
+			retiring_.reset();
+
+			// unlink rather than truncate the file, since reads in progress may still be using it
+
+			::unlink(path_.c_str());
+			segment_ = std::make_shared<segment>(path_);
+		}
+
+		std::string			path_;
+		std::uint64_t		capacity_;
+		serialize_f			serialize_;
+		deserialize_f		deserialize_;
+		segment_ptr			segment_;
+		index_t				index_;
+		usage_list_t		usage_;
+		std::uint64_t		live_bytes_;
+		std::size_t			hits_;
+		std::size_t			misses_;
+		cache_type*			cache_;
+		io_context_ptr		io_;
+		segment_ptr			retiring_;
+		relocation_list_ptr	relocating_;
+		std::size_t			relocated_;
+		bool				in_background_;
+		std::size_t			compaction_step_;
+		alive_ptr			alive_;
+	};
+
+	template <class Key, class T, class Hash = std::hash<Key>, class KeyEquals = std::equal_to<Key>>
+	using file_tier = basic_file_tier<lru_cache<Key, T, Hash, KeyEquals>>;
+}
+
+#endif /* guard_utils_lru_file_tier_h */
@@ -0,0 +1,501 @@
+/*
+MIT License
+
+Copyright © 2016 David Curtis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef guard_utils_lru_hot_keys_h
+#define guard_utils_lru_hot_keys_h
+
+#include "lru_cache.h"
+#include <atomic>
+#include <limits>
+
+namespace utils
+{
+	namespace detail
+	{
+		// frequency_sketch is a count-min sketch: four rows of saturating 16-bit counters, indexed by
+		// independent mixes of a key's hash. An estimate is the minimum of the key's four counters, so
+		// it can overestimate (when the key shares all four with more popular keys), but never
+		// underestimates. Increments are conservative (only the counters at the minimum are
+		// incremented), which reduces the overestimate. After every 10 * width increments, all
+		// of the counters are halved, so the estimates follow recent popularity.
+
+		class frequency_sketch
+		{
+		public:
+
+			static const unsigned rows = 4;
+
+			inline frequency_sketch(std::size_t width)
+			:
+			bits_{4},
+			increments_{0}
+			{
+				while ((std::size_t{1} << bits_) < width)
+				{
+					++bits_;
+				}
+				counters_.resize(rows << bits_, 0);
+				sample_size_ = 10 * (std::size_t{1} << bits_);
+			}
+
+			inline std::uint32_t estimate(std::size_t hash) const
+			{
+				std::uint32_t result = std::numeric_limits<std::uint16_t>::max();
+				for (unsigned row = 0; row < rows; ++row)
+				{
+					result = std::min<std::uint32_t>(result, counters_[index(hash, row)]);
+				}
+				return result;
+			}
+
+			// increment returns the key's new estimate
+
+			inline std::uint32_t increment(std::size_t hash)
+			{
+				auto current = estimate(hash);
+				if (current < std::numeric_limits<std::uint16_t>::max())
+				{
+					for (unsigned row = 0; row < rows; ++row)
+					{
+						auto& counter = counters_[index(hash, row)];
+						if (counter == current)
+						{
+							++counter;
+						}
+					}
+					++current;
+				}
+				if (++increments_ == sample_size_)
+				{
+					age();
+				}
+				return current;
+			}
+
+			inline void clear()
+			{
+				std::fill(counters_.begin(), counters_.end(), 0);
+				increments_ = 0;
+			}
+
+		private:
+
+			inline std::size_t index(std::size_t hash, unsigned row) const
+			{
+				static const std::uint64_t seeds[rows] = {0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull};
+				auto mixed = (static_cast<std::uint64_t>(hash) ^ (seeds[row] >> row)) * seeds[row];
+				return (static_cast<std::size_t>(row) << bits_) | static_cast<std::size_t>(mixed >> (64 - bits_));
+			}
+
+			inline void age()
+			{
+				for (auto& counter : counters_)
+				{
+					counter >>= 1;
+				}
+				increments_ = 0;
+			}
+
+			unsigned					bits_;
+			std::size_t					increments_;
+			std::size_t					sample_size_;
+			std::vector<std::uint16_t>	counters_;
+		};
+	}
+
+	// hot_key_replicator serves the most popular keys of a cache that is shared by several threads
+	// without sending their requests to the cache's executor. Requests from other threads are made
+	// through a reader, one per thread. A reader checks its own read-only replica of the hot keys
+	// before posting the request to the cache's executor, and replies immediately, on its own
+	// thread, if the key is there.
+	//
+	// On the cache's executor, every successful lookup made through a reader is counted in a
+	// frequency sketch. When a key's estimated frequency reaches the threshold, its value is copied
+	// (with the replicate function, which by default uses the value's copy constructor) into a new, immutable
+	// replica set, which is published by incrementing the replicator's epoch. Readers compare the
+	// epoch with the epoch of their replica set on each lookup, and pick up the new set when it
+	// changes, so the hot path touches no shared state other than the (rarely written) epoch.
+	//
+	// A replicated value is withdrawn, and a new set published, when its entry leaves the cache
+	// for any reason (the replicator is the cache's removal listener), so invalidate(), flush() and
+	// put() reach every reader before they return. Replica hits don't reach the cache, so each reader
+	// refreshes the cache entry of one of every touch_interval keys it serves (sampled in proportion
+	// to their popularity), keeping hot entries at the head of the usage order.
+	//
+	// The replicator must be constructed, attached, and used (apart from its readers) on the cache's
+	// executor, and it must outlive its readers and any tasks they have posted.
+	//
+	//	hot_key_replicator<K, V> replicator(cache, [&loop] (task_f task) { loop.post(std::move(task)); });
+	//	replicator.attach();
+	//
+	//	// on each worker thread
+	//	hot_key_replicator<K, V>::reader reader(replicator, [&worker] (task_f task) { worker.post(std::move(task)); });
+	//	reader.get(key, [] (const V* value, std::error_code err) { return extract(value); }, [] (result r) { ... });
+	//
+	// basic_hot_key_replicator takes the cache's type as a parameter, so it can serve a cache with
+	// any policies; hot_key_replicator is the replicator for a cache with the default policies. Its
+	// removal_listener can be chained after another component's listener, instead of attaching it.
+	// With an expiry policy, each replica carries its entry's deadline, and a reader that finds a
+	// replica past its deadline sends the request to the cache, which removes the expired entry
+	// (withdrawing the replica) and treats the request as a miss.
+
+	template <class Cache>
+	class basic_hot_key_replicator
+	{
+	public:
+
+		using cache_type = Cache;
+		using key_t = typename cache_type::key_t;
+		using value_t = typename cache_type::value_t;
+		using hash_t = typename cache_type::hash_t;
+		using key_equals_t = typename cache_type::key_equals_t;
+		using const_iterator = typename cache_type::const_iterator;
+		using task_f = typename cache_type::task_f;
+		using post_f = typename cache_type::post_f;
+		using removal_cause = typename cache_type::removal_cause;
+		using removal_batch_t = typename cache_type::removal_batch_t;
+		using removal_listener_f = typename cache_type::removal_listener_f;
+		using value_ptr_t = std::shared_ptr<const value_t>;
+		using replicate_f = std::function< value_ptr_t (const value_t&) >;
+		using deadline_t = typename cache_type::deadline_t;
+
+		static const std::size_t touch_interval = 64;
+
+	protected:
+
+		// a replica carries its cache entry's deadline, so that readers stop serving it when the
+		// entry expires, without waiting for the cache to notice
+
+		class replica
+		{
+		public:
+			value_ptr_t		value_;
+			deadline_t		deadline_;
+		};
+
+		using replica_map_t = std::unordered_map<key_t, replica, hash_t, key_equals_t>;
+
+		class replica_set
+		{
+		public:
+			std::uint64_t	epoch_;
+			replica_map_t	values_;
+		};
+
+		using replica_set_ptr = std::shared_ptr<const replica_set>;
+
+	public:
+
+		class reader
+		{
+		public:
+
+			inline reader(basic_hot_key_replicator& replicator, post_f origin)
+			:
+			replicator_{replicator},
+			origin_{std::move(origin)},
+			replicas_{replicator.published()},
+			epoch_{replicas_->epoch_},
+			since_touch_{0},
+			hits_{0},
+			misses_{0}
+			{}
+
+			reader(const reader& that) = delete;
+
+			reader& operator=(const reader& that) = delete;
+
+			// get invokes extract(value, err), with a pointer to the value (null if there is no value),
+			// and passes its result to reply. If the key is replicated, both are invoked immediately,
+			// on the calling thread; otherwise, extract is invoked on the cache's executor (as with the
+			// cache's own cross-executor get), and reply on the reader's origin executor.
+
+			template<class Extract, class Reply>
+			void get(const key_t& key, Extract extract, Reply reply)
+			{
+				auto value = find(key);
+				if (value)
+				{
+					++hits_;
+					if (++since_touch_ == touch_interval)
+					{
+						since_touch_ = 0;
+						replicator_.post_touch(key);
+					}
+					reply(extract(value, std::error_code()));
+				}
+				else
+				{
+					++misses_;
+					replicator_.post_lookup(key, origin_, std::move(extract), std::move(reply));
+				}
+			}
+
+			// find returns the reader's replica of the key's value, or null if the key isn't replicated
+			// (or its replica has expired). The pointer is valid until the reader's next call to get or find.
+
+			inline const value_t* find(const key_t& key)
+			{
+				refresh();
+				auto it = replicas_->values_.find(key);
+				if (it == replicas_->values_.end() || it->second.deadline_.passed())
+				{
+					return nullptr;
+				}
+				return it->second.value_.get();
+			}
+
+			inline std::size_t hits() const
+			{
+				return hits_;
+			}
+
+			inline std::size_t misses() const
+			{
+				return misses_;
+			}
+
+		private:
+
+			inline void refresh()
+			{
+				if (replicator_.epoch_.load(std::memory_order_acquire) != epoch_)
+				{
+					replicas_ = replicator_.published();
+					epoch_ = replicas_->epoch_;
+				}
+			}
+
+			basic_hot_key_replicator&		replicator_;
+			post_f					origin_;
+			replica_set_ptr			replicas_;
+			std::uint64_t			epoch_;
+			std::size_t				since_touch_;
+			std::size_t				hits_;
+			std::size_t				misses_;
+		};
+
+		inline basic_hot_key_replicator(cache_type& cache, post_f cache_executor, replicate_f replicate = copy_value,
+			std::size_t max_hot_keys = 64, std::uint32_t threshold = 16, std::size_t sketch_width = 4096)
+		:
+		cache_{cache},
+		cache_executor_{std::move(cache_executor)},
+		replicate_{std::move(replicate)},
+		max_hot_keys_{max_hot_keys},
+		threshold_{threshold},
+		sketch_{sketch_width},
+		current_{std::make_shared<replica_set>()},
+		published_{current_},
+		epoch_{0},
+		promotions_{0}
+		{}
+
+		basic_hot_key_replicator(const basic_hot_key_replicator& that) = delete;
+
+		basic_hot_key_replicator& operator=(const basic_hot_key_replicator& that) = delete;
+
+		// attach installs the replicator's removal listener in the cache. Removals are passed on to next,
+		// if supplied.
+
+		inline void attach(removal_listener_f next = removal_listener_f{})
+		{
+			cache_.set_removal_listener(removal_listener(std::move(next)));
+		}
+
+		// removal_listener returns the replicator's removal listener, without installing it, so that it
+		// can be chained after another listener (such as a file tier's)
+
+		inline removal_listener_f removal_listener(removal_listener_f next = removal_listener_f{})
+		{
+			return [this, next] (removal_batch_t& batch)
+			{
+				on_removals(batch);
+				if (next)
+				{
+					next(batch);
+				}
+			};
+		}
+
+		// epoch is incremented each time a new replica set is published; it may be read on any thread
+
+		inline std::uint64_t epoch() const
+		{
+			return epoch_.load(std::memory_order_acquire);
+		}
+
+		inline bool is_hot(const key_t& key) const
+		{
+			return current_->values_.find(key) != current_->values_.end();
+		}
+
+		inline std::size_t hot_count() const
+		{
+			return current_->values_.size();
+		}
+
+		inline std::size_t promotions() const
+		{
+			return promotions_;
+		}
+
+		static value_ptr_t copy_value(const value_t& value)
+		{
+			return std::make_shared<value_t>(value);
+		}
+
+	protected:
+
+		inline replica_set_ptr published() const
+		{
+			std::lock_guard<std::mutex> lock{published_mutex_};
+			return published_;
+		}
+
+		template<class Extract, class Reply>
+		void post_lookup(const key_t& key, post_f origin, Extract extract, Reply reply)
+		{
+			cache_executor_([this, key, origin, extract, reply] () mutable
+			{
+				cache_.get(key, std::move(origin), [this, key, extract] (const_iterator iter, std::error_code err) mutable
+				{
+					const value_t* value = (err || iter == cache_.cend()) ? nullptr : &*iter;
+					if (value)
+					{
+						record(key, iter);
+					}
+					return extract(value, err);
+				},
+				std::move(reply));
+			});
+		}
+
+		inline void post_touch(const key_t& key)
+		{
+			cache_executor_([this, key] ()
+			{
+				cache_.get(key, [this, key] (const_iterator iter, std::error_code err)
+				{
+					if (!err && iter != cache_.cend())
+					{
+						record(key, iter);
+					}
+				});
+			});
+		}
+
+		inline void record(const key_t& key, const_iterator iter)
+		{
+			auto hash = cache_.hash(key);
+			auto estimate = sketch_.increment(hash);
+			if (estimate < threshold_ || max_hot_keys_ == 0 || is_hot(key))
+			{
+				return;
+			}
+			
+			replica_map_t values{current_->values_};
+			if (values.size() >= max_hot_keys_)
+			{
+				// replace the coldest replicated key, if it's colder than this one
+				
+				auto coldest = values.end();
+				std::uint32_t coldest_estimate = estimate;
+				for (auto it = values.begin(); it != values.end(); ++it)
+				{
+					auto other = sketch_.estimate(cache_.hash(it->first));
+					if (other < coldest_estimate)
+					{
+						coldest = it;
+						coldest_estimate = other;
+					}
+				}
+				if (coldest == values.end())
+				{
+					return;
+				}
+				values.erase(coldest);
+			}
+			
+			values.emplace(key, replica{replicate_(*iter), cache_.deadline(iter)});
+			++promotions_;
+			publish(std::move(values));
+		}
+
+		inline void on_removals(removal_batch_t& batch)
+		{
+			if (current_->values_.empty())
+			{
+				return;
+			}
+			
+			replica_map_t values{current_->values_};
+			bool changed = false;
+			for (auto& removed : batch)
+			{
+				if (removed.cause() == removal_cause::flushed)
+				{
+					values.clear();
+					changed = true;
+					break;
+				}
+				changed = values.erase(removed.key()) > 0 || changed;
+			}
+			
+			if (changed)
+			{
+				publish(std::move(values));
+			}
+		}
+
+		inline void publish(replica_map_t values)
+		{
+			auto replicas = std::make_shared<replica_set>();
+			replicas->epoch_ = current_->epoch_ + 1;
+			replicas->values_ = std::move(values);
+			{
+				std::lock_guard<std::mutex> lock{published_mutex_};
+				published_ = replicas;
+			}
+			current_ = replicas;
+			epoch_.store(replicas->epoch_, std::memory_order_release);
+		}
+
+		cache_type&						cache_;
+		post_f							cache_executor_;
+		replicate_f						replicate_;
+		std::size_t						max_hot_keys_;
+		std::uint32_t					threshold_;
+		detail::frequency_sketch		sketch_;
+		replica_set_ptr					current_;
+		mutable std::mutex				published_mutex_;
+		replica_set_ptr					published_;
+		std::atomic<std::uint64_t>		epoch_;
+		std::size_t						promotions_;
+	};
+
+	template <class Key, class T, class Hash = std::hash<Key>, class KeyEquals = std::equal_to<Key>>
+	using hot_key_replicator = basic_hot_key_replicator<lru_cache<Key, T, Hash, KeyEquals>>;
+}
+
+#endif /* guard_utils_lru_hot_keys_h */
@@ -0,0 +1,198 @@
+/*
+MIT License
+
+Copyright © 2016 David Curtis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef guard_utils_lru_inflight_group_h
+#define guard_utils_lru_inflight_group_h
+
+#include "lru_cache.h"
+
+namespace utils
+{
+	// inflight_group collapses concurrent fetches of the same upstream object, across any number of
+	// caches. Each cache coalesces concurrent misses for its own keys; when several caches (typically
+	// with different value types) are populated from the same upstream objects, each of them would
+	// still fetch the object once. Caches built with miss handlers from the same group share its
+	// fetches instead: a miss maps the cache's key to an upstream key, and if a fetch for that upstream
+	// key is already in flight, the miss waits for it rather than starting another. When the fetch
+	// completes, the upstream object is passed to each waiting miss's converter, which makes the value
+	// for its cache.
+	//
+	//	inflight_group<std::string, user_record> group(fetch_user_record);
+	//	lru_cache<std::string, profile> profiles(group.miss_handler<lru_cache<std::string, profile>>(user_id_of, make_profile), 1000);
+	//	lru_cache<std::string, avatar> avatars(group.miss_handler<lru_cache<std::string, avatar>>(user_id_of, make_avatar), 1000);
+	//
+	// Only fetches that are in flight are shared; the group keeps nothing once a fetch completes.
+	// Like the cache, the group must be used from a single executor. If the fetch function's reply
+	// may be invoked on some other thread, give the group its executor with set_executor.
+
+	template <class UpstreamKey, class Upstream, class Hash = std::hash<UpstreamKey>, class KeyEquals = std::equal_to<UpstreamKey>>
+	class inflight_group
+	{
+	public:
+
+		using upstream_uptr_t = std::unique_ptr<Upstream>;
+		using upstream_ptr_t = std::shared_ptr<const Upstream>;
+		using fetch_reply_f = std::function< void (upstream_uptr_t, std::error_code) >;
+		using fetch_f = std::function< void (const UpstreamKey&, fetch_reply_f) >;
+		using waiter_f = std::function< void (const upstream_ptr_t&, std::error_code) >;
+		using task_f = std::function< void () >;
+		using post_f = std::function< void (task_f) >;
+
+	protected:
+
+		using waiter_list_t = std::vector<waiter_f>;
+		using inflight_map_t = std::unordered_map<UpstreamKey, waiter_list_t, Hash, KeyEquals>;
+
+	public:
+
+		inline inflight_group(fetch_f fetch)
+		:
+		fetch_{std::move(fetch)},
+		fetches_{0},
+		collapsed_{0}
+		{}
+
+		inflight_group(const inflight_group& that) = delete;
+
+		inflight_group& operator=(const inflight_group& that) = delete;
+
+		inline void set_executor(post_f post)
+		{
+			executor_ = std::move(post);
+		}
+
+		// fetch invokes waiter with the upstream object for key (or an error), starting a fetch
+		// unless one for the same key is already in flight
+
+		inline void fetch(const UpstreamKey& key, waiter_f waiter)
+		{
+			auto found = inflight_.find(key);
+			if (found != inflight_.end())
+			{
+				++collapsed_;
+				found->second.emplace_back(std::move(waiter));
+				return;
+			}
+			
+			inflight_[key].emplace_back(std::move(waiter));
+			++fetches_;
+			fetch_(key, [this, key] (upstream_uptr_t upstream, std::error_code err)
+			{
+				if (executor_)
+				{
+					upstream_ptr_t shared{std::move(upstream)};
+					executor_([this, key, shared, err] ()
+					{
+						complete(key, shared, err);
+					});
+				}
+				else
+				{
+					complete(key, upstream_ptr_t{std::move(upstream)}, err);
+				}
+			});
+		}
+
+		// miss_handler returns a miss handler for a cache of type Cache. upstream_key maps the cache's
+		// key to the key of the upstream object its value is made from; convert makes the value from
+		// the upstream object (returning a null pointer if it can't, which fails the miss with
+		// std::errc::bad_message).
+
+		template<class Cache>
+		typename Cache::miss_handler_f miss_handler(
+			std::function< UpstreamKey (const typename Cache::key_t&) > upstream_key,
+			std::function< typename Cache::value_uptr_t (const typename Cache::key_t&, const Upstream&) > convert)
+		{
+			using key_type = typename Cache::key_t;
+			using reply_type = typename Cache::miss_handler_reply_f;
+			
+			return [this, upstream_key, convert] (const key_type& key, reply_type reply)
+			{
+				fetch(upstream_key(key), [key, convert, reply] (const upstream_ptr_t& upstream, std::error_code err)
+				{
+					if (err || !upstream)
+					{
+						reply(nullptr, err ? err : std::make_error_code(std::errc::bad_message));
+						return;
+					}
+					auto value = convert(key, *upstream);
+					if (!value)
+					{
+						reply(nullptr, std::make_error_code(std::errc::bad_message));
+						return;
+					}
+					reply(std::move(value), std::error_code());
+				});
+			};
+		}
+
+		inline std::size_t inflight() const
+		{
+			return inflight_.size();
+		}
+
+		// fetches is the number of upstream fetches started; collapsed is the number of requests
+		// that joined a fetch already in flight
+
+		inline std::size_t fetches() const
+		{
+			return fetches_;
+		}
+
+		inline std::size_t collapsed() const
+		{
+			return collapsed_;
+		}
+
+	protected:
+
+		inline void complete(const UpstreamKey& key, const upstream_ptr_t& upstream, std::error_code err)
+		{
+			auto found = inflight_.find(key);
+			if (found == inflight_.end())
+			{
+				return;
+			}
+			
+			// The waiters are removed from the map before any of them is invoked, so a waiter
+			// that fetches the same key again starts a new fetch.
+			
+			waiter_list_t waiters{std::move(found->second)};
+			inflight_.erase(found);
+			
+			for (auto& waiter : waiters)
+			{
+				waiter(upstream, err);
+			}
+		}
+
+		fetch_f				fetch_;
+		post_f				executor_;
+		inflight_map_t		inflight_;
+		std::size_t			fetches_;
+		std::size_t			collapsed_;
+	};
+}
+
+#endif /* guard_utils_lru_inflight_group_h */
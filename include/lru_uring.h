@@ -0,0 +1,651 @@
+/*
+MIT License
+
+Copyright © 2016 David Curtis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef guard_utils_lru_uring_h
+#define guard_utils_lru_uring_h
+
+#include "lru_cache.h"
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+namespace utils
+{
+	// uring_loop is a small, single-threaded event loop for Linux, serving file reads with io_uring.
+	// It runs posted tasks, and the completions of reads started with read(), until there is nothing
+	// left to do. Reads started while the loop is running tasks (by miss handlers, for example) are
+	// queued in the submission ring, and submitted together, with one system call, when the tasks have
+	// run; completions are reaped in batches, and their replies invoked on the loop's thread.
+	//
+	// Reads that fit are performed into a pool of fixed buffers, registered with the kernel when the loop
+	// is constructed, so the kernel doesn't have to map the buffer for each read. If buffers can't be
+	// registered (for example, because of RLIMIT_MEMLOCK), the pool is used for ordinary reads, and if
+	// io_uring isn't available at all (is_open() returns false), reads fall back to pread(), performed
+	// by tasks posted to the loop.
+	//
+	// All of the loop's functions must be called on the loop's thread; post() can be used as the
+	// executor of a cache served by the loop.
+
+	class uring_loop
+	{
+	public:
+
+		using task_f = std::function< void () >;
+
+		// The data passed to a read reply is only valid for the duration of the reply. If the end
+		// of the file is reached, size is less than the length requested.
+
+		using read_reply_f = std::function< void (const char* data, std::size_t size, std::error_code err) >;
+
+	protected:
+
+		class read_op
+		{
+		public:
+			int							fd_;
+			std::uint64_t				offset_;
+			std::size_t					length_;
+			std::size_t					done_;
+			int							buffer_;
+			std::unique_ptr<char[]>		heap_;
+			read_reply_f				reply_;
+		};
+
+	public:
+
+		inline uring_loop(unsigned entries = 256, std::size_t buffer_count = 64, std::size_t buffer_size = 64 * 1024)
+		:
+		ring_fd_{-1},
+		sq_ring_{nullptr},
+		sq_ring_size_{0},
+		cq_ring_{nullptr},
+		cq_ring_size_{0},
+		sqes_{nullptr},
+		sq_tail_{0},
+		submitted_tail_{0},
+		buffer_memory_{nullptr},
+		buffer_count_{buffer_count},
+		buffer_size_{buffer_size},
+		buffers_registered_{false},
+		in_flight_{0},
+		submits_{0},
+		completions_{0}
+		{
+			io_uring_params params;
+			std::memset(&params, 0, sizeof(params));
+			ring_fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+			if (ring_fd_ < 0)
+			{
+				return;
+			}
+			
+			if (!map_rings(params))
+			{
+				close_ring();
+				return;
+			}
+			
+			if (buffer_count_ > 0 && ::posix_memalign(&buffer_memory_, 4096, buffer_count_ * buffer_size_) == 0)
+			{
+				std::vector<iovec> iovecs(buffer_count_);
+				for (std::size_t i = 0; i < buffer_count_; ++i)
+				{
+					iovecs[i].iov_base = buffer(static_cast<int>(i));
+					iovecs[i].iov_len = buffer_size_;
+					free_buffers_.push_back(static_cast<int>(i));
+				}
+				buffers_registered_ = ::syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, iovecs.data(), static_cast<unsigned>(iovecs.size())) == 0;
+			}
+			else
+			{
+				buffer_memory_ = nullptr;
+			}
+		}
+
+		inline ~uring_loop()
+		{
+			close_ring();
+			std::free(buffer_memory_);
+		}
+
+		uring_loop(const uring_loop& that) = delete;
+
+		uring_loop& operator=(const uring_loop& that) = delete;
+
+		inline bool is_open() const
+		{
+			return ring_fd_ >= 0;
+		}
+
+		inline bool buffers_registered() const
+		{
+			return buffers_registered_;
+		}
+
+		inline void post(task_f task)
+		{
+			tasks_.emplace_back(std::move(task));
+		}
+
+		// read reads up to length bytes from fd, starting at offset. The reply is invoked by the
+		// loop when the read is complete.
+
+		inline void read(int fd, std::uint64_t offset, std::size_t length, read_reply_f reply)
+		{
+			if (!is_open())
+			{
+				post([fd, offset, length, reply] ()
+				{
+					std::unique_ptr<char[]> data{new char[length]};
+					std::size_t done = 0;
+					while (done < length)
+					{
+						auto result = ::pread(fd, data.get() + done, length - done, static_cast<off_t>(offset + done));
+						if (result < 0 && errno == EINTR)
+						{
+							continue;
+						}
+						if (result < 0)
+						{
+							reply(nullptr, 0, std::error_code(errno, std::system_category()));
+							return;
+						}
+						if (result == 0)
+						{
+							break;
+						}
+						done += static_cast<std::size_t>(result);
+					}
+					reply(data.get(), done, std::error_code());
+				});
+				return;
+			}
+			
+			std::size_t index;
+			if (!free_ops_.empty())
+			{
+				index = free_ops_.back();
+				free_ops_.pop_back();
+			}
+			else
+			{
+				index = ops_.size();
+				ops_.emplace_back();
+			}
+			
+			auto& op = ops_[index];
+			op.fd_ = fd;
+			op.offset_ = offset;
+			op.length_ = length;
+			op.done_ = 0;
+			op.buffer_ = -1;
+			op.reply_ = std::move(reply);
+			if (length <= buffer_size_ && !free_buffers_.empty())
+			{
+				op.buffer_ = free_buffers_.back();
+				free_buffers_.pop_back();
+			}
+			else
+			{
+				op.heap_.reset(new char[length > 0 ? length : 1]);
+			}
+			
+			waiting_.push_back(index);
+			prepare();
+		}
+
+		// run runs tasks and reads until there are none left, and returns the number of
+		// tasks and read completions processed
+
+		inline std::size_t run()
+		{
+			std::size_t count = 0;
+			while (pending() > 0)
+			{
+				count += run_once();
+			}
+			return count;
+		}
+
+		// run_once runs the tasks posted so far, submits the reads they started, and reaps
+		// completions, blocking for at least one if there are no tasks to run
+
+		inline std::size_t run_once()
+		{
+			std::size_t count = run_tasks();
+			prepare();
+			if (is_open() && (sq_tail_ != submitted_tail_ || in_flight_ > 0))
+			{
+				submit(tasks_.empty());
+				count += reap();
+			}
+			return count;
+		}
+
+		inline std::size_t pending() const
+		{
+			return tasks_.size() + waiting_.size() + (sq_tail_ - submitted_tail_) + in_flight_;
+		}
+
+		// submits is the number of io_uring_enter calls made to submit reads or wait for their
+		// completion; completions is the number of read completions reaped
+
+		inline std::size_t submits() const
+		{
+			return submits_;
+		}
+
+		inline std::size_t completions() const
+		{
+			return completions_;
+		}
+
+	protected:
+
+		inline bool map_rings(const io_uring_params& params)
+		{
+			sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+			if (single_mmap)
+			{
+				sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+			}
+			
+			sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+			if (sq_ring_ == MAP_FAILED)
+			{
+				sq_ring_ = nullptr;
+				return false;
+			}
+			
+			if (single_mmap)
+			{
+				cq_ring_ = sq_ring_;
+			}
+			else
+			{
+				cq_ring_ = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+				if (cq_ring_ == MAP_FAILED)
+				{
+					cq_ring_ = nullptr;
+					return false;
+				}
+			}
+			
+			sqes_ = static_cast<io_uring_sqe*>(::mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+			if (sqes_ == MAP_FAILED)
+			{
+				sqes_ = nullptr;
+				return false;
+			}
+			
+			auto sq = static_cast<char*>(sq_ring_);
+			sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+			sq_tail_ptr_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+			sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+			sq_entries_ = params.sq_entries;
+			sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+			sq_tail_ = submitted_tail_ = *sq_tail_ptr_;
+			
+			auto cq = static_cast<char*>(cq_ring_);
+			cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+			cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+			cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+			cq_entries_ = params.cq_entries;
+			cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+			return true;
+		}
+
+		inline void close_ring()
+		{
+			if (sqes_)
+			{
+				::munmap(sqes_, sq_entries_ * sizeof(io_uring_sqe));
+			}
+			if (cq_ring_ && cq_ring_ != sq_ring_)
+			{
+				::munmap(cq_ring_, cq_ring_size_);
+			}
+			if (sq_ring_)
+			{
+				::munmap(sq_ring_, sq_ring_size_);
+			}
+			if (ring_fd_ >= 0)
+			{
+				::close(ring_fd_);
+			}
+			sqes_ = nullptr;
+			cq_ring_ = sq_ring_ = nullptr;
+			ring_fd_ = -1;
+		}
+
+		inline char* buffer(int index) const
+		{
+			return static_cast<char*>(buffer_memory_) + static_cast<std::size_t>(index) * buffer_size_;
+		}
+
+		inline char* data(const read_op& op) const
+		{
+			return op.buffer_ >= 0 ? buffer(op.buffer_) : op.heap_.get();
+		}
+
+		// max_submission caps the length of each submitted read, which the ring's 32-bit length field
+		// (and the kernel's own limit of about 2 GiB per read) couldn't otherwise hold; a longer read
+		// completes short, and the rest is submitted again
+
+		static const std::size_t max_submission = std::size_t{1} << 30;
+
+		// prepare moves waiting reads into the submission ring, as space allows. The number of reads
+		// in the kernel is limited to the size of the completion ring, so completions can't overflow.
+
+		inline void prepare()
+		{
+			while (!waiting_.empty()
+				&& sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) < sq_entries_
+				&& in_flight_ + (sq_tail_ - submitted_tail_) < cq_entries_)
+			{
+				auto index = waiting_.front();
+				waiting_.pop_front();
+				auto& op = ops_[index];
+				
+				auto slot = sq_tail_ & sq_mask_;
+				auto sqe = &sqes_[slot];
+				std::memset(sqe, 0, sizeof(*sqe));
+				sqe->opcode = (op.buffer_ >= 0 && buffers_registered_) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+				sqe->fd = op.fd_;
+				sqe->off = op.offset_ + op.done_;
+				sqe->addr = reinterpret_cast<std::uint64_t>(data(op) + op.done_);
+				sqe->len = static_cast<std::uint32_t>(std::min(op.length_ - op.done_, std::size_t{max_submission}));
+				if (sqe->opcode == IORING_OP_READ_FIXED)
+				{
+					sqe->buf_index = static_cast<std::uint16_t>(op.buffer_);
+				}
+				sqe->user_data = index;
+				sq_array_[slot] = slot;
+				++sq_tail_;
+			}
+		}
+
+		inline void submit(bool wait)
+		{
+			unsigned to_submit = sq_tail_ - submitted_tail_;
+			__atomic_store_n(sq_tail_ptr_, sq_tail_, __ATOMIC_RELEASE);
+			
+			while (true)
+			{
+				++submits_;
+				auto result = ::syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait ? 1u : 0u, wait ? IORING_ENTER_GETEVENTS : 0u, nullptr, 0);
+				if (result >= 0)
+				{
+					submitted_tail_ += static_cast<unsigned>(result);
+					in_flight_ += static_cast<std::size_t>(result);
+					break;
+				}
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				if ((errno == EAGAIN || errno == EBUSY) && in_flight_ > 0)
+				{
+					// out of resources; reap some completions before trying again
+					
+					break;
+				}
+				fail_unsubmitted(std::error_code(errno, std::system_category()));
+				break;
+			}
+		}
+
+		// fail_unsubmitted completes reads the kernel wouldn't accept with the error
+
+		inline void fail_unsubmitted(std::error_code err)
+		{
+			std::vector<std::size_t> failed;
+			for (auto tail = submitted_tail_; tail != sq_tail_; ++tail)
+			{
+				failed.push_back(static_cast<std::size_t>(sqes_[tail & sq_mask_].user_data));
+			}
+			sq_tail_ = submitted_tail_;
+			__atomic_store_n(sq_tail_ptr_, sq_tail_, __ATOMIC_RELEASE);
+			for (auto index : failed)
+			{
+				complete(index, err);
+			}
+		}
+
+		inline std::size_t reap()
+		{
+			std::size_t count = 0;
+			unsigned head = *cq_head_;
+			unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+			
+			// completions are copied out of the ring, and the ring released, before any replies
+			// are invoked, since replies can start new reads
+			
+			reaped_.clear();
+			while (head != tail)
+			{
+				auto& cqe = cqes_[head & cq_mask_];
+				reaped_.emplace_back(static_cast<std::size_t>(cqe.user_data), cqe.res);
+				++head;
+			}
+			__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+			in_flight_ -= reaped_.size();
+			completions_ += reaped_.size();
+			
+			auto batch = std::move(reaped_);
+			for (auto& completion : batch)
+			{
+				auto& op = ops_[completion.first];
+				auto result = completion.second;
+				if (result == -EINTR || result == -EAGAIN)
+				{
+					waiting_.push_back(completion.first);
+				}
+				else if (result < 0)
+				{
+					complete(completion.first, std::error_code(-result, std::system_category()));
+					++count;
+				}
+				else
+				{
+					op.done_ += static_cast<std::size_t>(result);
+					if (result > 0 && op.done_ < op.length_)
+					{
+						// short read; read the rest
+						
+						waiting_.push_back(completion.first);
+					}
+					else
+					{
+						complete(completion.first, std::error_code());
+						++count;
+					}
+				}
+			}
+			batch.clear();
+			reaped_ = std::move(batch);
+			return count;
+		}
+
+		inline void complete(std::size_t index, std::error_code err)
+		{
+			// the reply may start new reads, which can grow ops_, so nothing in ops_ is referenced
+			// while it runs; the op's buffer isn't released until it returns
+			
+			auto reply = std::move(ops_[index].reply_);
+			auto heap = std::move(ops_[index].heap_);
+			auto buffer_index = ops_[index].buffer_;
+			auto done = ops_[index].done_;
+			const char* result = buffer_index >= 0 ? buffer(buffer_index) : heap.get();
+			
+			reply(err ? nullptr : result, err ? 0 : done, err);
+			
+			if (buffer_index >= 0)
+			{
+				free_buffers_.push_back(buffer_index);
+			}
+			free_ops_.push_back(index);
+		}
+
+		inline std::size_t run_tasks()
+		{
+			std::size_t count = 0;
+			std::deque<task_f> tasks;
+			tasks.swap(tasks_);
+			for (auto& task : tasks)
+			{
+				task();
+				++count;
+			}
+			return count;
+		}
+
+		int											ring_fd_;
+		void*										sq_ring_;
+		std::size_t									sq_ring_size_;
+		void*										cq_ring_;
+		std::size_t									cq_ring_size_;
+		io_uring_sqe*								sqes_;
+		unsigned*									sq_head_;
+		unsigned*									sq_tail_ptr_;
+		unsigned*									sq_array_;
+		unsigned									sq_mask_;
+		unsigned									sq_entries_;
+		unsigned									sq_tail_;
+		unsigned									submitted_tail_;
+		unsigned*									cq_head_;
+		unsigned*									cq_tail_;
+		unsigned									cq_mask_;
+		unsigned									cq_entries_;
+		io_uring_cqe*								cqes_;
+		void*										buffer_memory_;
+		std::size_t									buffer_count_;
+		std::size_t									buffer_size_;
+		bool										buffers_registered_;
+		std::vector<int>							free_buffers_;
+		std::vector<read_op>						ops_;
+		std::vector<std::size_t>					free_ops_;
+		std::deque<std::size_t>						waiting_;
+		std::vector<std::pair<std::size_t, int>>	reaped_;
+		std::size_t									in_flight_;
+		std::size_t									submits_;
+		std::size_t									completions_;
+		std::deque<task_f>							tasks_;
+	};
+
+	// uring_file_source is a miss handler adapter for caches whose values are stored in files, one
+	// file per key: the miss handler opens the key's file, reads the whole file with the loop, and
+	// replies with the deserialized value when the read completes. Opening the file (and sizing it
+	// with fstat) is synchronous; the read, which dominates for all but the smallest values, isn't.
+	//
+	//	uring_loop loop;
+	//	uring_file_source<std::string, blob> source(loop, [] (const std::string& key) { return "/data/" + key; }, make_blob);
+	//	lru_cache<std::string, blob> cache(source.miss_handler(), 10000);
+
+	template <class Key, class T, class Hash = std::hash<Key>, class KeyEquals = std::equal_to<Key>>
+	class uring_file_source
+	{
+	public:
+
+		using cache_type = lru_cache<Key, T, Hash, KeyEquals>;
+		using value_uptr_t = typename cache_type::value_uptr_t;
+		using miss_handler_f = typename cache_type::miss_handler_f;
+		using miss_handler_reply_f = typename cache_type::miss_handler_reply_f;
+
+		// path returns the name of the file holding a key's value; deserialize makes a value from
+		// the file's contents (returning a null pointer if it can't)
+
+		using path_f = std::function< std::string (const Key&) >;
+		using deserialize_f = std::function< value_uptr_t (const char* data, std::size_t size) >;
+
+		inline uring_file_source(uring_loop& loop, path_f path, deserialize_f deserialize)
+		:
+		loop_{loop},
+		path_{std::move(path)},
+		deserialize_{std::move(deserialize)}
+		{}
+
+		inline miss_handler_f miss_handler()
+		{
+			return [this] (const Key& key, miss_handler_reply_f reply)
+			{
+				fetch(key, std::move(reply));
+			};
+		}
+
+	protected:
+
+		inline void fetch(const Key& key, miss_handler_reply_f reply)
+		{
+			int fd = ::open(path_(key).c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+			{
+				reply(nullptr, std::error_code(errno, std::system_category()));
+				return;
+			}
+			
+			struct stat status;
+			if (::fstat(fd, &status) != 0)
+			{
+				auto err = std::error_code(errno, std::system_category());
+				::close(fd);
+				reply(nullptr, err);
+				return;
+			}
+			
+			loop_.read(fd, 0, static_cast<std::size_t>(status.st_size), [this, fd, reply] (const char* data, std::size_t size, std::error_code err)
+			{
+				::close(fd);
+				if (err)
+				{
+					reply(nullptr, err);
+					return;
+				}
+				auto value = deserialize_(data, size);
+				if (!value)
+				{
+					reply(nullptr, std::make_error_code(std::errc::bad_message));
+					return;
+				}
+				reply(std::move(value), std::error_code());
+			});
+		}
+
+		uring_loop&			loop_;
+		path_f				path_;
+		deserialize_f		deserialize_;
+	};
+}
+
+#endif /* guard_utils_lru_uring_h */